@@ -0,0 +1,46 @@
+/*
+ * ALIX: `alz.h` -- ALZ compressed image format
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _ALZ_H_
+#define _ALZ_H_
+
+/*
+ * An ALZ image carries a set of extents of some original file, each stored as
+ * an independent LZ4 block (see the LZ4 block format description:
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+ *
+ * Images are produced by `tools/alzpack`. For an Elf kernel there is one
+ * extent for the Elf header and program headers and one per loadable
+ * segment, so the bootloader can unpack every segment straight into its
+ * destination pages. Any other file is stored as a single extent.
+ *
+ * Layout: `struct alz_hdr`, then `nblk` of `struct alz_blk`, then the
+ * compressed data. All fields are little endian.
+ */
+
+#define ALZ_MAGIC	0x345A4C41	/* "ALZ4" */
+
+typedef struct {
+
+	uint32_t	magic;		/* ALZ_MAGIC */
+	uint32_t	nblk;		/* number of extents that follow */
+	uint64_t	rawsz;		/* size of the original file */
+
+} Alz_hdr;
+
+typedef struct {
+
+	uint64_t	off;		/* offset of extent in original file */
+	uint64_t	rawsz;		/* size of extent in original file */
+	uint64_t	zoff;		/* offset of LZ4 block in this image */
+	uint64_t	zsz;		/* size of LZ4 block */
+
+} Alz_blk;
+
+#endif /* _ALZ_H_ */
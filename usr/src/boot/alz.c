@@ -0,0 +1,138 @@
+/*
+ * ALIX: `boot/alz.c` -- ALIX bootloader (x86-64 EFI), ALZ/LZ4 decompression
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <alz.h>
+
+/*
+ * Reading from boot media through the firmware is slow. The kernel and font
+ * may be stored as ALZ images (see `alz.h`) which are unpacked here directly
+ * into their destination memory.
+ */
+
+/*
+ * Decode one LZ4 block of `srcsz` bytes at `src` into `dst`, which has room
+ * for `dstsz` bytes. Returns the number of bytes produced or -1 if the block
+ * is malformed or would overflow `dst`.
+ */
+int64_t
+lz4_decode(uintptr_t dst, uint64_t dstsz, uintptr_t src, uint64_t srcsz)
+{
+	uint8_t *ip, *iend, *op, *oend, *match;
+	uint64_t len, off;
+	uint8_t token, b;
+
+	ip = (uint8_t *) src;
+	iend = ip + srcsz;
+	op = (uint8_t *) dst;
+	oend = op + dstsz;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literals */
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (uint64_t) (iend - ip) || len > (uint64_t) (oend - op))
+			return -1;
+
+		if (len >= 8 && (((uintptr_t) op | (uintptr_t) ip) & 7) == 0) {
+			for (; len >= 8; len -= 8, op += 8, ip += 8)
+				*(uint64_t *) op = *(uint64_t *) ip;
+		}
+		for (; len > 0; len--)
+			*op++ = *ip++;
+
+		/* Last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* Match */
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ((uint64_t) ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (uint64_t) (op - (uint8_t *) dst))
+			return -1;
+		match = op - off;
+
+		len = (token & 0xF) + 4;
+		if ((token & 0xF) == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (uint64_t) (oend - op))
+			return -1;
+
+		/* Matches may overlap the output, copy forward */
+		if (off >= 8) {
+			for (; len >= 8; len -= 8, op += 8, match += 8)
+				*(uint64_t *) op = *(uint64_t *) match;
+		}
+		for (; len > 0; len--)
+			*op++ = *match++;
+	}
+
+	return op - (uint8_t *) dst;
+}
+
+/*
+ * Returns the extent of ALZ image `hdr` (`sz` bytes in memory) beginning at
+ * `off`, NULL if none or if the extent table runs past the image.
+ */
+Alz_blk *
+alz_find(Alz_hdr *hdr, uint64_t sz, uint64_t off)
+{
+	Alz_blk *blk;
+	uint32_t i;
+
+	if (sz < sizeof(Alz_hdr)
+	    || hdr->nblk > (sz - sizeof(Alz_hdr)) / sizeof(Alz_blk))
+		return NULL;
+
+	blk = (Alz_blk *) (hdr + 1);
+	for (i = 0; i < hdr->nblk; i++) {
+		if (blk[i].off == off)
+			return &blk[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Unpack extent `blk` of ALZ image `hdr` (`sz` bytes in memory) to `dst`.
+ * Returns 0 on success, -1 if the image is damaged.
+ */
+int
+alz_unpack(Alz_hdr *hdr, uint64_t sz, Alz_blk *blk, uintptr_t dst)
+{
+	int64_t n;
+
+	if (blk->zoff > sz || blk->zsz > sz - blk->zoff)
+		return -1;
+
+	n = lz4_decode(dst, blk->rawsz, (uintptr_t) hdr + blk->zoff, blk->zsz);
+	if (n < 0 || (uint64_t) n != blk->rawsz)
+		return -1;
+
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <stddef.h>
 
 #include <efi.h>
+#include <alz.h>
 #include <sys/kargtab.h>
 
 /* EFI console macros */
@@ -36,6 +37,15 @@
 /* Enter load phase in `load.c` */
 extern void			load(void);
 
+/* From `alz.c` */
+extern Alz_blk *		alz_find(Alz_hdr *hdr, uint64_t sz,
+					uint64_t off);
+extern int			alz_unpack(Alz_hdr *hdr, uint64_t sz,
+					Alz_blk *blk, uintptr_t dst);
+
+/* From `er.s`, returns the time stamp counter */
+extern uint64_t			tscread(void);
+
 /* EFI handles, protocols, other data structures */
 Efi_system_table *		systab;		/* EFI system table */
 Efi_handle 			imghan;		/* EFI app image handle */
@@ -45,6 +55,7 @@ Efi_file_protocol *		filesys;	/* root of filesystem */
 Efi_file_protocol *		kfile;		/* kernel file handle */
 Efi_graphics_output_protocol *	gop;		/* Graphics Output Protocol */
 uint64_t			mmapkey;	/* EFI mmap key */
+char *				cfg;		/* alix.cfg, NUL terminated */
 
 /*
  * Kernel argument table: Data and pointers required by the kernel.
@@ -76,13 +87,34 @@ printh(uint64_t value)
 	print(hex);
 }
 
-/* Zero memory from and to. */
+/* Zero memory from and to (inclusive), 8 bytes at a time where possible. */
 void
 memzero(uintptr_t from, uintptr_t to)
 {
-	for (; from <= to; from++) {
-		*((uint8_t*) from) = 0;
+	for (; from <= to && (from & 7) != 0; from++)
+		*((uint8_t *) from) = 0;
+
+	for (; from + 7 <= to; from += 8)
+		*((uint64_t *) from) = 0;
+
+	for (; from <= to; from++)
+		*((uint8_t *) from) = 0;
+}
+
+/* Copy `sz` bytes from `src` to `dst`, 8 bytes at a time where possible. */
+void
+memcopy(uintptr_t dst, uintptr_t src, uint64_t sz)
+{
+	if (((dst ^ src) & 7) == 0) {
+		for (; sz > 0 && (dst & 7) != 0; sz--)
+			*((uint8_t *) dst++) = *((uint8_t *) src++);
+
+		for (; sz >= 8; sz -= 8, dst += 8, src += 8)
+			*((uint64_t *) dst) = *((uint64_t *) src);
 	}
+
+	for (; sz > 0; sz--)
+		*((uint8_t *) dst++) = *((uint8_t *) src++);
 }
 
 /* Allocate requested amount of (contiguous) pages. */
@@ -94,7 +126,7 @@ palloc(int count)
 
 	s = bootsrv->allocate_pages(
 		Efi_allocate_any_pages,
-		Efi_runtime_services_data,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
 		count,
 		&ptr
 	);
@@ -104,6 +136,41 @@ palloc(int count)
 	return ptr;
 }
 
+/* Returns the size in bytes of an open file. */
+uint64_t
+fsize(Efi_file_protocol *f)
+{
+	Efi_status s;
+	Efi_guid guid;
+	Efi_file_info *info;
+	uint64_t sz;
+
+	guid = EFI_FILE_INFO_ID;
+	sz = 0;
+	info = NULL;
+	f->get_info(f, &guid, &sz, (void *) info);
+	s = bootsrv->allocate_pool(
+		Efi_loader_data,
+		sz,
+		(void **) &info
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Memory allocation fail");
+
+	s = f->get_info(
+		f,
+		&guid,
+		&sz,
+		(void *) info
+	);
+	if (s!= EFI_SUCCESS)
+		fatal(L"Failed file access");
+	sz = info->file_size;
+
+	bootsrv->free_pool(info);
+	return sz;
+}
+
 /* Initializes boot media filesystem access */
 static void
 filesys_init()
@@ -169,11 +236,13 @@ static void
 find_font()
 {
 	Efi_status s;
-	Efi_guid guid;
 	Efi_file_protocol *d, *f;
-	Efi_file_info *info;
-	uint64_t sz;
-	uintptr_t pgs;
+	Alz_hdr *hdr;
+	Alz_blk *blk;
+	uint64_t sz, start;
+	uintptr_t pgs, raw;
+
+	start = tscread();
 
 	/* Find font file */
 	s = filesys->open(
@@ -186,40 +255,29 @@ find_font()
 	if (s != EFI_SUCCESS)
 		fatal(L"Failed to locate kernel console font on boot media");
 
+	/* Prefer a compressed font image if one is present */
 	s = d->open(
 		d,
 		&f,
-		(int16_t *) L"spleen-8x16.psfu",
+		(int16_t *) L"spleen-8x16.psfu.alz",
 		EFI_FILE_MODE_READ,
 		0
 	);
+	if (s != EFI_SUCCESS)
+		s = d->open(
+			d,
+			&f,
+			(int16_t *) L"spleen-8x16.psfu",
+			EFI_FILE_MODE_READ,
+			0
+		);
 	if (s != EFI_SUCCESS)
 		fatal(L"Failed to locate kernel console font on boot media");
 
 	println(L"Located kernel console font on boot media");
 	
 	/* Determine file size */
-	guid = EFI_FILE_INFO_ID;
-	sz = 0;
-	info = NULL;
-	f->get_info(f, &guid, &sz, (void *) info);
-	s = bootsrv->allocate_pool(
-		Efi_runtime_services_data,
-		sz,
-		(void **) &info
-	);
-	if (s != EFI_SUCCESS)
-		fatal(L"Memory allocation fail");
-
-	s = f->get_info(
-		f,
-		&guid,
-		&sz,
-		(void *) info
-	);
-	if (s!= EFI_SUCCESS)
-		fatal(L"Failed font file access");
-	sz = info->file_size;
+	sz = fsize(f);
 
 	/* allocate pages and read file */
 	pgs = palloc((sz / 0x1000) + 1);
@@ -233,8 +291,244 @@ find_font()
 		fatal(L"Failed to read font from boot media");
 
 	println(L"Font read from boot media");
+	kargtab.font_fsz = sz;
+
+	/* Unpack compressed font into its final pages */
+	hdr = (Alz_hdr *) pgs;
+	if (sz >= sizeof(Alz_hdr) && hdr->magic == ALZ_MAGIC) {
+		blk = alz_find(hdr, sz, 0);
+		if (blk == NULL || blk->rawsz != hdr->rawsz)
+			fatal(L"Invalid compressed font image");
+
+		raw = palloc((hdr->rawsz / 0x1000) + 1);
+		if (alz_unpack(hdr, sz, blk, raw) != 0)
+			fatal(L"Failed to unpack compressed font image");
+
+		bootsrv->free_pages(pgs, (sz / 0x1000) + 1);
+		pgs = raw;
+		sz = blk->rawsz;
+	}
+
 	kargtab.font_base = (uintptr_t) pgs;
 	kargtab.font_size = sz;
+	kargtab.font_tsc = tscread() - start;
+}
+
+/*
+ * Load the optional initial ramdisk archive `initrd` with a single read into
+ * contiguous pages. The kernel uses it in place.
+ */
+static void
+find_initrd(void)
+{
+	Efi_status s;
+	Efi_file_protocol *f;
+	uint64_t sz;
+	uintptr_t pgs;
+
+	kargtab.initrd_base = 0;
+	kargtab.initrd_size = 0;
+
+	s = filesys->open(
+		filesys,
+		&f,
+		(int16_t *) L"initrd",
+		EFI_FILE_MODE_READ,
+		0
+	);
+	if (s != EFI_SUCCESS)
+		return;
+
+	sz = fsize(f);
+	if (sz == 0)
+		return;
+
+	pgs = palloc((sz / 0x1000) + 1);
+	s = f->read(
+		f,
+		&sz,
+		(void *) pgs
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to read initrd from boot media");
+
+	println(L"Initial ramdisk read from boot media");
+	kargtab.initrd_base = pgs;
+	kargtab.initrd_size = sz;
+}
+
+/*
+ * Read the optional bootloader configuration file `alix.cfg`. It holds lines
+ * of `key=value`, lines starting with '#' are comments. Settings:
+ *	gop=native	largest video mode available
+ *	gop=max:N	largest video mode with at most N pixels
+ *	gop=WxH		exactly W by H pixels
+ * Without a `gop` setting the mode the firmware set is kept.
+ */
+static void
+config_init(void)
+{
+	Efi_status s;
+	Efi_file_protocol *f;
+	uint64_t sz;
+
+	s = filesys->open(
+		filesys,
+		&f,
+		(int16_t *) L"alix.cfg",
+		EFI_FILE_MODE_READ,
+		0
+	);
+	if (s != EFI_SUCCESS)
+		return;
+
+	sz = fsize(f);
+	s = bootsrv->allocate_pool(
+		Efi_loader_data,
+		sz + 1,
+		(void **) &cfg
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Memory allocation fail");
+
+	s = f->read(
+		f,
+		&sz,
+		(void *) cfg
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to read alix.cfg from boot media");
+	cfg[sz] = '\0';
+
+	println(L"Read configuration from boot media");
+}
+
+/*
+ * Look up `key` in the configuration, copying its value to `val` (at most
+ * `valsz` bytes including the terminator). Returns 0 if found, -1 otherwise.
+ */
+static int
+config_get(const char *key, char *val, int valsz)
+{
+	char *line;
+	const char *k;
+	int i;
+
+	if (cfg == NULL)
+		return -1;
+
+	for (line = cfg; *line != '\0'; ) {
+		while (*line == ' ' || *line == '\t')
+			line++;
+
+		for (k = key; *k != '\0' && *line == *k; k++, line++)
+			;
+		if (*k == '\0' && *line == '=') {
+			line++;
+			for (i = 0; i < valsz - 1 && *line != '\0'
+			&& *line != '\r' && *line != '\n' && *line != ' '
+			&& *line != '\t'; i++)
+				val[i] = *line++;
+			val[i] = '\0';
+			return 0;
+		}
+
+		while (*line != '\0' && *line != '\n')
+			line++;
+		if (*line == '\n')
+			line++;
+	}
+
+	return -1;
+}
+
+/* Returns `str` past `prefix` if it starts with it, NULL otherwise */
+static const char *
+skip(const char *str, const char *prefix)
+{
+	for (; *prefix != '\0'; str++, prefix++) {
+		if (*str != *prefix)
+			return NULL;
+	}
+
+	return str;
+}
+
+/* Parse a decimal number, advancing `str` past it */
+static uint64_t
+atou(const char **str)
+{
+	uint64_t v;
+
+	for (v = 0; **str >= '0' && **str <= '9'; (*str)++)
+		v = (v * 10) + (**str - '0');
+
+	return v;
+}
+
+/*
+ * Pick a video mode according to the `gop` setting. Only modes with a
+ * linear 32-bit RGB/BGR framebuffer, which is what the kernel drives, are
+ * considered. Returns the mode number, or the current mode if nothing fits.
+ */
+static uint32_t
+gop_pick(void)
+{
+	Efi_status s;
+	Efi_graphics_output_mode_information *info;
+	uint64_t sz, px, bestpx, limit, w, h;
+	uint32_t i, best;
+	const char *p;
+	char policy[32];
+
+	best = gop->mode->mode;
+	if (config_get("gop", policy, sizeof(policy)) != 0)
+		return best;
+
+	/* `max:N` and `native` (no limit) pick the largest mode that fits */
+	w = h = 0;
+	limit = 0;
+	if ((p = skip(policy, "max:")) != NULL) {
+		limit = atou(&p);
+	} else if (policy[0] >= '0' && policy[0] <= '9') {
+		p = policy;
+		w = atou(&p);
+		if (*p++ != 'x')
+			return best;
+		h = atou(&p);
+	} else if ((p = skip(policy, "native")) == NULL || *p != '\0') {
+		println(L"Unknown gop policy in alix.cfg, keeping video mode");
+		return best;
+	}
+
+	bestpx = 0;
+	for (i = 0; i < gop->mode->max_mode; i++) {
+		s = gop->query_mode(gop, i, &sz, &info);
+		if (s != EFI_SUCCESS)
+			continue;
+		if (info->pixel_format != PixelRedGreenBlueReserved8BitPerColor
+		&& info->pixel_format != PixelBlueGreenRedReserved8BitPerColor) {
+			bootsrv->free_pool(info);
+			continue;
+		}
+
+		px = (uint64_t) info->horizontal_resolution
+			* info->vertical_resolution;
+		if (w != 0 && info->horizontal_resolution == w
+		&& info->vertical_resolution == h) {
+			bootsrv->free_pool(info);
+			return i;
+		}
+		bootsrv->free_pool(info);
+		if (w != 0 || (limit != 0 && px > limit))
+			continue;
+		if (px > bestpx) {
+			bestpx = px;
+			best = i;
+		}
+	}
+
+	return best;
 }
 
 /* Initialize Graphics Output Protocol. Populate entries in `kargtab`. */
@@ -243,6 +537,7 @@ gop_init(void)
 {
 	Efi_guid guid;
 	Efi_status s;
+	uint32_t mode;
 
 	guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
 	s = bootsrv->locate_protocol(
@@ -253,11 +548,38 @@ gop_init(void)
 	if (s != EFI_SUCCESS)
 		fatal(L"Failed to access Graphics Output Protocol");
 
+	mode = gop_pick();
+	if (mode != gop->mode->mode) {
+		s = gop->set_mode(gop, mode);
+		if (s != EFI_SUCCESS)
+			println(L"Failed to set video mode, keeping current");
+	}
+
 	kargtab.gop_mode = (uintptr_t) gop->mode;
 
 	println(L"Initialized Graphics Output Protocol");
 }
 
+/*
+ * Calibrate the TSC against the firmware's stall service, which is good to
+ * a microsecond. A 1 ms window keeps the cost to boot time small.
+ */
+static void
+tsc_calibrate(void)
+{
+	uint64_t start;
+
+	start = tscread();
+	bootsrv->stall(1000);
+	kargtab.tsc_khz = tscread() - start;
+}
+
+/* Spare descriptors a fetched memory map has room for */
+#define MMAP_SLACK 8
+
+static uint64_t		mmap_cap;	/* Size of the buffer at
+					   `kargtab.mmap` */
+
 /* Retrieve the EFI memory map. Populate entry in `kargtab`. */
 void
 getmmap()
@@ -270,6 +592,12 @@ getmmap()
 
 	mmap = NULL;
 
+	/* Drop a previously fetched copy */
+	if (kargtab.mmap != 0) {
+		bootsrv->free_pool((void *) kargtab.mmap);
+		kargtab.mmap = 0;
+	}
+
 	sz = 0;
 	s = bootsrv->get_memory_map(
 		&sz,
@@ -279,14 +607,16 @@ getmmap()
 		&ver
 	);
 
-	sz += (dsz * 2);
+	/* Allocating may split a descriptor, `regetmmap()` needs more room */
+	sz += (dsz * MMAP_SLACK);
 	s = bootsrv->allocate_pool(
-		Efi_runtime_services_data,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
 		sz,
 		(void **) &mmap
 	);
 	if (s != EFI_SUCCESS)
 		fatal(L"Failed to allocate memory for EFI memory map");
+	mmap_cap = sz;
 
 	s = bootsrv->get_memory_map(
 		&sz,
@@ -303,11 +633,154 @@ getmmap()
 	kargtab.mmap_dsz = (uint64_t) dsz;
 }
 
+/*
+ * Retrieve the EFI memory map again into the buffer `getmmap()` allocated.
+ * After a failed `exit_boot_services()` this is the only boot service that
+ * may be called before the next attempt.
+ */
+void
+regetmmap(void)
+{
+	Efi_status s;
+	uint64_t sz, dsz;
+	uint32_t ver;
+
+	sz = mmap_cap;
+	s = bootsrv->get_memory_map(
+		&sz,
+		(Efi_memory_descriptor *) kargtab.mmap,
+		&mmapkey,
+		&dsz,
+		&ver
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to obtain EFI memory map");
+
+	kargtab.mmap_sz = (uint64_t) sz;
+	kargtab.mmap_dsz = (uint64_t) dsz;
+}
+
+/* Spare compact memory map entries for descriptors added after sizing */
+#define KMMAP_SLACK 32
+
+static struct kmmap *	kmmap;		/* Compact memory map */
+static uint64_t		kmmap_max;	/* 	-capacity in entries */
+
+/*
+ * Reserve room for the compact memory map, sized from the last fetched EFI
+ * memory map, since `kmmap_build()` runs after boot services are gone.
+ * Returns 0 if the current reservation already fits that map, else 1:
+ * allocating changed the EFI map, which has to be fetched again.
+ */
+int
+kmmap_alloc(void)
+{
+	Efi_status s;
+	uint64_t n;
+
+	n = kargtab.mmap_sz / kargtab.mmap_dsz;
+	if (kmmap != NULL && n <= kmmap_max)
+		return 0;
+	if (kmmap != NULL)
+		bootsrv->free_pool(kmmap);
+
+	kmmap_max = n + KMMAP_SLACK;
+	s = bootsrv->allocate_pool(
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		kmmap_max * sizeof(struct kmmap),
+		(void **) &kmmap
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to allocate memory for memory map");
+
+	return 1;
+}
+
+/* Classify an EFI memory type for the compact memory map */
+static uint32_t
+kmm_type(uint32_t type)
+{
+	switch (type) {
+	case Efi_conventional_memory:
+		return KMM_USABLE;
+	case Efi_loader_code:
+	case Efi_loader_data:
+	case Efi_boot_services_code:
+	case Efi_boot_services_data:
+		return KMM_BOOT;
+	case Efi_runtime_services_code:
+	case Efi_runtime_services_data:
+		return KMM_RUNTIME;
+	case ALIX_MEMORY_TYPE:
+		return KMM_KERNEL;
+	case Efi_ACPI_reclaim_memory:
+		return KMM_ACPI;
+	case Efi_ACPI_memoryNVS:
+		return KMM_ACPI_NVS;
+	case Efi_memory_mapped_IO:
+	case Efi_memory_mapped_IO_port_space:
+		return KMM_MMIO;
+	default:
+		return KMM_RESERVED;
+	}
+}
+
+/*
+ * Build the compact memory map from the final EFI memory map: insertion
+ * sort by address (firmware maps are nearly always sorted already, making
+ * this linear), then merge neighbours of equal type and attributes.
+ */
+void
+kmmap_build(void)
+{
+	Efi_memory_descriptor *d;
+	struct kmmap e;
+	uintptr_t p;
+	uint64_t n, i, j;
+
+	n = 0;
+	for (p = kargtab.mmap; p < kargtab.mmap + kargtab.mmap_sz;
+			p += kargtab.mmap_dsz) {
+		/* Only if the map grew past the slack on a retry */
+		if (n == kmmap_max) {
+			kargtab.kmmap_lost++;
+			continue;
+		}
+
+		d = (Efi_memory_descriptor *) p;
+		e.base = d->physical_start;
+		e.size = d->number_of_pages * 0x1000;
+		e.type = kmm_type(d->type);
+		e.pad = 0;
+		e.attr = d->attribute;
+
+		for (i = n; i > 0 && kmmap[i - 1].base > e.base; i--)
+			kmmap[i] = kmmap[i - 1];
+		kmmap[i] = e;
+		n++;
+	}
+
+	for (i = 0, j = 1; j < n; j++) {
+		if (kmmap[i].base + kmmap[i].size == kmmap[j].base
+		&& kmmap[i].type == kmmap[j].type
+		&& kmmap[i].attr == kmmap[j].attr) {
+			kmmap[i].size += kmmap[j].size;
+			continue;
+		}
+		kmmap[++i] = kmmap[j];
+	}
+
+	kargtab.kmmap = (uintptr_t) kmmap;
+	kargtab.kmmap_n = (n > 0) ? i + 1 : 0;
+}
+
 void
 boot(Efi_handle img_handle, Efi_system_table *st)
 {
 	Efi_status s;
 
+	kargtab.timeline[TL_ENTRY] = tscread();
+
 	imghan = img_handle;
 	systab = st;
 	bootsrv = systab->boot_services;
@@ -316,11 +789,23 @@ boot(Efi_handle img_handle, Efi_system_table *st)
 	println(L"ALIX Bootloader...");
 	
 	filesys_init();	/* Access boot media filesystem */
+	config_init();	/* Read optional bootloader configuration */
+	kargtab.timeline[TL_FILESYS] = tscread();
 	find_kernel();	/* Locate kernel on boot media */
+	kargtab.timeline[TL_KERNEL] = tscread();
 	find_font();	/* Locate and load kernel console font */
+	kargtab.timeline[TL_FONT] = tscread();
+	find_initrd();	/* Load initial ramdisk if present */
+	kargtab.timeline[TL_INITRD] = tscread();
 	gop_init();	/* Initialize GOP and obtain framebuffer */
+	kargtab.timeline[TL_GOP] = tscread();
+
+	tsc_calibrate();
+	kargtab.timeline[TL_TSC] = tscread();
 
 	kargtab.runtime_srv = (uintptr_t) systab->runtime_services;
+	kargtab.efi_cfg = systab->configuration_table;
+	kargtab.efi_cfg_n = systab->number_of_table_entries;
 
 	/* Enter kernel load phase */
 	load();
@@ -12,7 +12,9 @@
 
 #include <elf.h>
 #include <efi.h>
+#include <alz.h>
 #include <sys/kargtab.h>
+#include <sys/x64/page.h>
 
 /* EFI console macros */
 #define print(string) systab->console_out->output_string(systab->console_out,\
@@ -25,8 +27,14 @@
 /* From `boot.c` */
 extern void 				printh(uint64_t value);
 extern void 				memzero(uintptr_t from, uintptr_t to);
+extern void				memcopy(uintptr_t dst, uintptr_t src,
+						uint64_t sz);
+extern uint64_t				fsize(Efi_file_protocol *f);
 extern uintptr_t			palloc(int count);
-extern int 				getmmap(void);
+extern void 				getmmap(void);
+extern void				regetmmap(void);
+extern int				kmmap_alloc(void);
+extern void				kmmap_build(void);
 
 extern Efi_system_table *		systab;	/* EFI system table */
 extern Efi_handle			imghan; /* EFI app image handle */
@@ -36,23 +44,32 @@ extern Efi_graphics_output_protocol *	gop;    /* Graphics Output Protocol */
 extern uint64_t				mmapkey;/* EFI mmap key */
 extern struct kargtab 			kargtab;/* Kernel argument table */
 
+/* From `alz.c` */
+extern Alz_blk *			alz_find(Alz_hdr *hdr, uint64_t sz,
+						uint64_t off);
+extern int				alz_unpack(Alz_hdr *hdr, uint64_t sz,
+						Alz_blk *blk, uintptr_t dst);
+
 /* From `er.s` */
 
-/*
- * Gets access to paging, required to map the kernel.
- * - Ensures bit #16 of `cr0` is disabled.
- * - Returns the value of `cr3`
- */
-extern uintptr_t 			pgaccess();
+/* Returns the time stamp counter */
+extern uint64_t				tscread(void);
+
+/* Executes `cpuid` for `leaf`/`subleaf`, eax..edx are stored to `regs` */
+extern void				cpuinfo(uint32_t leaf, uint32_t subleaf,
+						uint32_t *regs);
 
 /*
  * Epilogue to the whole bootloader, the last phase.
- * - Clears paging cache so our kernel mapping takes effect
+ * - records the handoff TSC stamp at `tl`
+ * - Switches to the kernel's page tables at `cr3`
  * - Transitions from shitty EFI ABI to SysV ABI
- * - setup stack
+ * - Switches to the kernel's own stack at `stack`
  * - pass appropriate arguments to kernel entry and call it
  */
-extern void				er(uintptr_t entry, uintptr_t kargtab);
+extern void				er(uintptr_t entry, uintptr_t kargtab,
+						uint64_t *tl, uintptr_t cr3,
+						uintptr_t stack);
 
 /*
  * Second phase of bootloader:
@@ -62,75 +79,126 @@ extern void				er(uintptr_t entry, uintptr_t kargtab);
  *  - Call kernel and pass it arguments
  */
 
+/* Kernel binary, read whole into memory with a single read */
+static uintptr_t kimg;		/* Base of image, 2 MiB aligned */
+static uint64_t kimg_sz;	/* Size of image in bytes */
+static Alz_hdr *kalz;		/* Image as ALZ, NULL if not compressed */
+
+/* Elf header and program headers, in the image or unpacked from it */
+static uintptr_t khdr;
+static uint64_t khdr_sz;
+
 /* ELF header structures used for parsing kernel executable */
-static Elf64_Ehdr ehdr;         /* Elf header */
+static Elf64_Ehdr *ehdr;        /* Elf header */
 static Elf64_Phdr *phdrs;       /* Program headers */
 
-/* Fresh PDPT used to map the kernel (pointer later inserted in PML4) */
-static uint64_t *pdpt;
+/*
+ * Kernel owned PML4 built from scratch: the higher half kernel, a direct map
+ * of physical memory at `DMAP_BASE` and, sharing the direct map's tables, an
+ * identity map of the same range for the handoff and firmware runtime calls.
+ */
+static uint64_t *pml4;
+
+static uintptr_t kpalloc(uintptr_t virt, uint64_t count);
 
-/* Reads Elf program headers */
+/*
+ * Read the entire kernel binary into memory. Boot media reads are slow, so
+ * this is the one and only read of `kfile`; everything after this parses the
+ * image in memory.
+ */
 static void
-read_phdrs(void)
+read_kernel(void)
 {
 	Efi_status s;
-	uint64_t bufsz;
+	uint64_t sz;
 
-	bufsz = ehdr.e_phentsize * ehdr.e_phnum;
-	s = bootsrv->allocate_pool(
-		Efi_loader_data,
-		bufsz,
-		(void **) &phdrs
-	);
-	if (s != EFI_SUCCESS)
-		fatal(L"Failed pool allocation");
+	kimg_sz = fsize(kfile);
+	if (kimg_sz < sizeof(Elf64_Ehdr))
+		fatal(L"Kernel binary is truncated");
+
+	/* Aligned to 2 MiB so in place segments may still use large pages */
+	kimg = kpalloc(0, (kimg_sz + PAGE_MASK) / PAGE_SIZE);
 
-	kfile->set_position(kfile, ehdr.e_phoff);
+	sz = kimg_sz;
 	s = kfile->read(
 		kfile,
-		&bufsz,
-		phdrs
+		&sz,
+		(void *) kimg
 	);
-	if (s != EFI_SUCCESS)
+	if (s != EFI_SUCCESS || sz != kimg_sz)
 		fatal(L"Failed file read on kernel binary");
 }
 
-/* Reads the Elf header */
+/* Locates and checks the Elf program headers */
+static void
+read_phdrs(void)
+{
+	if (ehdr->e_phentsize != sizeof(Elf64_Phdr))
+		fatal(L"Invalid Elf program header size in kernel binary");
+
+	if (ehdr->e_phoff + (ehdr->e_phentsize * ehdr->e_phnum) > khdr_sz)
+		fatal(L"Kernel binary is truncated");
+
+	phdrs = (Elf64_Phdr *) (khdr + ehdr->e_phoff);
+}
+
+/*
+ * Locates and checks the Elf header. A compressed (ALZ) kernel image carries
+ * the Elf header and program headers as the extent at offset 0, which is
+ * unpacked to a buffer of its own.
+ */
 static void
 read_ehdr(void)
 {
 	Efi_status s;
-	uint64_t bufsz;
+	Alz_blk *blk;
 
-	bufsz = sizeof(Elf64_Ehdr);
-	s = kfile->read(
-		kfile,
-		&bufsz,
-		&ehdr
-	);
-	if (s != EFI_SUCCESS)
-		fatal(L"Failed file read on kernel binary");
+	khdr = kimg;
+	khdr_sz = kimg_sz;
+
+	if (kimg_sz >= sizeof(Alz_hdr)
+	    && ((Alz_hdr *) kimg)->magic == ALZ_MAGIC) {
+		kalz = (Alz_hdr *) kimg;
+
+		blk = alz_find(kalz, kimg_sz, 0);
+		if (blk == NULL || blk->rawsz < sizeof(Elf64_Ehdr))
+			fatal(L"Invalid compressed kernel image");
+
+		s = bootsrv->allocate_pool(
+			Efi_loader_data,
+			blk->rawsz,
+			(void **) &khdr
+		);
+		if (s != EFI_SUCCESS)
+			fatal(L"Failed pool allocation");
+
+		if (alz_unpack(kalz, kimg_sz, blk, khdr) != 0)
+			fatal(L"Failed to unpack compressed kernel image");
+		khdr_sz = blk->rawsz;
+	}
+
+	ehdr = (Elf64_Ehdr *) khdr;
 
 	/*
-	 * After reading Elf header perform checks on the data, make sure this
-	 * is a valid executable for our kernel
+	 * Perform checks on the Elf header, make sure this is a valid
+	 * executable for our kernel
 	 */
-	if ((ehdr.e_ident[EI_MAG0] != ELFMAG0)
-	|| (ehdr.e_ident[EI_MAG1] != ELFMAG1)
-	|| (ehdr.e_ident[EI_MAG2] != ELFMAG2)
-	|| (ehdr.e_ident[EI_MAG3] != ELFMAG3))
+	if ((ehdr->e_ident[EI_MAG0] != ELFMAG0)
+	|| (ehdr->e_ident[EI_MAG1] != ELFMAG1)
+	|| (ehdr->e_ident[EI_MAG2] != ELFMAG2)
+	|| (ehdr->e_ident[EI_MAG3] != ELFMAG3))
 		fatal(L"Invalid Elf magic number in kernel binary");
 
-	if (ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+	if (ehdr->e_ident[EI_CLASS] != ELFCLASS64)
 		fatal(L"Invalid Elf class in kernel binary");
 
-	if (ehdr.e_ident[EI_DATA] != ELFDATA2LSB)
+	if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB)
 		fatal(L"Invalid Elf data type in kernel binary");
 
-	if (ehdr.e_type != ET_EXEC)
+	if (ehdr->e_type != ET_EXEC)
 		fatal(L"Invalid Elf object type in kernel binary");
 
-	if (ehdr.e_machine != EM_X86_64)
+	if (ehdr->e_machine != EM_X86_64)
 		fatal(L"Invalid Elf machine type in kernel binary");
 }
 
@@ -139,7 +207,6 @@ static uint64_t *
 pagetab_next(uint64_t *currtab, uint16_t index)
 {
 	uintptr_t ptr;
-	uintptr_t page;
 
 	ptr = (uintptr_t) currtab[index];
 
@@ -153,29 +220,36 @@ pagetab_next(uint64_t *currtab, uint16_t index)
 		ptr = palloc(1);
 		if (ptr == 0)
 			return NULL;
-		memzero(ptr, ptr + (0x1000));
-		currtab[index] = ptr | 3; /* Present, R/W */
+		memzero(ptr, ptr + PAGE_MASK);
+		currtab[index] = ptr | PTE_P | PTE_W;
 	}
 
+	/* A large page already covers this range, there is no table below */
+	if (ptr & PTE_PS)
+		return NULL;
+
 	/* Clear flags if present for, sanitize address */
-	ptr = ((ptr >> 12) & 0x7FFFFFFFFF) << 12;
-	return (uint64_t *) ptr;
+	return (uint64_t *) (ptr & PTE_ADDR);
 }
 
-/* Map virtual addy to physical addy. */
+/* Number of 2 MiB and 4 KiB mappings made so far */
+static uint64_t nlarge, nsmall;
+
+/* Map a single 4 KiB page, virtual addy to physical addy. */
 static void
-mapaddr(uintptr_t virt, uintptr_t phys)
+mapaddr(uintptr_t virt, uintptr_t phys, uint64_t flags)
 {
-	uint16_t index;
 	uint64_t *table;
 
-	table = pdpt;
+	table = pagetab_next(pml4, PML4_INDEX(virt));
+	if (table == NULL)
+		fatal(L"Failed mapping ");
 
-	table = pagetab_next(table, ((virt >> 30) & 0x1FF));
+	table = pagetab_next(table, PDPT_INDEX(virt));
 	if (table == NULL)
 		fatal(L"Failed mapping ");
 
-	table = pagetab_next(table, ((virt >> 21) & 0x1FF));
+	table = pagetab_next(table, PD_INDEX(virt));
 	if (table == NULL)
 		fatal(L"Failed mapping ");
 	
@@ -183,107 +257,487 @@ mapaddr(uintptr_t virt, uintptr_t phys)
 	 * Reached the page table, now set the address of the page frame with
 	 * appropriate flags.
 	 */
-	index = ((virt >> 12) & 0x1FF);
+	table[PT_INDEX(virt)] = phys | PTE_P | PTE_W | flags;
+	nsmall++;
+}
 
-	table[index] = phys | 3; /* Present, R/W */
+/* Map a single 2 MiB page directly in the page directory. */
+static void
+mapladdr(uintptr_t virt, uintptr_t phys, uint64_t flags)
+{
+	uint64_t *table;
+
+	table = pagetab_next(pml4, PML4_INDEX(virt));
+	if (table == NULL)
+		fatal(L"Failed mapping ");
+
+	table = pagetab_next(table, PDPT_INDEX(virt));
+	if (table == NULL)
+		fatal(L"Failed mapping ");
+
+	if (table[PD_INDEX(virt)] != 0)
+		fatal(L"Failed mapping, range already mapped ");
+
+	table[PD_INDEX(virt)] = phys | PTE_P | PTE_W | PTE_PS | flags;
+	nlarge++;
 }
 
 /*
- * Load loadable segments from kernel binary into memory and populate new page
- * tables.
+ * Map a virtually and physically contiguous range. Wherever both addresses
+ * sit on a 2 MiB boundary with at least 2 MiB left to map a large page is
+ * used, anything else falls back to 4 KiB pages. `flags` are added to the
+ * present and writable bits of every entry.
  */
 static void
-loadk(void)
+maprange(uintptr_t virt, uintptr_t phys, uint64_t sz, uint64_t flags)
+{
+	while (sz > 0) {
+		if (((virt | phys) & LPAGE_MASK) == 0 && sz >= LPAGE_SIZE) {
+			mapladdr(virt, phys, flags);
+			virt += LPAGE_SIZE;
+			phys += LPAGE_SIZE;
+			sz -= LPAGE_SIZE;
+		} else {
+			mapaddr(virt, phys, flags);
+			virt += PAGE_SIZE;
+			phys += PAGE_SIZE;
+			sz -= PAGE_SIZE;
+		}
+	}
+}
+
+/*
+ * Allocate `count` contiguous pages for the kernel whose physical address is
+ * congruent to `virt` modulo 2 MiB, so that every 2 MiB aligned part of the
+ * virtual range can be backed by a large page. EFI only guarantees 4 KiB
+ * alignment: over-allocate by one large page and hand back the slop.
+ */
+static uintptr_t
+kpalloc(uintptr_t virt, uint64_t count)
+{
+	Efi_status s;
+	uintptr_t base, page;
+	uint64_t total, head;
+
+	total = count + (LPAGE_SIZE / PAGE_SIZE);
+	s = bootsrv->allocate_pages(
+		Efi_allocate_any_pages,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		total,
+		(uint64_t *) &base
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to allocate memory for kernel");
+
+	page = ((base + LPAGE_MASK) & ~LPAGE_MASK) + (virt & LPAGE_MASK);
+	if (page - base >= LPAGE_SIZE)
+		page -= LPAGE_SIZE;
+
+	head = (page - base) / PAGE_SIZE;
+	if (head > 0)
+		bootsrv->free_pages(base, head);
+	if (total - head - count > 0)
+		bootsrv->free_pages(page + (count * PAGE_SIZE),
+				total - head - count);
+
+	return page;
+}
+
+/* Allocate `pgs` pages to back the virtual range starting at `vstart`. */
+static uintptr_t
+segalloc(uintptr_t vstart, uint64_t pgs)
 {
 	Efi_status s;
 	uintptr_t page;
-	uint64_t pgs, sz;
-	int i, j, loadable;
 
-	pdpt = (uint64_t *) palloc(1);
-	memzero((uintptr_t) pdpt, (uintptr_t) pdpt + 0x1000);
+	/*
+	 * Only bother aligning for large pages if the range spans a whole
+	 * 2 MiB aligned virtual page.
+	 */
+	if (((vstart + LPAGE_MASK) & ~LPAGE_MASK) + LPAGE_SIZE
+			<= vstart + (pgs * PAGE_SIZE))
+		return kpalloc(vstart, pgs);
+
+	s = bootsrv->allocate_pages(
+		Efi_allocate_any_pages,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		pgs,
+		(uint64_t *) &page
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to allocate memory for kernel");
+
+	return page;
+}
+
+/*
+ * Whether a segment can be mapped where it already sits in the kernel image.
+ * That requires the file offset and virtual address to share their offset
+ * within a page. If the segment spans a 2 MiB virtual page we also require
+ * them to be congruent modulo 2 MiB, a copy is cheaper than giving up the
+ * large page.
+ */
+static int
+inplace(Elf64_Phdr *ph)
+{
+	uintptr_t vstart, vend;
+
+	if (kalz != NULL)
+		return 0;
+
+	if (ph->p_filesz == 0 || ph->p_offset + ph->p_filesz > kimg_sz)
+		return 0;
+
+	if ((ph->p_offset & PAGE_MASK) != (ph->p_vaddr & PAGE_MASK))
+		return 0;
 
-	for (i = 0; i < ehdr.e_phnum; i++) {
+	vstart = ph->p_vaddr & ~PAGE_MASK;
+	vend = (ph->p_vaddr + ph->p_filesz) & ~PAGE_MASK;
+	if (((vstart + LPAGE_MASK) & ~LPAGE_MASK) + LPAGE_SIZE <= vend
+	&& (ph->p_offset & LPAGE_MASK) != (ph->p_vaddr & LPAGE_MASK))
+		return 0;
+
+	return 1;
+}
+
+/* Place the file contents of a whole segment at `dst`. */
+static void
+segread(uintptr_t dst, Elf64_Phdr *ph)
+{
+	Alz_blk *blk;
+
+	if (ph->p_filesz == 0)
+		return;
+
+	/* Compressed segments are unpacked straight into their pages */
+	if (kalz != NULL) {
+		blk = alz_find(kalz, kimg_sz, ph->p_offset);
+		if (blk == NULL || blk->rawsz != ph->p_filesz)
+			fatal(L"Invalid compressed kernel image");
+		if (alz_unpack(kalz, kimg_sz, blk, dst) != 0)
+			fatal(L"Failed to unpack compressed kernel image");
+		return;
+	}
+
+	if (ph->p_offset + ph->p_filesz > kimg_sz)
+		fatal(L"Kernel binary is truncated");
+	memcopy(dst, kimg + ph->p_offset, ph->p_filesz);
+}
+
+/*
+ * Load loadable segments from kernel image into memory and populate new page
+ * tables.
+ */
+static void
+loadk(void)
+{
+	uintptr_t page, vstart, vmid, vend, src;
+	uint64_t pgs;
+	int i;
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
 		if (phdrs[i].p_type != PT_LOAD)
 			continue;
 
-		/* Allocate the amount of pages we need to load this segment */
-		if (phdrs[i].p_memsz < 0x1000)
-			pgs = 1;
-		else
-			pgs = phdrs[i].p_memsz / 0x1000;
-
-		s = bootsrv->allocate_pages(
-			Efi_allocate_any_pages,
-			Efi_runtime_services_code,
-			pgs,
-			(uint64_t *) &page
-		);
-		if (s != EFI_SUCCESS)
-			fatal(L"Failed to allocate memory for kernel");
-
-		/* Read segment content from file into pages if necessary */
-		if (phdrs[i].p_filesz != 0) {
-			s = kfile->set_position(kfile, phdrs[i].p_offset);
-			sz = phdrs[i].p_filesz;
-			s = kfile->read(
-				kfile,
-				&sz,
-				(void *) page
-			);
-			if (s != EFI_SUCCESS)
-				fatal(L"Failed to read kernel from boot "
-						"media");
+		/* Page aligned virtual range covered by this segment */
+		vstart = phdrs[i].p_vaddr & ~PAGE_MASK;
+		vend = (phdrs[i].p_vaddr + phdrs[i].p_memsz + PAGE_MASK)
+			& ~PAGE_MASK;
+		src = kimg + phdrs[i].p_offset;
+
+		/*
+		 * Pages entirely backed by the file are mapped straight out
+		 * of the image, no copy. Only the last partially filled page
+		 * and the BSS past it need fresh memory.
+		 */
+		vmid = vstart;
+		if (inplace(&phdrs[i])) {
+			vmid = (phdrs[i].p_vaddr + phdrs[i].p_filesz)
+				& ~PAGE_MASK;
+			maprange(vstart, src - (phdrs[i].p_vaddr - vstart),
+					vmid - vstart, 0);
+			if (vmid == vend)
+				continue;
 		}
 
-		/* Zero unused memory if necessary */
-		if (phdrs[i].p_memsz > phdrs[i].p_filesz) {
-			memzero((uintptr_t) (page + phdrs[i].p_filesz + 1),
-				(uintptr_t)(page + (pgs * 0x1000)));
+		pgs = (vend - vmid) / PAGE_SIZE;
+		page = segalloc(vmid, pgs);
+
+		/* Copy what the file covers, zero the rest */
+		if (vmid == vstart) {
+			memzero(page, page + (phdrs[i].p_vaddr - vstart) - 1);
+			segread(page + (phdrs[i].p_vaddr - vstart), &phdrs[i]);
+			memzero(page + (phdrs[i].p_vaddr - vstart)
+					+ phdrs[i].p_filesz,
+				page + (pgs * PAGE_SIZE) - 1);
+		} else {
+			memcopy(page, src + (vmid - phdrs[i].p_vaddr),
+				phdrs[i].p_vaddr + phdrs[i].p_filesz - vmid);
+			memzero(page + (phdrs[i].p_vaddr + phdrs[i].p_filesz
+					- vmid),
+				page + (pgs * PAGE_SIZE) - 1);
 		}
 
 		/* Map pages in the tables we're building */
-		for (j = 0; j < pgs; j++)
-			mapaddr(phdrs[i].p_vaddr + (j * 0x1000),
-					((uintptr_t) page) + (j * 0x1000));
+		maprange(vmid, page, pgs * PAGE_SIZE, 0);
+	}
+
+	kargtab.kmap_large = nlarge;
+	kargtab.kmap_small = nsmall;
+}
+
+/*
+ * Map the framebuffer a second time at `FB_BASE` with the PWT bit alone set,
+ * selecting PAT entry 1 which the kernel programs as write-combining. Pixel
+ * writes then go out in bursts rather than one uncached store at a time.
+ */
+static void
+fbmap(void)
+{
+	Efi_graphics_output_protocol_mode *mode;
+	uintptr_t base;
+	uint64_t sz;
+
+	mode = (Efi_graphics_output_protocol_mode *) kargtab.gop_mode;
+	base = mode->framebuffer_base & ~PAGE_MASK;
+	sz = (mode->framebuffer_base + mode->framebuffer_size - base
+			+ PAGE_MASK) & ~PAGE_MASK;
+
+	maprange(FB_BASE + (base & LPAGE_MASK), base, sz, PTE_PWT);
+	kargtab.fb_base = FB_BASE + (mode->framebuffer_base & LPAGE_MASK);
+}
+
+/*
+ * Allocate the kernel PML4. It is kept below 4 GiB so that processors still
+ * in protected mode (application processors being started) can load it.
+ */
+static void
+pml4_init(void)
+{
+	Efi_status s;
+	uintptr_t page;
+
+	page = 0xFFFFFFFF;
+	s = bootsrv->allocate_pages(
+		Efi_allocate_max_address,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		1,
+		(uint64_t *) &page
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to allocate kernel PML4");
+
+	memzero(page, page + PAGE_MASK);
+	pml4 = (uint64_t *) page;
+	kargtab.pml4 = page;
+}
+
+/*
+ * Returns the end of the physical address space to direct map: the top of
+ * the EFI memory map or of the framebuffer, and never less than 4 GiB so
+ * the local APIC, I/O APIC and friends below it are covered too.
+ */
+static uint64_t
+dmap_top(void)
+{
+	Efi_memory_descriptor *d;
+	Efi_graphics_output_protocol_mode *mode;
+	uintptr_t p;
+	uint64_t top, end;
+
+	top = 0x100000000;
+
+	for (p = kargtab.mmap; p < kargtab.mmap + kargtab.mmap_sz;
+			p += kargtab.mmap_dsz) {
+		d = (Efi_memory_descriptor *) p;
+		end = d->physical_start + (d->number_of_pages * PAGE_SIZE);
+		if (end > top)
+			top = end;
+	}
+
+	mode = (Efi_graphics_output_protocol_mode *) kargtab.gop_mode;
+	end = mode->framebuffer_base + mode->framebuffer_size;
+	if (end > top)
+		top = end;
+
+	return (top + HPAGE_MASK) & ~HPAGE_MASK;
+}
+
+/*
+ * Build the physical direct map with 1 GiB pages where the processor has
+ * them, 2 MiB pages otherwise, then alias the same PDPTs at the bottom of
+ * the address space as an identity map.
+ */
+static void
+dmap(void)
+{
+	uint32_t regs[4];
+	uint64_t *pdpt, *pd;
+	uint64_t top, pa;
+	int huge, i;
+
+	/* CPUID.80000001H:EDX[26], 1 GiB pages */
+	huge = 0;
+	cpuinfo(0x80000000, 0, regs);
+	if (regs[0] >= 0x80000001) {
+		cpuinfo(0x80000001, 0, regs);
+		huge = (regs[3] >> 26) & 1;
+	}
+
+	top = dmap_top();
+	for (pa = 0; pa < top; pa += HPAGE_SIZE) {
+		pdpt = pagetab_next(pml4, PML4_INDEX(DMAP_BASE + pa));
+		if (pdpt == NULL)
+			fatal(L"Failed mapping physical memory");
+
+		if (huge) {
+			pdpt[PDPT_INDEX(pa)] = pa | PTE_P | PTE_W | PTE_PS;
+			continue;
+		}
+
+		pd = pagetab_next(pdpt, PDPT_INDEX(pa));
+		if (pd == NULL)
+			fatal(L"Failed mapping physical memory");
+		for (i = 0; i < 512; i++)
+			pd[i] = (pa + (i * LPAGE_SIZE)) | PTE_P | PTE_W | PTE_PS;
 	}
+
+	for (i = 0; i < (top + (1ULL << 39) - 1) >> 39; i++)
+		pml4[i] = pml4[PML4_INDEX(DMAP_BASE) + i];
+
+	kargtab.dmap_top = top;
+	kargtab.dmap_pgsz = huge ? HPAGE_SIZE : LPAGE_SIZE;
+}
+
+/* Rebase pointers handed to the kernel into the direct map */
+static void
+rebase(void)
+{
+	kargtab.this = P2V((uintptr_t) &kargtab);
+	kargtab.kstack = P2V(kargtab.kstack);
+	kargtab.mmap = P2V(kargtab.mmap);
+	kargtab.kmmap = P2V(kargtab.kmmap);
+	kargtab.runtime_srv = P2V(kargtab.runtime_srv);
+	kargtab.efi_cfg = P2V(kargtab.efi_cfg);
+	kargtab.gop_mode = P2V(kargtab.gop_mode);
+	kargtab.font_base = P2V(kargtab.font_base);
+	if (kargtab.initrd_base != 0)
+		kargtab.initrd_base = P2V(kargtab.initrd_base);
+}
+
+/*
+ * Allocate the kernel's initial stack. The firmware's stack is in boot
+ * services memory, which the kernel takes back.
+ */
+#define KSTACK_PAGES	16
+
+static void
+kstack_alloc(void)
+{
+	Efi_status s;
+	uintptr_t base;
+
+	s = bootsrv->allocate_pages(
+		Efi_allocate_any_pages,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		KSTACK_PAGES,
+		(uint64_t *) &base
+	);
+	if (s != EFI_SUCCESS)
+		fatal(L"Failed to allocate kernel stack");
+
+	kargtab.kstack = base + (KSTACK_PAGES * PAGE_SIZE);
+}
+
+/*
+ * Allocate a page below 1 MiB for the kernel to start application
+ * processors from, they begin in real mode at a page number given in the
+ * startup IPI. Not being able to is no reason to stop booting.
+ */
+static void
+trampoline_alloc(void)
+{
+	Efi_status s;
+	uintptr_t page;
+
+	page = 0x9FFFF;
+	s = bootsrv->allocate_pages(
+		Efi_allocate_max_address,
+		(Efi_memory_type) ALIX_MEMORY_TYPE,
+		1,
+		(uint64_t *) &page
+	);
+	kargtab.trampoline = (s == EFI_SUCCESS) ? page : 0;
 }
 
 void
 load(void)
 {
 	Efi_status s;
-	uintptr_t cr3;
-	uint64_t *pml4;
-	uintptr_t val;
+	uint64_t start;
 	
-	read_ehdr();	/* Read the Elf header and verify its validity */	
-	read_phdrs();	/* Read program headers to be analyzed */
+	start = tscread();
+
+	read_kernel();	/* Read the whole kernel binary from boot media */
+	read_ehdr();	/* Verify validity of the Elf header */
+	read_phdrs();	/* Locate program headers to be analyzed */
 
 	/* Allocate pages, read kernel, and populate new page tables */
+	pml4_init();
 	loadk();
+	fbmap();
+	kstack_alloc();
+	trampoline_alloc();
+
+	/* Nothing is mapped out of a compressed image, give it back */
+	kargtab.kimg_fsz = kimg_sz;
+	kargtab.kimg_sz = kimg_sz;
+	if (kalz != NULL) {
+		kargtab.kimg_sz = kalz->rawsz;
+		bootsrv->free_pages(kimg, (kimg_sz + PAGE_MASK) / PAGE_SIZE);
+	}
+	kargtab.kimg_tsc = tscread() - start;
+	kargtab.timeline[TL_LOADK] = tscread();
 
 	/*
-	 * Retrieve memory map from EFI and exit EFI boot services
-	 * From this point forward we own the machine
+	 * The direct map must cover everything in the memory map, which has
+	 * to be fetched first. Building it allocates page tables, so the map
+	 * is fetched again for the final copy below.
 	 */
 	getmmap();
-	bootsrv->exit_boot_services(imghan, mmapkey);
+	dmap();
 
 	/*
-	 * Get paging access. Ensures bit 16 in `cr0` is off and returns the
-	 * value of `cr3` so we can access the PML4 to link in our new mappings.
+	 * Retrieve memory map from EFI and exit EFI boot services
+	 * From this point forward we own the machine. The compact map is sized
+	 * from this final map, and allocating it changes the map, so fetch it
+	 * until the compact map fits.
 	 */
-	cr3 = pgaccess();
+	getmmap();
+	while (kmmap_alloc())
+		getmmap();
+	kargtab.timeline[TL_MMAP] = tscread();
+	s = bootsrv->exit_boot_services(imghan, mmapkey);
+	if (s != EFI_SUCCESS) {
+		/*
+		 * Map changed under us, allowed to retry once. Nothing may be
+		 * allocated or freed before it, only the map fetched again.
+		 */
+		regetmmap();
+		s = bootsrv->exit_boot_services(imghan, mmapkey);
+		if (s != EFI_SUCCESS)
+			fatal(L"Failed to exit boot services");
+	}
+	kargtab.timeline[TL_EXITBS] = tscread();
 
-	/* Install our mappings */
-	pml4 = (uint64_t *)((cr3 >> 12) << 12);
-	pml4[((ehdr.e_entry >> 39) & 0x1FF)] = (((uintptr_t)pdpt) | 3);
+	kmmap_build();
+	rebase();
 	
 	/*
 	 * And.... We're outta here.
-	 * Setup the call to our kernel
+	 * Setup the call to our kernel, switching to our own page tables
 	 */
-	er(ehdr.e_entry, (uintptr_t) &kargtab);
+	er(ehdr->e_entry, kargtab.this, &kargtab.timeline[TL_HANDOFF],
+			kargtab.pml4, kargtab.kstack);
 }
 
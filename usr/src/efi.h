@@ -37,6 +37,17 @@
 			{ 0x9042a9de, 0x23dc, 0x4a38, \
   			{ 0x96, 0xfb, 0x7a, 0xde, 0xd0, 0x80, 0x51, 0x6a }}
 
+/*
+ * Configuration table GUIDs
+ */
+#define EFI_ACPI_20_TABLE_GUID (Efi_guid) \
+			{ 0x8868e871, 0xe4f1, 0x11d3, \
+			{ 0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81 }}
+
+#define EFI_ACPI_TABLE_GUID (Efi_guid) \
+			{ 0xeb9d2d30, 0x2d88, 0x11d3, \
+			{ 0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d }}
+
 /*
  * UEFI boolean... 1 byte value
  */
@@ -344,7 +355,11 @@ typedef struct Efi_boot_services {
 		uint64_t *		memory
 	);
 
-	void *			free_pages;
+	Efi_status (*free_pages)
+	(
+		uint64_t		memory,
+		uint64_t		pages
+	);
 
 	/*
 	 * Returns the current memory map
@@ -368,7 +383,10 @@ typedef struct Efi_boot_services {
 		void **			buffer
 	);
 
-	void *			free_pool;
+	Efi_status (*free_pool)
+	(
+		void *			buffer
+	);
 
 	/*
 	 * Event and timer services
@@ -533,6 +551,69 @@ typedef struct Efi_simple_text_output_protocol {
 
 } Efi_simple_text_output_protocol;
 
+/*
+ * The kernel calls runtime services after boot services have exited. It is
+ * built for the System V calling convention, so their pointers carry the
+ * EFI one (Microsoft x64) explicitly.
+ */
+#define EFIAPI	__attribute__((ms_abi))
+
+typedef struct Efi_time_capabilities {
+
+	uint32_t	resolution;	/* Counts per second */
+	uint32_t	accuracy;	/* Error rate in parts per million */
+	uint8_t		sets_to_zero;
+
+} Efi_time_capabilities;
+
+#define EFI_UNSPECIFIED_TIMEZONE	0x07FF
+
+/*
+ * Runtime services, callable at their physical addresses until the
+ * operating system calls `set_virtual_address_map`. ALIX never does and
+ * keeps physical memory identity mapped instead.
+ */
+typedef struct Efi_runtime_services {
+
+	Efi_table_header	hdr;
+
+	/*
+	 * Time services
+	 */
+	Efi_status (EFIAPI *get_time)
+	(
+		Efi_time *			time,
+		Efi_time_capabilities *		capabilities
+	);
+
+	void *			set_time;
+	void *			get_wakeup_time;
+	void *			set_wakeup_time;
+
+	/*
+	 * Virtual memory services
+	 */
+	void *			set_virtual_address_map;
+	void *			convert_pointer;
+
+	/*
+	 * Variable services
+	 */
+	void *			get_variable;
+	void *			get_next_variable_name;
+	void *			set_variable;
+
+	/*
+	 * Miscellaneous services
+	 */
+	void *			get_next_high_monotonic_count;
+	void *			reset_system;
+	void *			update_capsule;
+	void *			query_capsule_capabilities;
+	void *			query_variable_info;
+
+} Efi_runtime_services;
+
 /*
  * Pointers to boot and run time services and other tables
  */
@@ -554,6 +635,13 @@ typedef struct Efi_system_table {
 
 } Efi_system_table;
 
+typedef struct Efi_configuration_table {
+
+	Efi_guid				vendor_guid;
+	uint64_t				vendor_table;
+
+} Efi_configuration_table;
+
 typedef enum Efi_graphics_pixel_format {
 
 	PixelRedGreenBlueReserved8BitPerColor,
@@ -0,0 +1,43 @@
+/*
+ * ALIX: `initrd.h` -- Initial ramdisk archive format
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _INITRD_H_
+#define _INITRD_H_
+
+/*
+ * The initial ramdisk is read whole into memory by the bootloader and used
+ * in place by the kernel, no file data is ever copied.
+ *
+ * Layout: `Initrd_hdr`, then `nent` of `Initrd_ent` sorted by name, then the
+ * file data. Each file starts on an `INITRD_ALIGN` boundary so it may later
+ * be mapped directly. Images are produced by `tools/mkinitrd`. All fields
+ * are little endian.
+ */
+
+#define INITRD_MAGIC	0x44525849	/* "IXRD" */
+#define INITRD_ALIGN	0x1000
+#define INITRD_NAMESZ	48		/* including terminating NUL */
+
+typedef struct {
+
+	uint32_t	magic;		/* INITRD_MAGIC */
+	uint32_t	nent;		/* number of entries in index */
+	uint64_t	size;		/* size of the whole archive */
+
+} Initrd_hdr;
+
+typedef struct {
+
+	char		name[INITRD_NAMESZ];	/* path, NUL terminated */
+	uint64_t	off;		/* offset of data from archive start */
+	uint64_t	size;		/* size of data */
+
+} Initrd_ent;
+
+#endif /* _INITRD_H_ */
@@ -0,0 +1,151 @@
+/*
+ * ALIX: `sys/acpi.c` -- ACPI table access
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <efi.h>
+#include <sys/kargtab.h>
+#include <sys/acpi.h>
+#include <sys/string.h>
+#include <sys/x64/page.h>
+#include <sys/dev/console.h>
+
+/*
+ * The firmware hands over the RSDP in the EFI configuration table, which
+ * leads to the XSDT (or on ACPI 1.0 the RSDT), an array of pointers to every
+ * other table. Tables are only ever read, in place, and live in `KMM_ACPI`
+ * memory the kernel does not reclaim.
+ */
+
+static Acpi_sdt *	root;		/* XSDT or RSDT */
+static int		xsdt;		/* 64 bit entries */
+
+/* Returns 0 if the `len` bytes at `p` sum up to 0 */
+static uint8_t
+checksum(const void *p, size_t len)
+{
+	const uint8_t *b;
+	uint8_t sum;
+
+	b = p;
+	for (sum = 0; len > 0; len--)
+		sum += *b++;
+
+	return sum;
+}
+
+static int
+guideq(Efi_guid a, Efi_guid b)
+{
+	return memcmp(&a, &b, sizeof(Efi_guid)) == 0;
+}
+
+static int
+rootcount(void)
+{
+	return (root->length - sizeof(Acpi_sdt)) / (xsdt ? 8 : 4);
+}
+
+/* Physical address of the `i`th table in the root table */
+static uintptr_t
+rootentry(int i)
+{
+	uint8_t *p;
+	uint64_t a;
+	uint32_t a32;
+
+	p = (uint8_t *) (root + 1);
+	if (xsdt) {
+		memcpy(&a, p + i * 8, 8);	/* Only 4 byte aligned */
+		return a;
+	}
+	memcpy(&a32, p + i * 4, 4);
+
+	return a32;
+}
+
+/*
+ * Find the RSDP in the EFI configuration table and validate the root table.
+ * Returns 0, or -1 if the firmware provides no usable ACPI tables.
+ */
+int
+acpi_init(struct kargtab *kargtab)
+{
+	Efi_configuration_table *cfg;
+	Acpi_rsdp *rsdp;
+	Acpi_sdt *sdt;
+	uint64_t i;
+	int n;
+
+	rsdp = NULL;
+	cfg = (Efi_configuration_table *) kargtab->efi_cfg;
+	for (i = 0; i < kargtab->efi_cfg_n; i++) {
+		if (guideq(cfg[i].vendor_guid, EFI_ACPI_20_TABLE_GUID)) {
+			rsdp = (Acpi_rsdp *) P2V(cfg[i].vendor_table);
+			break;
+		}
+		if (guideq(cfg[i].vendor_guid, EFI_ACPI_TABLE_GUID))
+			rsdp = (Acpi_rsdp *) P2V(cfg[i].vendor_table);
+	}
+
+	if (rsdp == NULL || memcmp(rsdp->signature, "RSD PTR ", 8) != 0
+	|| checksum(rsdp, 20) != 0) {
+		kprintf("ACPI: no RSDP\n");
+		return -1;
+	}
+
+	if (rsdp->revision >= 2 && rsdp->xsdt != 0
+	&& checksum(rsdp, rsdp->length) == 0) {
+		root = (Acpi_sdt *) P2V(rsdp->xsdt);
+		xsdt = 1;
+	} else {
+		root = (Acpi_sdt *) P2V(rsdp->rsdt);
+		xsdt = 0;
+	}
+
+	if (checksum(root, root->length) != 0) {
+		kprintf("ACPI: bad %s checksum\n", xsdt ? "XSDT" : "RSDT");
+		root = NULL;
+		return -1;
+	}
+
+	kprintf("ACPI: revision %u, tables:", rsdp->revision);
+	for (n = 0; n < rootcount(); n++) {
+		sdt = (Acpi_sdt *) P2V(rootentry(n));
+		kprintf(" %c%c%c%c", sdt->signature[0], sdt->signature[1],
+				sdt->signature[2], sdt->signature[3]);
+	}
+	kprintf("\n");
+
+	return 0;
+}
+
+/*
+ * Returns the first table with the 4 character `signature` (e.g. "SRAT") and
+ * a valid checksum, NULL if there is none.
+ */
+Acpi_sdt *
+acpi_find(const char *signature)
+{
+	Acpi_sdt *sdt;
+	int i;
+
+	if (root == NULL)
+		return NULL;
+
+	for (i = 0; i < rootcount(); i++) {
+		sdt = (Acpi_sdt *) P2V(rootentry(i));
+		if (memcmp(sdt->signature, signature, 4) == 0
+		&& checksum(sdt, sdt->length) == 0)
+			return sdt;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,235 @@
+/*
+ * ALIX: `sys/acpi.h` -- ACPI table access
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _ACPI_H_
+#define _ACPI_H_
+
+/*
+ * Only the tables the kernel reads. ACPI Specification Version 6.5 is being
+ * referenced:
+ * 	https://uefi.org/specs/ACPI/6.5/index.html
+ *
+ * Table addresses are physical, reach them through the direct map.
+ */
+
+/* Root System Description Pointer */
+typedef struct Acpi_rsdp {
+
+	char		signature[8];	/* "RSD PTR " */
+	uint8_t		checksum;	/* First 20 bytes */
+	char		oemid[6];
+	uint8_t		revision;	/* 0: ACPI 1.0, 2: 2.0 and later */
+	uint32_t	rsdt;
+	uint32_t	length;		/* 2.0 and later: */
+	uint64_t	xsdt;
+	uint8_t		xchecksum;	/* Whole structure */
+	uint8_t		reserved[3];
+
+} __attribute__((packed)) Acpi_rsdp;
+
+/* Header common to all system description tables */
+typedef struct Acpi_sdt {
+
+	char		signature[4];
+	uint32_t	length;		/* Header included */
+	uint8_t		revision;
+	uint8_t		checksum;
+	char		oemid[6];
+	char		oemtable[8];
+	uint32_t	oemrevision;
+	uint32_t	creator;
+	uint32_t	creatorrevision;
+
+} __attribute__((packed)) Acpi_sdt;
+
+/* System Resource Affinity Table ("SRAT"), a list of affinity structures */
+typedef struct Acpi_srat {
+
+	Acpi_sdt	hdr;
+	uint32_t	reserved1;
+	uint64_t	reserved2;
+
+} __attribute__((packed)) Acpi_srat;
+
+#define SRAT_LAPIC	0		/* `Acpi_srat_lapic` */
+#define SRAT_MEMORY	1		/* `Acpi_srat_memory` */
+#define SRAT_X2APIC	2		/* `Acpi_srat_x2apic` */
+
+#define SRAT_ENABLED	(1 << 0)	/* `flags`, entry is in use */
+#define SRAT_HOTPLUG	(1 << 1)	/* Memory may be hot plugged */
+
+typedef struct Acpi_srat_entry {
+
+	uint8_t		type;
+	uint8_t		length;
+
+} __attribute__((packed)) Acpi_srat_entry;
+
+typedef struct Acpi_srat_lapic {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		domain_lo;	/* Proximity domain, bits 7:0 */
+	uint8_t		apicid;
+	uint32_t	flags;
+	uint8_t		sapic_eid;
+	uint8_t		domain_hi[3];	/* 	-bits 31:8 */
+	uint32_t	clock_domain;
+
+} __attribute__((packed)) Acpi_srat_lapic;
+
+typedef struct Acpi_srat_memory {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint32_t	domain;
+	uint16_t	reserved1;
+	uint64_t	base;
+	uint64_t	size;
+	uint32_t	reserved2;
+	uint32_t	flags;
+	uint64_t	reserved3;
+
+} __attribute__((packed)) Acpi_srat_memory;
+
+typedef struct Acpi_srat_x2apic {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint16_t	reserved1;
+	uint32_t	domain;
+	uint32_t	x2apicid;
+	uint32_t	flags;
+	uint32_t	clock_domain;
+	uint32_t	reserved2;
+
+} __attribute__((packed)) Acpi_srat_x2apic;
+
+/*
+ * System Locality Information Table ("SLIT"): relative distances between
+ * proximity domains, `nlocality` squared bytes, row major. 10 is local.
+ */
+typedef struct Acpi_slit {
+
+	Acpi_sdt	hdr;
+	uint64_t	nlocality;
+	uint8_t		dist[];
+
+} __attribute__((packed)) Acpi_slit;
+
+/*
+ * Multiple APIC Description Table ("APIC"): the local APIC address and a
+ * list of interrupt controller structures, one per processor among them.
+ */
+typedef struct Acpi_madt {
+
+	Acpi_sdt	hdr;
+	uint32_t	lapic;		/* Local APIC physical address */
+	uint32_t	flags;		/* `MADT_PCAT_COMPAT` */
+
+} __attribute__((packed)) Acpi_madt;
+
+#define MADT_PCAT_COMPAT	(1 << 0)	/* Dual 8259s to mask */
+
+#define MADT_LAPIC	0		/* `Acpi_madt_lapic` */
+#define MADT_IOAPIC	1
+#define MADT_LAPIC_ADDR	5		/* `Acpi_madt_lapic_addr` */
+#define MADT_X2APIC	9		/* `Acpi_madt_x2apic` */
+
+#define MADT_ENABLED	(1 << 0)	/* `flags`, processor usable */
+#define MADT_ONLINE	(1 << 1)	/* Can be enabled later */
+
+typedef struct Acpi_madt_entry {
+
+	uint8_t		type;
+	uint8_t		length;
+
+} __attribute__((packed)) Acpi_madt_entry;
+
+typedef struct Acpi_madt_lapic {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		uid;		/* ACPI processor UID */
+	uint8_t		apicid;
+	uint32_t	flags;
+
+} __attribute__((packed)) Acpi_madt_lapic;
+
+/* 64 bit local APIC address, overrides the one in the header */
+typedef struct Acpi_madt_lapic_addr {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint16_t	reserved;
+	uint64_t	addr;
+
+} __attribute__((packed)) Acpi_madt_lapic_addr;
+
+typedef struct Acpi_madt_x2apic {
+
+	uint8_t		type;
+	uint8_t		length;
+	uint16_t	reserved;
+	uint32_t	x2apicid;
+	uint32_t	flags;
+	uint32_t	uid;
+
+} __attribute__((packed)) Acpi_madt_x2apic;
+
+/* Generic Address Structure, a register in some address space */
+typedef struct Acpi_gas {
+
+	uint8_t		space;		/* `GAS_*` */
+	uint8_t		width;		/* Bits */
+	uint8_t		offset;
+	uint8_t		access;
+	uint64_t	addr;
+
+} __attribute__((packed)) Acpi_gas;
+
+#define GAS_MEMORY	0
+#define GAS_IO		1
+
+/*
+ * Fixed ACPI Description Table ("FACP"), only as far as the power
+ * management timer. Check `hdr.length` before the extended fields.
+ */
+typedef struct Acpi_fadt {
+
+	Acpi_sdt	hdr;
+	uint8_t		reserved1[40];
+	uint32_t	pm_tmr_blk;	/* Power management timer port */
+	uint8_t		reserved2[11];
+	uint8_t		pm_tmr_len;	/* 4 if there is one */
+	uint8_t		reserved3[20];
+	uint32_t	flags;		/* `FADT_*` */
+	uint8_t		reserved4[92];
+	Acpi_gas	x_pm_tmr_blk;	/* Overrides `pm_tmr_blk` */
+
+} __attribute__((packed)) Acpi_fadt;
+
+#define FADT_TMR_VAL_EXT	(1 << 8)	/* 32 bit timer, else 24 */
+
+/* High Precision Event Timer Table ("HPET") */
+typedef struct Acpi_hpet {
+
+	Acpi_sdt	hdr;
+	uint32_t	blockid;	/* Hardware ID of the timer block */
+	Acpi_gas	base;		/* Registers, in memory */
+	uint8_t		number;
+	uint16_t	mintick;
+	uint8_t		protection;
+
+} __attribute__((packed)) Acpi_hpet;
+
+int		acpi_init(struct kargtab *kargtab);
+Acpi_sdt *	acpi_find(const char *signature);
+
+#endif /* _ACPI_H_ */
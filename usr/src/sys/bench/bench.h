@@ -0,0 +1,60 @@
+/*
+ * ALIX: `sys/bench/bench.h` -- in-kernel benchmarks
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * Benchmarks are only built with `make KOPTS=-DBENCH` and run from `main()`,
+ * timing with the TSC rate `clock_init()` calibrated (`kargtab->tsc_khz`).
+ */
+
+/* Cycles to microseconds, 0 if the TSC rate is unknown */
+#define BENCH_US(kargtab, cyc) \
+	((kargtab)->tsc_khz ? (cyc) * 1000 / (kargtab)->tsc_khz : 0)
+
+/*
+ * Threads a benchmark starts and parks until they finish. With a start line
+ * they spin at `bench_line()` until all are there, then run together; the
+ * last to call `bench_done()` wakes the waiter in `bench_wait()`.
+ */
+struct benchteam {
+
+	uint32_t	n;		/* Threads */
+	uint32_t	ready;		/* Threads at the start line */
+	uint32_t	left;		/* Threads still running */
+	struct thread *	waiter;
+
+};
+
+uint64_t	bench_rand(uint64_t *state);
+void		bench_sort(uint64_t *v, int n);
+uint64_t	bench_overhead(void);
+void		bench_minmean(const char *name, void (*op)(void), int n,
+		    uint64_t base);
+void		bench_team(struct benchteam *bt, uint32_t n);
+void		bench_drop(struct benchteam *bt, uint32_t n);
+void		bench_line(struct benchteam *bt);
+void		bench_done(struct benchteam *bt);
+void		bench_wait(struct benchteam *bt);
+
+void	bench_vt(struct kargtab *kargtab);
+void	bench_pmm(struct kargtab *kargtab);
+void	bench_pmm_ap(void);
+void	bench_kmalloc(struct kargtab *kargtab);
+void	bench_tlb(struct kargtab *kargtab);
+void	bench_trap(struct kargtab *kargtab);
+void	bench_timer(struct kargtab *kargtab);
+void	bench_clock(struct kargtab *kargtab);
+void	bench_sched(struct kargtab *kargtab);
+void	bench_topo(struct kargtab *kargtab);
+void	bench_lock(struct kargtab *kargtab);
+void	bench_rcu(struct kargtab *kargtab);
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,64 @@
+/*
+ * ALIX: `sys/bench/clock.c` -- kernel time read benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/clock.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * What `ktime_get_ns()` costs over reading the TSC it is made of, with no
+ * writer around: the sequence count checks and the 128 bit multiply. Time
+ * must also never go backwards between calls.
+ */
+
+#define NREADS		4096
+
+static void
+readtsc(void)
+{
+	(void) tscread();
+}
+
+static void
+readktime(void)
+{
+	(void) ktime_get_ns();
+}
+
+void
+bench_clock(struct kargtab *kargtab)
+{
+	uint64_t prev, now;
+	int i, back;
+
+	(void) kargtab;
+
+	if (clockdata->mult == 0)
+		return;
+
+	kprintf("Clock reads, %d calls:\n", NREADS);
+	bench_minmean("tscread()", readtsc, NREADS, 0);
+	bench_minmean("ktime_get_ns()", readktime, NREADS, 0);
+
+	back = 0;
+	prev = ktime_get_ns();
+	for (i = 0; i < NREADS; i++) {
+		now = ktime_get_ns();
+		if (now < prev)
+			back++;
+		prev = now;
+	}
+	kprintf("  went backwards %d times, now %lu ns, real %lu s\n", back,
+			prev, ktime_get_real_ns() / NSEC_PER_SEC);
+}
@@ -0,0 +1,78 @@
+/*
+ * ALIX: `sys/bench/kmalloc.c` -- kmalloc latency benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/kmalloc.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Time every single `kmalloc()` and `kfree()` for a spread of sizes (slab
+ * classes and page runs) and report latency percentiles in cycles, less the
+ * cost of reading the TSC itself.
+ */
+
+#define NOPS		512
+
+static const size_t sizes[] = { 24, 200, 1000, 4000, 12000, 65536 };
+
+static void *		ptrs[NOPS];
+static uint64_t		talloc[NOPS];
+static uint64_t		tfree[NOPS];
+
+static void
+report(const char *name, uint64_t *v)
+{
+	bench_sort(v, NOPS);
+	kprintf("    %s: p50 %lu, p90 %lu, p99 %lu, max %lu\n", name,
+			v[NOPS / 2], v[NOPS * 90 / 100], v[NOPS * 99 / 100],
+			v[NOPS - 1]);
+}
+
+static uint64_t
+less(uint64_t t, uint64_t base)
+{
+	return t > base ? t - base : 0;
+}
+
+void
+bench_kmalloc(struct kargtab *kargtab)
+{
+	uint64_t t, base;
+	size_t s;
+	int i;
+
+	base = bench_overhead();
+	kprintf("\nbench: kmalloc, %d ops per size, cycles (%lu subtracted)\n",
+			NOPS, base);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (i = 0; i < NOPS; i++) {
+			t = tscread();
+			ptrs[i] = kmalloc(sizes[s], 0);
+			talloc[i] = less(tscread() - t, base);
+		}
+		/* Free in allocation order, the common FIFO-ish pattern */
+		for (i = 0; i < NOPS; i++) {
+			t = tscread();
+			kfree(ptrs[i]);
+			tfree[i] = less(tscread() - t, base);
+		}
+
+		kprintf("  %lu bytes:\n", sizes[s]);
+		report("kmalloc", talloc);
+		report("kfree", tfree);
+	}
+
+	kmalloc_stats();
+}
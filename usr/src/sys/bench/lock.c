@@ -0,0 +1,153 @@
+/*
+ * ALIX: `sys/bench/lock.c` -- spinlock benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/sched.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * A thread pinned to each of the first `n` CPUs takes and releases the same
+ * lock `NACQUIRE` times around bumping a shared counter, all starting
+ * together. Uncontended on one CPU it is the cost of the atomics; on all of
+ * them the cost of handing the lock, and the counter's line, around. A
+ * counter short of `n * NACQUIRE` would mean two held it at once. Read
+ * locks only read the counter, they share the lock.
+ */
+
+#define NACQUIRE	20000
+
+#define K_TICKET	0
+#define K_MCS		1
+#define K_WRITE		2
+#define K_READ		3
+#define NKIND		4
+
+static const char *	kinds[NKIND] = {
+	"ticket", "MCS", "rwlock write", "rwlock read"
+};
+
+static struct {
+
+	struct spinlock	spin;
+	struct mcslock	mcs;
+	struct rwlock	rw;
+	uint64_t	counter;	/* Under whichever lock */
+
+} lk __attribute__((aligned(64))) = {
+	SPINLOCK_INIT, MCSLOCK_INIT, RWLOCK_INIT, 0
+};
+
+static struct {
+
+	int		kind;
+	struct benchteam team;
+	uint64_t	cycles[NCPU];	/* Each thread's */
+
+} run;
+
+static void
+worker(void *arg)
+{
+	struct mcsnode node;
+	uint64_t t, sum;
+	uint32_t id;
+	int i;
+
+	id = (uint32_t) (uintptr_t) arg;
+	bench_line(&run.team);
+
+	sum = 0;
+	t = tscread();
+	for (i = 0; i < NACQUIRE; i++) {
+		switch (run.kind) {
+		case K_TICKET:
+			spin_lock(&lk.spin);
+			lk.counter++;
+			spin_unlock(&lk.spin);
+			break;
+		case K_MCS:
+			mcs_lock(&lk.mcs, &node);
+			lk.counter++;
+			mcs_unlock(&lk.mcs, &node);
+			break;
+		case K_WRITE:
+			write_lock(&lk.rw);
+			lk.counter++;
+			write_unlock(&lk.rw);
+			break;
+		default:
+			read_lock(&lk.rw);
+			sum += lk.counter;
+			read_unlock(&lk.rw);
+			break;
+		}
+	}
+	run.cycles[id] = tscread() - t;
+	(void) sum;
+	bench_done(&run.team);
+}
+
+static void
+measure(int kind, uint32_t n)
+{
+	uint64_t sum;
+	uint32_t i;
+
+	run.kind = kind;
+	bench_team(&run.team, n);
+	lk.counter = 0;
+
+	for (i = 0; i < n; i++) {
+		if (thread_create("bench", worker, (void *) (uintptr_t) i,
+				PRIO_DEFAULT, i) == NULL)
+			break;
+	}
+	if (i < n) {
+		bench_drop(&run.team, n - i);
+		kprintf("  %s: only %u of %u threads started\n", kinds[kind],
+				i, n);
+		if ((n = i) == 0)
+			return;
+	}
+	bench_wait(&run.team);
+
+	sum = 0;
+	for (i = 0; i < n; i++)
+		sum += run.cycles[i];
+	kprintf("  %s, %u CPUs: %lu cycles per acquire and release",
+			kinds[kind], n, sum / (n * NACQUIRE));
+	if (kind != K_READ && lk.counter != (uint64_t) n * NACQUIRE)
+		kprintf(", counted %lu of %lu!", lk.counter,
+				(uint64_t) n * NACQUIRE);
+	kprintf("\n");
+}
+
+void
+bench_lock(struct kargtab *kargtab)
+{
+	int k;
+
+	(void) kargtab;
+
+	kprintf("Spinlocks, %d acquisitions per CPU:\n", NACQUIRE);
+	for (k = 0; k < NKIND; k++) {
+		measure(k, 1);
+		if (ncpu > 1)
+			measure(k, ncpu);
+	}
+}
@@ -0,0 +1,135 @@
+/*
+ * ALIX: `sys/bench/pmm.c` -- page allocator benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Every running CPU allocates and frees order 0 and order 9 blocks in a
+ * loop, first through its page cache and then with caching turned off so
+ * each operation takes the zone lock. The BSP starts each run by bumping
+ * `phase`, application processors waiting in `bench_pmm_ap()` join in.
+ */
+
+#define ROUNDS		256
+#define DEPTH		32		/* Blocks held at once */
+#define NPHASE		2		/* Runs */
+
+static volatile uint32_t	phase;
+static volatile uint32_t	ndone;
+static uint64_t			result[NCPU][2];	/* Cycles per order */
+
+/* Allocate `DEPTH` blocks of `order` and free them, `ROUNDS` times */
+static uint64_t
+churn(int order, int rounds)
+{
+	uintptr_t blks[DEPTH];
+	uint64_t start;
+	int r, i;
+
+	start = tscread();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < DEPTH; i++)
+			blks[i] = pmm_alloc(order);
+		for (i = DEPTH - 1; i >= 0; i--) {
+			if (blks[i] != 0)
+				pmm_free(blks[i], order);
+		}
+	}
+
+	return tscread() - start;
+}
+
+static void
+run(void)
+{
+	struct cpu *self;
+
+	self = cpu_self();
+	result[self->id][0] = churn(0, ROUNDS);
+	result[self->id][1] = churn(9, ROUNDS / 16);
+	pmm_pcp_drain();
+	__atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Application processors wait here in benchmark builds, until the last run
+ * is done and they can go on to run threads.
+ */
+void
+bench_pmm_ap(void)
+{
+	uint32_t seen;
+
+	seen = 0;
+	while (seen < NPHASE) {
+		while (phase == seen)
+			__builtin_ia32_pause();
+		seen = phase;
+		run();
+	}
+}
+
+static void
+report(struct kargtab *kargtab, const char *name)
+{
+	uint64_t ops0, ops9, sum0, sum9;
+	uint32_t c;
+
+	ops0 = (uint64_t) ROUNDS * DEPTH * 2;
+	ops9 = (uint64_t) (ROUNDS / 16) * DEPTH * 2;
+	sum0 = sum9 = 0;
+
+	kprintf("  %s:\n", name);
+	for (c = 0; c < ncpu; c++) {
+		kprintf("    cpu %u: 4 KiB %lu cycles/op, 2 MiB %lu cycles/op\n",
+				c, result[c][0] / ops0, result[c][1] / ops9);
+		sum0 += result[c][0];
+		sum9 += result[c][1];
+	}
+	if (kargtab->tsc_khz != 0 && sum0 != 0) {
+		/* CPUs run concurrently, so scale the average time per CPU */
+		kprintf("    total: %lu 4 KiB ops/ms\n", ops0 * ncpu * ncpu
+				* kargtab->tsc_khz / sum0);
+	}
+}
+
+void
+bench_pmm(struct kargtab *kargtab)
+{
+	kprintf("\nbench: pmm, %u CPUs, %d blocks deep\n", ncpu, DEPTH);
+
+	ndone = 0;
+	__atomic_add_fetch(&phase, 1, __ATOMIC_RELEASE);
+	run();
+	while (ndone != ncpu)
+		__builtin_ia32_pause();
+	report(kargtab, "per-CPU caches");
+
+	pmm_pcp_tune(0, 0, 0);
+	pmm_pcp_tune(9, 0, 0);
+	ndone = 0;
+	__atomic_add_fetch(&phase, 1, __ATOMIC_RELEASE);
+	run();
+	while (ndone != ncpu)
+		__builtin_ia32_pause();
+	report(kargtab, "zone lock only");
+
+	pmm_pcp_tune(0, 48, 16);
+	pmm_pcp_tune(9, 8, 2);
+	pmm_stats();
+}
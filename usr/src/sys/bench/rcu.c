@@ -0,0 +1,259 @@
+/*
+ * ALIX: `sys/bench/rcu.c` -- RCU against rwlock benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/kmalloc.h>
+#include <sys/sched.h>
+#include <sys/rcu.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * A shared hash table, read-mostly: a reader pinned to every CPU but the
+ * first looks up random keys while a writer on the first updates one entry
+ * every `WRITE_GAP` cycles. Under the rwlock every lookup writes the lock's
+ * cache line, and the writer holds all of them off; under RCU a lookup
+ * writes nothing shared, and the writer replaces entries with copies and
+ * frees the old ones with `call_rcu()`. A lookup finding the wrong key
+ * would be a reader on freed memory. With one CPU the reader runs alone.
+ */
+
+#define NBUCKET		64
+#define NKEY		1024
+#define NLOOKUP		100000		/* Per reader */
+#define WRITE_GAP	2000
+
+struct entry {
+
+	struct rcuhead	rcu;		/* First, for `freeentry()` */
+	struct entry *	next;
+	uint32_t	key;
+	uint64_t	value;
+
+};
+
+static struct entry *	table[NBUCKET];
+static struct rwlock	tablelock = RWLOCK_INIT;
+
+static struct {
+
+	int		rcu;		/* Or the rwlock */
+	struct benchteam team;
+	uint32_t	readers;	/* Readers still running */
+	uint64_t	cycles[NCPU];	/* Each reader's */
+	uint64_t	nbad;		/* Lookups that found a wrong key */
+	uint64_t	nupdate;
+
+} run;
+
+static void
+freeentry(struct rcuhead *head)
+{
+	kfree(head);
+}
+
+/* Entry of `key`, in a read-side section or under the lock */
+static struct entry *
+lookup(uint32_t key)
+{
+	struct entry *e;
+
+	e = rcu_dereference(table[key % NBUCKET]);
+	for (; e != NULL; e = rcu_dereference(e->next))
+		if (e->key == key)
+			return e;
+
+	return NULL;
+}
+
+static void
+reader(void *arg)
+{
+	struct entry *e;
+	uint64_t seed, t, bad;
+	uint32_t id, key;
+	int i;
+
+	id = (uint32_t) (uintptr_t) arg;
+	seed = id + 1;
+	bad = 0;
+	bench_line(&run.team);
+
+	t = tscread();
+	for (i = 0; i < NLOOKUP; i++) {
+		key = bench_rand(&seed) % NKEY;
+		if (run.rcu) {
+			rcu_read_lock();
+			if ((e = lookup(key)) == NULL || e->key != key)
+				bad++;
+			rcu_read_unlock();
+		} else {
+			read_lock(&tablelock);
+			if ((e = lookup(key)) == NULL || e->key != key)
+				bad++;
+			read_unlock(&tablelock);
+		}
+	}
+	run.cycles[id] = tscread() - t;
+
+	__atomic_add_fetch(&run.nbad, bad, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&run.readers, 1, __ATOMIC_RELEASE);
+	bench_done(&run.team);
+}
+
+/* Replace the entry of `key` with an updated copy, the only writer */
+static void
+replace(uint32_t key)
+{
+	struct entry **pp, *old, *new;
+
+	pp = &table[key % NBUCKET];
+	for (; (old = *pp) != NULL; pp = &old->next)
+		if (old->key == key)
+			break;
+	if (old == NULL || (new = kmalloc(sizeof(struct entry), 0)) == NULL)
+		return;
+
+	new->next = old->next;
+	new->key = key;
+	new->value = old->value + 1;
+	rcu_assign_pointer(*pp, new);
+	call_rcu(&old->rcu, freeentry);
+}
+
+static void
+writer(void *arg)
+{
+	struct entry *e;
+	uint64_t seed, n, end;
+	uint32_t key;
+
+	(void) arg;
+
+	seed = 0x5EED;
+	n = 0;
+	bench_line(&run.team);
+
+	while (__atomic_load_n(&run.readers, __ATOMIC_ACQUIRE) != 0) {
+		key = bench_rand(&seed) % NKEY;
+		if (run.rcu) {
+			replace(key);
+		} else {
+			write_lock(&tablelock);
+			if ((e = lookup(key)) != NULL)
+				e->value++;
+			write_unlock(&tablelock);
+		}
+		n++;
+
+		end = tscread() + WRITE_GAP;
+		while (tscread() < end)
+			__builtin_ia32_pause();
+	}
+
+	run.nupdate = n;
+	bench_done(&run.team);
+}
+
+static void
+measure(int rcu)
+{
+	uint64_t sum;
+	uint32_t i, first, nreader;
+
+	/* Readers on every CPU but the writer's */
+	first = ncpu > 1 ? 1 : 0;
+	nreader = ncpu - first;
+
+	run.rcu = rcu;
+	bench_team(&run.team, nreader + first);
+	run.readers = nreader;
+	run.nbad = 0;
+	run.nupdate = 0;
+
+	for (i = 0; i < nreader; i++) {
+		if (thread_create("bench", reader, (void *) (uintptr_t) i,
+				PRIO_DEFAULT, first + i) == NULL)
+			break;
+	}
+	if (i < nreader) {
+		__atomic_sub_fetch(&run.readers, nreader - i,
+				__ATOMIC_ACQ_REL);
+		bench_drop(&run.team, nreader - i);
+		nreader = i;
+	}
+	if (first && thread_create("bench", writer, NULL, PRIO_DEFAULT, 0)
+	    == NULL)
+		bench_drop(&run.team, 1);
+	bench_wait(&run.team);
+	if (nreader == 0)
+		return;
+
+	sum = 0;
+	for (i = 0; i < nreader; i++)
+		sum += run.cycles[i];
+	kprintf("  %s, %u readers: %lu cycles per lookup, %lu updates",
+			rcu ? "RCU" : "rwlock", nreader,
+			sum / ((uint64_t) nreader * NLOOKUP), run.nupdate);
+	if (run.nbad != 0)
+		kprintf(", %lu lookups went wrong!", run.nbad);
+	kprintf("\n");
+}
+
+void
+bench_rcu(struct kargtab *kargtab)
+{
+	struct entry *e;
+	uint64_t t;
+	uint32_t key, b;
+	int i;
+
+	for (key = 0; key < NKEY; key++) {
+		if ((e = kmalloc(sizeof(struct entry), 0)) == NULL)
+			break;
+		b = key % NBUCKET;
+		e->key = key;
+		e->value = 0;
+		e->next = table[b];
+		table[b] = e;
+	}
+
+	kprintf("RCU against rwlock, table of %d keys, %d lookups per reader, "
+			"an update every %d cycles:\n", NKEY, NLOOKUP,
+			WRITE_GAP);
+	if (key == NKEY) {
+		measure(0);
+		measure(1);
+	}
+
+	/* Every replaced entry is freed once it returns */
+	t = tscread();
+	for (i = 0; i < 16; i++)
+		synchronize_rcu();
+	t = (tscread() - t) / 16;
+	kprintf("  synchronize_rcu(): %lu cycles, %lu us\n", t,
+			BENCH_US(kargtab, t));
+
+	for (b = 0; b < NBUCKET; b++) {
+		while ((e = table[b]) != NULL) {
+			table[b] = e->next;
+			kfree(e);
+		}
+	}
+
+	rcu_stats();
+}
@@ -0,0 +1,141 @@
+/*
+ * ALIX: `sys/bench/sched.c` -- context switch benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/sched.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Two threads trading the processor. Yielding to each other on one CPU is
+ * the bare switch. Ping-pong, each unparking the other and parking, adds
+ * the wakeup, and across two CPUs the interrupt that brings the other out
+ * of `halt()`; a round trip is two wakeups. The main thread parks until
+ * both are done.
+ */
+
+#define NROUNDS		10000
+
+struct pair {
+
+	struct thread *	a;
+	struct thread *	b;
+	struct benchteam team;
+	uint64_t	cycles;		/* Measured by `a` */
+
+};
+
+static void
+yielder(void *arg)
+{
+	struct pair *p;
+	uint64_t t;
+	int i;
+
+	p = arg;
+	t = tscread();
+	for (i = 0; i < NROUNDS; i++)
+		thread_yield();
+	t = tscread() - t;
+
+	/* Both take about as long, keep either */
+	p->cycles = t;
+	bench_done(&p->team);
+}
+
+static void
+ping(void *arg)
+{
+	struct pair *p;
+	uint64_t t;
+	int i;
+
+	p = arg;
+	p->a = thread_self();
+	t = tscread();
+	for (i = 0; i < NROUNDS; i++) {
+		thread_unpark(p->b);
+		thread_park();
+	}
+	p->cycles = tscread() - t;
+	bench_done(&p->team);
+}
+
+static void
+pong(void *arg)
+{
+	struct pair *p;
+	int i;
+
+	p = arg;
+	for (i = 0; i < NROUNDS; i++) {
+		thread_park();
+		thread_unpark(p->a);
+	}
+	bench_done(&p->team);
+}
+
+/* Run `fa` on CPU `a` and `fb` on CPU `b`, returns the cycles `fa` took */
+static uint64_t
+run(void (*fa)(void *), int a, void (*fb)(void *), int b)
+{
+	struct pair p;
+
+	p.a = NULL;
+	p.cycles = 0;
+	bench_team(&p.team, 2);
+
+	if ((p.b = thread_create("bench", fb, &p, PRIO_DEFAULT, b)) == NULL)
+		return 0;
+	if (thread_create("bench", fa, &p, PRIO_DEFAULT, a) == NULL)
+		bench_drop(&p.team, 1);
+	bench_wait(&p.team);
+
+	return p.cycles;
+}
+
+static void
+report(const char *name, int a, int b, uint64_t cycles)
+{
+	if (cycles == 0) {
+		kprintf("  %s, cpu %d and %d: could not run\n", name, a, b);
+		return;
+	}
+
+	/* Each round is two switches */
+	kprintf("  %s, cpu %d and %d: %lu cycles per switch\n", name, a, b,
+			cycles / (2 * NROUNDS));
+}
+
+void
+bench_sched(struct kargtab *kargtab)
+{
+	int far;
+
+	(void) kargtab;
+
+	kprintf("Context switches, %d rounds, %u CPUs:\n", NROUNDS, ncpu);
+
+	report("yield", 0, 0, run(yielder, 0, yielder, 0));
+	report("ping-pong", 0, 0, run(ping, 0, pong, 0));
+	if (ncpu > 1)
+		report("ping-pong", 0, 1, run(ping, 0, pong, 1));
+	far = ncpu - 1;
+	if (far > 1)
+		report("ping-pong", 0, far, run(ping, 0, pong, far));
+
+	sched_stats();
+}
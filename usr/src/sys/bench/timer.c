@@ -0,0 +1,72 @@
+/*
+ * ALIX: `sys/bench/timer.c` -- timer latency and idle benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/timer.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * A chain of one-shot timers, each armed by the last one's callback 20 to
+ * 500 us ahead, while the processor halts in between: how late callbacks
+ * run past their deadline is interrupt delivery, entry and the wheel. Then
+ * a one second sleep with nothing else pending, which tickless takes a
+ * single interrupt for where a 1 kHz tick would take a thousand.
+ */
+
+#define NSHOT		256
+
+static struct timer		shot;
+static uint64_t			late[NSHOT];
+static volatile int		nshot;
+static uint64_t			seed = 88172645463325252ULL;
+
+static void
+fire(void *arg)
+{
+	(void) arg;
+
+	late[nshot] = tscread() - shot.expires;
+	if (++nshot < NSHOT)
+		timer_add(&shot, 20000 + bench_rand(&seed) % 480000);
+}
+
+void
+bench_timer(struct kargtab *kargtab)
+{
+	uint64_t flags;
+
+	if (!timer_ready)
+		return;
+
+	kprintf("\nbench: timer, %d one-shot timers\n", NSHOT);
+	nshot = 0;
+	shot.prev = NULL;
+	shot.func = fire;
+	shot.arg = NULL;
+	flags = intr_save();
+	timer_add(&shot, 20000);
+	while (nshot < NSHOT)
+		halt();
+	intr_restore(flags);
+
+	bench_sort(late, NSHOT);
+	kprintf("  late by (cycles): p50 %lu, p99 %lu, max %lu\n",
+			late[NSHOT / 2], late[NSHOT * 99 / 100],
+			late[NSHOT - 1]);
+
+	/* Rates over the sleep alone */
+	timer_stats();
+	timer_sleep(1000000000);
+	timer_stats();
+}
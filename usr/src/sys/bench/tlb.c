@@ -0,0 +1,117 @@
+/*
+ * ALIX: `sys/bench/tlb.c` -- TLB reach benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/vmm.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Touch one word of every page of a 64 MiB buffer, pages in random order, so
+ * nearly every access needs a translation the TLB does not hold. 16384 4 KiB
+ * pages are far more than any TLB caches, 32 2 MiB pages are not. The same
+ * walk runs over a buffer mapped with 4 KiB pages, one mapped with 2 MiB
+ * pages, and one faulted in a page at a time before and after
+ * `vmm_collapse()` promoted it.
+ */
+
+#define BUFSZ		(64ULL << 20)
+#define NPAGES		(BUFSZ / PAGE_SIZE)
+#define PASSES		8
+
+static uint32_t		perm[NPAGES];
+
+static void
+shuffle(void)
+{
+	uint64_t x;
+	uint32_t i, j, t;
+
+	for (i = 0; i < NPAGES; i++)
+		perm[i] = i;
+
+	/* Fisher-Yates */
+	x = 88172645463325252ULL;
+	for (i = NPAGES - 1; i > 0; i--) {
+		j = bench_rand(&x) % (i + 1);
+		t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+}
+
+/* Cycles per access, a different cache line in each page */
+static uint64_t
+walkbuf(volatile uint64_t *buf)
+{
+	uint64_t t, sum;
+	uint32_t i;
+	int pass;
+
+	sum = 0;
+	t = tscread();
+	for (pass = 0; pass < PASSES; pass++) {
+		for (i = 0; i < NPAGES; i++)
+			sum += buf[perm[i] * (PAGE_SIZE / 8) + (i % 64) * 8];
+	}
+	t = tscread() - t;
+	(void) sum;
+
+	return t / (PASSES * NPAGES);
+}
+
+static void
+run(const char *name, int flags)
+{
+	volatile uint64_t *buf;
+
+	if ((buf = vmalloc(BUFSZ, flags)) == NULL) {
+		kprintf("  %s: out of memory\n", name);
+		return;
+	}
+	walkbuf(buf);
+	kprintf("  %s: %lu cycles per access\n", name, walkbuf(buf));
+	vfree((void *) buf);
+}
+
+void
+bench_tlb(struct kargtab *kargtab)
+{
+	volatile uint64_t *buf;
+	uint64_t before, t;
+
+	shuffle();
+	kprintf("TLB reach, %lu MiB a page at a time in random order:\n",
+			BUFSZ >> 20);
+	run("4 KiB pages", VM_NOW | VM_NOHUGE);
+	run("2 MiB pages", VM_NOW);
+
+	/* Faulted in, then promoted */
+	if ((buf = vmalloc(BUFSZ, 0)) == NULL) {
+		kprintf("  lazy: out of memory\n");
+		return;
+	}
+	walkbuf(buf);
+	before = walkbuf(buf);
+	t = tscread();
+	while (vmm_collapse(NPAGES) != 0)
+		;
+	t = tscread() - t;
+	kprintf("  faulted in: %lu cycles per access, %lu after collapsing "
+			"(%lu us)\n", before, walkbuf(buf),
+			BENCH_US(kargtab, t));
+	vfree((void *) buf);
+
+	vmm_stats();
+}
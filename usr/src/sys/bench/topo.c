@@ -0,0 +1,196 @@
+/*
+ * ALIX: `sys/bench/topo.c` -- topology and thread placement benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/sched.h>
+#include <sys/topo.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * What the domain levels stand for: a cache line handed back and forth
+ * between CPU 0 and the nearest CPU at each level, by two threads pinned
+ * there spinning on it. Then where the scheduler puts unpinned threads
+ * started from CPU 0 while it is busy, and the ones before them keep
+ * theirs busy: as near as there are idle CPUs, whole cores first.
+ */
+
+#define NBOUNCE		10000
+#define SPIN_US		2000		/* Placed threads stay busy */
+#define TURN_OFF	2		/* Side 0 did not start */
+
+struct bounce {
+
+	uint32_t	turn;		/* The line handed over */
+	uint8_t		pad[60];
+	struct benchteam team;
+	uint64_t	cycles;		/* Measured by side 0 */
+
+};
+
+static struct bounce	bnc __attribute__((aligned(64)));
+
+struct placed {
+
+	struct benchteam team;
+	uint64_t	spin;		/* Cycles to stay busy */
+	uint32_t	cpu[NCPU];	/* Where each thread ran */
+
+};
+
+static struct placed	plc;
+
+static void
+side0(void *arg)
+{
+	uint64_t t;
+	int i;
+
+	(void) arg;
+
+	t = tscread();
+	for (i = 0; i < NBOUNCE; i++) {
+		while (__atomic_load_n(&bnc.turn, __ATOMIC_ACQUIRE) != 0)
+			__builtin_ia32_pause();
+		__atomic_store_n(&bnc.turn, 1, __ATOMIC_RELEASE);
+	}
+	bnc.cycles = tscread() - t;
+	bench_done(&bnc.team);
+}
+
+static void
+side1(void *arg)
+{
+	uint32_t turn;
+	int i;
+
+	(void) arg;
+
+	for (i = 0; i < NBOUNCE; i++) {
+		while ((turn = __atomic_load_n(&bnc.turn,
+				__ATOMIC_ACQUIRE)) != 1) {
+			if (turn == TURN_OFF)
+				goto out;
+			__builtin_ia32_pause();
+		}
+		__atomic_store_n(&bnc.turn, 0, __ATOMIC_RELEASE);
+	}
+out:
+	bench_done(&bnc.team);
+}
+
+/* Cycles per round trip of the line between CPUs 0 and `b`, 0 on failure */
+static uint64_t
+bounce(uint32_t b)
+{
+	bnc.turn = 0;
+	bnc.cycles = 0;
+	bench_team(&bnc.team, 2);
+
+	if (thread_create("bench", side1, NULL, PRIO_DEFAULT, b) == NULL)
+		return 0;
+	if (thread_create("bench", side0, NULL, PRIO_DEFAULT, 0) == NULL) {
+		__atomic_store_n(&bnc.turn, TURN_OFF, __ATOMIC_RELEASE);
+		bench_drop(&bnc.team, 1);
+	}
+	bench_wait(&bnc.team);
+
+	return bnc.cycles / NBOUNCE;
+}
+
+static void
+spinner(void *arg)
+{
+	uint64_t end;
+	uint32_t i;
+
+	i = (uint32_t) (uintptr_t) arg;
+	plc.cpu[i] = thread_self()->cpu;
+	end = tscread() + plc.spin;
+	while (tscread() < end)
+		__builtin_ia32_pause();
+	bench_done(&plc.team);
+}
+
+static void
+placement(struct kargtab *kargtab)
+{
+	uint32_t atlevel[NTOPO];
+	uint64_t used;
+	uint32_t i, n;
+	int l;
+
+	plc.spin = kargtab->tsc_khz ? kargtab->tsc_khz * SPIN_US / 1000
+	    : 4000000;
+
+	/* One for every other CPU, all busy at once */
+	n = ncpu - 1;
+	bench_team(&plc.team, n);
+	for (i = 0; i < n; i++) {
+		if (thread_create("bench", spinner, (void *) (uintptr_t) i,
+				PRIO_DEFAULT, -1) == NULL)
+			break;
+	}
+	bench_drop(&plc.team, n - i);
+	n = i;
+	bench_wait(&plc.team);
+
+	for (l = 0; l < NTOPO; l++)
+		atlevel[l] = 0;
+	used = 0;
+	for (i = 0; i < n; i++) {
+		atlevel[topo_level(0, plc.cpu[i])]++;
+		used |= 1ULL << plc.cpu[i];
+	}
+
+	kprintf("  placement: %u threads from cpu 0 on %d CPUs,", n,
+			__builtin_popcountll(used));
+	if (used & 1)
+		kprintf(" cpu 0 itself,");
+	for (l = 0; l < NTOPO; l++)
+		kprintf(" %s %u", topo_name(l), atlevel[l]);
+	kprintf("\n");
+}
+
+void
+bench_topo(struct kargtab *kargtab)
+{
+	uint64_t c;
+	uint32_t j;
+	int l;
+
+	if (ncpu < 2)
+		return;
+
+	kprintf("Topology, cache line round trips from cpu 0, %d each:\n",
+			NBOUNCE);
+	for (l = 0; l < NTOPO; l++) {
+		for (j = 1; j < ncpu; j++)
+			if (topo_level(0, j) == l)
+				break;
+		if (j == ncpu)
+			continue;
+
+		if ((c = bounce(j)) == 0)
+			kprintf("  %s, cpu %u: could not run\n", topo_name(l),
+					j);
+		else
+			kprintf("  %s, cpu %u: %lu cycles\n", topo_name(l), j,
+					c);
+	}
+
+	placement(kargtab);
+}
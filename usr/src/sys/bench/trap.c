@@ -0,0 +1,54 @@
+/*
+ * ALIX: `sys/bench/trap.c` -- interrupt entry/exit benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Round trips through an empty handler: `int 0xF0` enters like any device
+ * interrupt and takes the fast path, `int3` takes the full save of
+ * exceptions. The difference is what saving every register costs. Software
+ * interrupts skip the APIC, so this is the entry stub, dispatch and `iretq`
+ * alone, less the cost of reading the TSC.
+ */
+
+#define NOPS		4096
+
+static void
+empty(struct trapframe *tf)
+{
+	(void) tf;
+}
+
+void
+bench_trap(struct kargtab *kargtab)
+{
+	Traphandler soft, bp;
+	uint64_t base;
+
+	(void) kargtab;
+
+	soft = trap_register(T_SOFT, empty);
+	bp = trap_register(T_BP, empty);
+	base = bench_overhead();
+
+	kprintf("Trap entry and exit, %d round trips:\n", NOPS);
+	bench_minmean("interrupt (caller-saved registers)", softint, NOPS,
+			base);
+	bench_minmean("exception (all registers)", breakpoint, NOPS, base);
+
+	trap_register(T_SOFT, soft);
+	trap_register(T_BP, bp);
+}
@@ -0,0 +1,141 @@
+/*
+ * ALIX: `sys/bench/util.c` -- helpers shared by the benchmarks
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/sched.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/* Next of xorshift64 sequence `state`, which must not start at 0 */
+uint64_t
+bench_rand(uint64_t *state)
+{
+	uint64_t x;
+
+	x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+/* Sort `v` ascending, Shell sort: small and good enough for percentiles */
+void
+bench_sort(uint64_t *v, int n)
+{
+	uint64_t x;
+	int gap, i, j;
+
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			x = v[i];
+			for (j = i; j >= gap && v[j - gap] > x; j -= gap)
+				v[j] = v[j - gap];
+			v[j] = x;
+		}
+	}
+}
+
+/* Cycles reading the TSC itself takes, the least of a few tries */
+uint64_t
+bench_overhead(void)
+{
+	uint64_t t, min;
+	int i;
+
+	min = UINT64_MAX;
+	for (i = 0; i < 64; i++) {
+		t = tscread();
+		t = tscread() - t;
+		if (t < min)
+			min = t;
+	}
+
+	return min;
+}
+
+/* Time `op` `n` times, less `base` cycles each, and print min and mean */
+void
+bench_minmean(const char *name, void (*op)(void), int n, uint64_t base)
+{
+	uint64_t t, min, sum;
+	int i;
+
+	min = UINT64_MAX;
+	sum = 0;
+	for (i = 0; i < n; i++) {
+		t = tscread();
+		op();
+		t = tscread() - t;
+		t = t > base ? t - base : 0;
+		if (t < min)
+			min = t;
+		sum += t;
+	}
+
+	kprintf("  %s: min %lu, mean %lu cycles\n", name, min, sum / n);
+}
+
+/* Set up `bt` for `n` threads, waited for by the caller */
+void
+bench_team(struct benchteam *bt, uint32_t n)
+{
+	bt->n = n;
+	bt->ready = 0;
+	bt->left = n;
+	bt->waiter = thread_self();
+}
+
+/* Count out `n` threads that could not be started */
+void
+bench_drop(struct benchteam *bt, uint32_t n)
+{
+	/* Those at the start line go without them */
+	__atomic_sub_fetch(&bt->left, n, __ATOMIC_ACQ_REL);
+	__atomic_sub_fetch(&bt->n, n, __ATOMIC_ACQ_REL);
+}
+
+/* Wait for the rest of the team at the start line */
+void
+bench_line(struct benchteam *bt)
+{
+	__atomic_add_fetch(&bt->ready, 1, __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(&bt->ready, __ATOMIC_ACQUIRE)
+	    != __atomic_load_n(&bt->n, __ATOMIC_ACQUIRE))
+		__builtin_ia32_pause();
+}
+
+/* The calling thread is finished, the last one wakes the waiter */
+void
+bench_done(struct benchteam *bt)
+{
+	struct thread *w;
+
+	/* The waiter may return, and `bt` go, the moment `left` is 0 */
+	w = bt->waiter;
+	if (__atomic_sub_fetch(&bt->left, 1, __ATOMIC_ACQ_REL) == 0)
+		thread_unpark(w);
+}
+
+/* Park until every thread of `bt` is done */
+void
+bench_wait(struct benchteam *bt)
+{
+	while (__atomic_load_n(&bt->left, __ATOMIC_ACQUIRE) != 0)
+		thread_park();
+}
@@ -0,0 +1,71 @@
+/*
+ * ALIX: `sys/bench/vt.c` -- virtual terminal output benchmark
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/bench/bench.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/page.h>
+#include <sys/dev/fb.h>
+#include <sys/dev/vt.h>
+#include <sys/dev/console.h>
+
+/*
+ * Time `vt_putc()` writing through the direct map alias of the framebuffer
+ * (memory type left to the firmware's MTRRs, usually uncached) and through
+ * the write-combining window at `FB_BASE`. Lines are long enough to wrap and
+ * there are enough of them to scroll, which reads back the framebuffer.
+ */
+
+#define NCHARS		16384
+#define LINELEN		100
+
+static uint64_t
+run(void)
+{
+	uint64_t start;
+	int i;
+
+	start = tscread();
+	for (i = 0; i < NCHARS; i++)
+		vt_putc(i % LINELEN == LINELEN - 1 ? '\n' : '!' + i % 94);
+
+	return tscread() - start;
+}
+
+static void
+report(struct kargtab *kargtab, const char *name, uint64_t cyc)
+{
+	uint64_t us;
+
+	us = BENCH_US(kargtab, cyc);
+	kprintf("  %s: %lu cycles/char, %lu chars/s\n", name, cyc / NCHARS,
+			us ? NCHARS * 1000000ULL / us : 0);
+}
+
+void
+bench_vt(struct kargtab *kargtab)
+{
+	uintptr_t wc;
+	uint64_t dmap, wcomb;
+
+	wc = fb_remap(P2V(FRAMEBUFFER.physbase));
+	dmap = run();
+	fb_remap(wc);
+	wcomb = run();
+
+	kprintf("\nbench: vt_putc, %d chars\n", NCHARS);
+	report(kargtab, "direct map", dmap);
+	if (wc != P2V(FRAMEBUFFER.physbase))
+		report(kargtab, "write-combining", wcomb);
+	else
+		kprintf("  write-combining: no window mapped\n");
+}
@@ -0,0 +1,390 @@
+/*
+ * ALIX: `sys/clock.c` -- TSC clocksource and kernel time
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <efi.h>
+#include <sys/kargtab.h>
+#include <sys/acpi.h>
+#include <sys/lock.h>
+#include <sys/vmm.h>
+#include <sys/clock.h>
+#include <sys/x64/page.h>
+#include <sys/x64/pat.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/io.h>
+#include <sys/dev/console.h>
+
+/*
+ * All time is the TSC. The bootloader's estimate of its rate, taken over a
+ * millisecond of the firmware's stall service, is refined at boot against a
+ * fixed frequency reference: the HPET if there is one, else the ACPI power
+ * management timer. Monotonic time counts from processor reset. Real time
+ * is monotonic time plus the offset read from the firmware's clock.
+ *
+ * This needs an invariant TSC, one that ticks at the same rate in every
+ * power state. Without one time runs slow whenever the processor does.
+ */
+
+#define CAL_MS		20		/* Calibration window */
+#define CAL_TRIES	5		/* Samples to bracket a reading */
+#define PMTMR_HZ	3579545
+
+/* HPET registers */
+#define HPET_CAP	0x000		/* Capabilities, period in bits 63:32 */
+#define HPET_CONF	0x010
+#define HPET_COUNTER	0x0F0
+#define HPET_ENABLE	(1 << 0)	/* `HPET_CONF`, counter runs */
+
+#define CLOCK_SHIFT	32
+
+static union {
+
+	struct clockdata	d;
+	uint8_t			page[PAGE_SIZE];
+
+} clockpage __attribute__((aligned(PAGE_SIZE)));
+
+const struct clockdata	*clockdata = &clockpage.d;
+static struct spinlock	clocklock = SPINLOCK_INIT;	/* Writers */
+
+/* Reference counter, wrapping at `refmask` */
+static uint32_t		(*refread)(void);
+static uint32_t		refmask;
+static uint64_t		refhz;
+
+static volatile uint32_t *hpet;
+static uint16_t		pmtmr;
+
+static uint32_t
+hpetread(void)
+{
+	return hpet[HPET_COUNTER / 4];
+}
+
+static uint32_t
+pmtmrread(void)
+{
+	return inl(pmtmr);
+}
+
+static int
+hpet_init(void)
+{
+	Acpi_hpet *t;
+	uint64_t period;
+
+	t = (Acpi_hpet *) acpi_find("HPET");
+	if (t == NULL || t->base.space != GAS_MEMORY || t->base.addr == 0)
+		return -1;
+
+	hpet = vmap(t->base.addr, PAGE_SIZE, PTE_W | PAT_UC);
+	if (hpet == NULL)
+		return -1;
+
+	/* Femtoseconds a tick, at most 100 ns */
+	period = hpet[HPET_CAP / 4 + 1];
+	if (period == 0 || period > 100000000)
+		return -1;
+
+	hpet[HPET_CONF / 4] |= HPET_ENABLE;
+	refread = hpetread;
+	refmask = UINT32_MAX;
+	refhz = 1000000000000000ULL / period;
+
+	return 0;
+}
+
+static int
+pmtmr_init(void)
+{
+	Acpi_fadt *f;
+
+	f = (Acpi_fadt *) acpi_find("FACP");
+	if (f == NULL)
+		return -1;
+
+	if (f->hdr.length >= offsetof(Acpi_fadt, x_pm_tmr_blk)
+			+ sizeof(Acpi_gas) && f->x_pm_tmr_blk.addr != 0
+	&& f->x_pm_tmr_blk.space == GAS_IO)
+		pmtmr = f->x_pm_tmr_blk.addr;
+	else if (f->pm_tmr_len == 4)
+		pmtmr = f->pm_tmr_blk;
+	if (pmtmr == 0)
+		return -1;
+
+	refread = pmtmrread;
+	refmask = (f->flags & FADT_TMR_VAL_EXT) ? UINT32_MAX : 0xFFFFFF;
+	refhz = PMTMR_HZ;
+
+	return 0;
+}
+
+/*
+ * Read the reference counter and the TSC at the same moment. An SMI or a
+ * slow read would stretch the moment, so take the tightest of a few tries.
+ */
+static uint32_t
+refsample(uint64_t *tsc)
+{
+	uint64_t t0, t1, best;
+	uint32_t r, ref;
+	int i;
+
+	best = UINT64_MAX;
+	ref = 0;
+	for (i = 0; i < CAL_TRIES; i++) {
+		t0 = tscread();
+		r = refread();
+		t1 = tscread();
+		if (t1 - t0 < best) {
+			best = t1 - t0;
+			ref = r;
+			*tsc = t0 + best / 2;
+		}
+	}
+
+	return ref;
+}
+
+/* TSC frequency measured over `CAL_MS` of the reference counter */
+static uint64_t
+calibrate(void)
+{
+	uint64_t t0, t1, ticks;
+	uint32_t r0, r1;
+
+	ticks = refhz * CAL_MS / 1000;
+	r0 = refsample(&t0);
+	while (((refread() - r0) & refmask) < ticks)
+		__builtin_ia32_pause();
+	r1 = refsample(&t1);
+
+	ticks = (r1 - r0) & refmask;
+	if (ticks == 0)
+		return 0;
+
+	return (t1 - t0) * refhz / ticks;
+}
+
+static uint64_t
+scale(uint64_t cyc, uint64_t mult, uint32_t shift)
+{
+	return ((unsigned __int128) cyc * mult) >> shift;
+}
+
+/* Wait out a writer, return the sequence count to check against */
+static uint32_t
+readbegin(const struct clockdata *c)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)) & 1)
+		__builtin_ia32_pause();
+
+	return seq;
+}
+
+/* Whether what was read since `readbegin()` may be torn */
+static int
+readretry(const struct clockdata *c, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Returns the flags to give `writeend()` */
+static uint64_t
+writebegin(struct clockdata *c)
+{
+	uint64_t flags;
+
+	/* A reader interrupting the writer would wait on it forever */
+	flags = spin_lock_irqsave(&clocklock);
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return flags;
+}
+
+static void
+writeend(struct clockdata *c, uint64_t flags)
+{
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+	spin_unlock_irqrestore(&clocklock, flags);
+}
+
+/* Nanoseconds since processor reset, 0 before `clock_init()` */
+uint64_t
+ktime_get_ns(void)
+{
+	const struct clockdata *c;
+	uint64_t ns;
+	uint32_t seq;
+
+	c = clockdata;
+	do {
+		seq = readbegin(c);
+		ns = c->ns_base + scale(tscread() - c->tsc_base, c->mult,
+				c->shift);
+	} while (readretry(c, seq));
+
+	return ns;
+}
+
+/* Nanoseconds since 1970 (UTC), 0 if the time of day is unknown */
+uint64_t
+ktime_get_real_ns(void)
+{
+	const struct clockdata *c;
+	uint64_t ns, real;
+	uint32_t seq;
+
+	c = clockdata;
+	do {
+		seq = readbegin(c);
+		real = c->real_base;
+		ns = c->ns_base + scale(tscread() - c->tsc_base, c->mult,
+				c->shift);
+	} while (readretry(c, seq));
+
+	return real != 0 ? real + ns : 0;
+}
+
+/* Set the time of day to `real_ns` nanoseconds since 1970 (UTC) */
+void
+clock_settime(uint64_t real_ns)
+{
+	struct clockdata *c;
+	uint64_t flags;
+
+	c = &clockpage.d;
+	flags = writebegin(c);
+	c->real_base = real_ns - (c->ns_base + scale(tscread() - c->tsc_base,
+			c->mult, c->shift));
+	writeend(c, flags);
+}
+
+/* Days from 1970-01-01 to the given date of the Gregorian calendar */
+static uint64_t
+days(uint32_t y, uint32_t m, uint32_t d)
+{
+	uint32_t era, yoe, doy, doe;
+
+	/* Years start in March, putting the leap day last */
+	if (m <= 2)
+		y--;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (uint64_t) era * 146097 + doe - 719468;
+}
+
+/*
+ * Real time from the firmware's clock, in nanoseconds since 1970, 0 if it
+ * cannot be read. Most firmware keeps the clock in UTC and leaves the time
+ * zone unspecified, anything else is taken as UTC too.
+ */
+static uint64_t
+efi_time(struct kargtab *kargtab)
+{
+	Efi_runtime_services *rt;
+	Efi_time tm;
+	Efi_status s;
+	uint64_t flags;
+
+	if (kargtab->runtime_srv == 0)
+		return 0;
+	rt = (Efi_runtime_services *) kargtab->runtime_srv;
+
+	/* At its physical address, through the identity map */
+	flags = intr_save();
+	s = rt->get_time(&tm, NULL);
+	intr_restore(flags);
+	if (s != EFI_SUCCESS)
+		return 0;
+
+	if (tm.year < 1970 || tm.month < 1 || tm.month > 12 || tm.day < 1
+	|| tm.day > 31 || tm.hour > 23 || tm.minute > 59 || tm.second > 59
+	|| tm.nanosecond >= NSEC_PER_SEC)
+		return 0;
+
+	return ((days(tm.year, tm.month, tm.day) * 24 + tm.hour) * 3600
+			+ tm.minute * 60 + tm.second) * NSEC_PER_SEC
+			+ tm.nanosecond;
+}
+
+/*
+ * Calibrate the TSC and publish the clock, needs `acpi_init()` and
+ * `vmm_init()`. Updates `kargtab->tsc_khz` for those that work in cycles.
+ */
+void
+clock_init(struct kargtab *kargtab)
+{
+	struct clockdata *c;
+	const char *ref;
+	uint32_t regs[4];
+	uint64_t hz, khz, real, flags;
+
+	/* CPUID.80000007H:EDX[8] */
+	cpuid(0x80000000, 0, regs);
+	if (regs[0] >= 0x80000007) {
+		cpuid(0x80000007, 0, regs);
+		if (((regs[3] >> 8) & 1) == 0)
+			kprintf("clock: TSC not invariant, time will drift\n");
+	}
+
+	hz = 0;
+	ref = "bootloader estimate";
+	if (hpet_init() == 0)
+		ref = "HPET";
+	else if (pmtmr_init() == 0)
+		ref = "ACPI PM timer";
+	if (refread != NULL) {
+		flags = intr_save();
+		hz = calibrate();
+		intr_restore(flags);
+	}
+
+	/* Off by more than the bootloader could have been, keep its estimate */
+	khz = kargtab->tsc_khz;
+	if (hz == 0 || (khz != 0 && (hz / 1000 < khz / 2
+	|| hz / 1000 > khz * 2))) {
+		hz = khz * 1000;
+		ref = "bootloader estimate";
+	}
+	if (hz == 0) {
+		kprintf("clock: TSC rate unknown, no clock\n");
+		return;
+	}
+	kargtab->tsc_khz = hz / 1000;
+
+	real = efi_time(kargtab);
+
+	c = &clockpage.d;
+	flags = writebegin(c);
+	c->shift = CLOCK_SHIFT;
+	c->mult = (NSEC_PER_SEC << CLOCK_SHIFT) / hz;
+	c->tsc_base = 0;
+	c->ns_base = 0;
+	c->tsc_hz = hz;
+	writeend(c, flags);
+
+	if (real != 0)
+		clock_settime(real);
+
+	kprintf("clock: TSC %lu Hz (%s)", hz, ref);
+	if (real != 0)
+		kprintf(", %lu s since 1970", real / NSEC_PER_SEC);
+	kprintf("\n");
+}
@@ -0,0 +1,45 @@
+/*
+ * ALIX: `sys/clock.h` -- TSC clocksource and kernel time
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#define NSEC_PER_SEC	1000000000ULL
+
+/*
+ * What it takes to turn the TSC into time, alone in a page so user space
+ * can be given a read-only mapping of it and read the clock without a
+ * system call. Readers take no lock. They read `seq`, which is odd while a
+ * writer is updating the rest, and start over if it changed meanwhile.
+ *
+ * 	ns = ns_base + ((tsc - tsc_base) * mult >> shift)
+ *
+ * with the product taken to 128 bits, so it never overflows.
+ */
+struct clockdata {
+
+	uint32_t	seq;
+	uint32_t	shift;
+	uint64_t	mult;
+	uint64_t	tsc_base;
+	uint64_t	ns_base;	/* Monotonic time at `tsc_base` */
+	uint64_t	real_base;	/* Real time (ns since 1970, UTC) at
+					   monotonic 0, 0 if unknown */
+	uint64_t	tsc_hz;		/* TSC frequency */
+
+};
+
+extern const struct clockdata	*clockdata;
+
+void		clock_init(struct kargtab *kargtab);
+uint64_t	ktime_get_ns(void);
+uint64_t	ktime_get_real_ns(void);
+void		clock_settime(uint64_t real_ns);
+
+#endif /* _CLOCK_H_ */
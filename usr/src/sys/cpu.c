@@ -0,0 +1,81 @@
+/*
+ * ALIX: `sys/cpu.c` -- Per-CPU data
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/vmm.h>
+#include <sys/sched.h>
+#include <sys/x64/cpu.h>
+
+struct cpu	cpus[NCPU];
+uint32_t	ncpu;
+
+/* Local APIC id of the calling processor, the x2APIC id where there is one */
+static uint32_t
+apicid(void)
+{
+	uint32_t regs[4];
+
+	cpuid(0, 0, regs);
+	if (regs[0] >= 0xB) {
+		cpuid(0xB, 0, regs);
+		if (regs[1] != 0)	/* Leaf implemented */
+			return regs[3];
+	}
+	cpuid(1, 0, regs);
+
+	return regs[1] >> 24;
+}
+
+/* Set up the bootstrap processor's area, needs `numa_init()` */
+void
+cpu_init(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < NCPU; i++) {
+		cpus[i].self = &cpus[i];
+		cpus[i].id = i;
+	}
+	ncpu = 1;
+
+	cpus[0].apicid = apicid();
+	cpus[0].node = numa_cpunode(cpus[0].apicid);
+}
+
+/*
+ * Idle loop, of each processor's idle thread, with interrupts off. Threads
+ * to run, its own or stolen, come first. Spare cycles go to zeroing pages
+ * ahead of `pmm_zalloc()` and, on the bootstrap processor only, collapsing
+ * kernel mappings into 2 MiB pages: one is enough, and each collapse shoots
+ * the old mappings down in every other processor's TLB (`vmm.c`). With
+ * neither left to do the processor halts until an interrupt, which with no
+ * timers pending may be never.
+ */
+void
+cpu_idle(void)
+{
+	struct cpu *self;
+
+	self = cpu_self();
+	for (;;) {
+		if (sched_idle())
+			continue;
+		if (pmm_zero_idle(64) == 0
+		&& (self->id != 0 || vmm_collapse(1) == 0))
+			halt();
+		else
+			intr_poll();
+	}
+}
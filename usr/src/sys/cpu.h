@@ -0,0 +1,50 @@
+/*
+ * ALIX: `sys/cpu.h` -- Per-CPU data
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _CPU_H_
+#define _CPU_H_
+
+/* Needs `sys/numa.h` and `sys/pmm.h` */
+
+#define NCPU	64
+
+/*
+ * State private to one processor. Only its own CPU touches it (with
+ * interrupts off where an interrupt handler could too), so none of it is
+ * locked. The GS base of each processor points at its own. A thread may
+ * only use it with preemption disabled, or it may find itself on another
+ * processor halfway through.
+ *
+ * `x64/cpu.S` knows where `preempt` and `needresched` are.
+ */
+struct cpu {
+
+	struct cpu *	self;			/* This structure */
+	uint32_t	preempt;		/* Preemption disabled if not
+						   0, `preempt_disable()` */
+	uint32_t	needresched;		/* Switch threads once
+						   `preempt` allows, set by
+						   other CPUs too */
+	uint32_t	id;			/* Index into `cpus` */
+	uint32_t	apicid;			/* Local APIC id */
+	int		node;			/* NUMA node */
+	struct pcp	pcp[PCP_NORDER];	/* Page caches, see `pmm.c` */
+	struct numastat	numa[MAXNODE];		/* Allocations, per node */
+	uint64_t	ntrap[256];		/* Traps taken, per vector */
+
+};
+
+extern struct cpu	cpus[NCPU];
+extern uint32_t		ncpu;		/* CPUs running */
+
+void		cpu_init(void);
+struct cpu *	cpu_self(void);		/* `x64/cpu.S` */
+void		cpu_idle(void);
+
+#endif /* _CPU_H_ */
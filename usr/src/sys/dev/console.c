@@ -13,9 +13,19 @@
 #include <stdarg.h>
 
 #include <sys/kargtab.h>
+#include <sys/lock.h>
 #include <sys/dev/uart.h>
 #include <sys/dev/vt.h>
 
+/*
+ * One lock covers all output, taken once per call, so messages from
+ * several processors come out whole rather than interleaved. All of them
+ * may print at once, so it is an MCS lock. Interrupts are off while it is
+ * held: a handler printing on the holder's processor would wait on it
+ * forever.
+ */
+static struct mcslock	conslock = MCSLOCK_INIT;
+
 void
 console_init(struct kargtab *kargtab)
 {
@@ -23,19 +33,42 @@ console_init(struct kargtab *kargtab)
 	vt_init(kargtab);	/* Virtual terminal */
 }
 
-void
-kputc(char ch)
+/* `kputc()`, with `conslock` held */
+static void
+putch(char ch)
 {
 	uart_putc(ch);
 	vt_putc(ch);
 }
 
+static void
+putstr(char *string)
+{
+	for (; *string != '\0'; string++)
+		putch(*string);
+}
+
+void
+kputc(char ch)
+{
+	struct mcsnode n;
+	uint64_t flags;
+
+	flags = mcs_lock_irqsave(&conslock, &n);
+	putch(ch);
+	mcs_unlock_irqrestore(&conslock, &n, flags);
+}
+
 /* Print a null terminated string */
 void
 kputs(char *string)
 {
-	for (; *string != '\0'; string++)
-		kputc(*string);
+	struct mcsnode n;
+	uint64_t flags;
+
+	flags = mcs_lock_irqsave(&conslock, &n);
+	putstr(string);
+	mcs_unlock_irqrestore(&conslock, &n, flags);
 }
 
 /*
@@ -47,15 +80,15 @@ static void
 printnum(int64_t sval, int base, int sign)
 {
 	static char chars[] = "0123456789ABCDEF";
-	static char buf[32];
+	char buf[32];
 	uint64_t value;
 	int i;
 
 	if (sval == 0) {
 		if (base == 10)
-			kputc('0');
+			putch('0');
 		else if (base == 16)
-			kputs("0x0");
+			putstr("0x0");
 		return;
 	}
 
@@ -84,7 +117,7 @@ printnum(int64_t sval, int base, int sign)
 	}
 
 	while (buf[i] != '\0') {
-		kputc(buf[i]);
+		putch(buf[i]);
 		i++;
 	}
 }
@@ -115,20 +148,26 @@ kprintf(const char *fmt, ...)
 	int sign;
 	int64_t num;
 	va_list args;
+	struct mcsnode n;
+	uint64_t flags;
 
 	va_start(args, fmt);
+	flags = mcs_lock_irqsave(&conslock, &n);
 
-	size = format = 0;
-	sign = 1;
+	format = 0;
 
 	while (*fmt != '\0') {
 		if (*fmt != '%') {
-			kputc(*fmt);
+			putch(*fmt);
 			fmt++;
 			continue;
 		}
 		fmt++;
 
+		/* Each conversion starts out plain and signed */
+		size = 0;
+		sign = 1;
+
 swtch:
 		switch (*fmt) {
 		case 'h':
@@ -143,20 +182,20 @@ swtch:
 			goto swtch;
 		case 's':
 			if (size != '\0') {
-				kputc('%');
+				putch('%');
 				continue;
 			}
 
-			kputs(va_arg(args, char*));
+			putstr(va_arg(args, char*));
 			fmt++;
 			continue;
 		case 'c':
 			if (size != '\0') {
-				kputc('%');
+				putch('%');
 				continue;
 			}
 
-			kputc((char) va_arg(args, int));
+			putch((char) va_arg(args, int));
 			fmt++;
 			continue;
 		case 'u':
@@ -171,7 +210,7 @@ swtch:
 			fmt++;
 			break;
 		default:
-			kputc('%');
+			putch('%');
 			fmt++;
 			continue;
 		}
@@ -185,6 +224,7 @@ swtch:
 		printnum(num, base, sign);
 	}
 
+	mcs_unlock_irqrestore(&conslock, &n, flags);
 	va_end(args);
 }
 
@@ -192,9 +232,14 @@ swtch:
 void
 console_write(void *buf, size_t sz)
 {
+	struct mcsnode n;
+	uint64_t flags;
+
+	flags = mcs_lock_irqsave(&conslock, &n);
 	for (; sz > 0; sz--) {
-		kputc(*(char *)buf);
+		putch(*(char *)buf);
 		buf++;
 	}
+	mcs_unlock_irqrestore(&conslock, &n, flags);
 }
 
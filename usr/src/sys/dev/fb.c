@@ -11,6 +11,7 @@
 
 #include <efi.h>
 #include <sys/kargtab.h>
+#include <sys/x64/page.h>
 
 #define _FB_C_
 #include <sys/dev/fb.h>
@@ -24,21 +25,30 @@ void
 fb_init(struct kargtab *kargtab)
 {
 	Efi_graphics_output_protocol_mode *mode;
+	Efi_graphics_output_mode_information *info;
 	uint32_t *fb;
-	int i;
+	uint64_t i;
 
+	/* Pointers within firmware structures are physical */
 	mode = (Efi_graphics_output_protocol_mode *) kargtab->gop_mode;
+	info = (Efi_graphics_output_mode_information *) P2V(mode->info);
 
+	/*
+	 * Prefer the write-combining window the bootloader mapped, the direct
+	 * map alias remains for `fb_remap()`.
+	 */
 	FRAMEBUFFER = (struct Framebuffer) {
-		.base = (uintptr_t) mode->framebuffer_base,
-		.size = (uint64_t) mode->framebuffer_size,
-		.width = mode->info->horizontal_resolution,
-		.height = mode->info->vertical_resolution,
-		.scanlinepx = mode->info->pixels_per_scan_line,
+		.base = kargtab->fb_base != 0 ? kargtab->fb_base
+				: P2V(mode->framebuffer_base),
+		.physbase = mode->framebuffer_base,
+		.size = (uint64_t) mode->framebuffer_size / sizeof(uint32_t),
+		.width = info->horizontal_resolution,
+		.height = info->vertical_resolution,
+		.scanlinepx = info->pixels_per_scan_line,
 	};
 
 
-	switch (mode->info->pixel_format) {
+	switch (info->pixel_format) {
 
 	case PixelRedGreenBlueReserved8BitPerColor:
 		FRAMEBUFFER.redshift = 0;
@@ -74,6 +84,21 @@ fb_init(struct kargtab *kargtab)
 	}
 }
 
+/*
+ * Switch the address pixels are written through, another mapping of the same
+ * framebuffer memory (possibly with another memory type). Returns the old one.
+ */
+uintptr_t
+fb_remap(uintptr_t base)
+{
+	uintptr_t old;
+
+	old = FRAMEBUFFER.base;
+	FRAMEBUFFER.base = base;
+
+	return old;
+}
+
 /* Returns `Color` comprised of all provided pieces */
 Color
 fb_color(Color red, Color green, Color blue)
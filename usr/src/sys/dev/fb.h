@@ -12,6 +12,7 @@
 
 #define _Framebuffer struct Framebuffer { \
 	uintptr_t	base;		/* base address of framebuffer */     \
+	uintptr_t	physbase;	/* physical address */                \
 	uint64_t	size;		/* size of framebuffer (in pixels) */ \
 	uint32_t	width;		/* width in pixels */                 \
 	uint32_t	height;		/* height in pixels */                \
@@ -39,6 +40,7 @@ typedef uint32_t Color;
 
 void 	fb_init(struct kargtab *kargtab);
 Color	fb_color(Color red, Color green, Color blue);
+uintptr_t	fb_remap(uintptr_t base);
 
 #endif /* _FB_H_ */
 
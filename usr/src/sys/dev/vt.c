@@ -8,8 +8,10 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <sys/kargtab.h>
+#include <sys/lock.h>
 #include <sys/dev/fb.h>
 
 /*
@@ -34,6 +36,9 @@ static uint16_t		cols;
 static uint16_t		row;
 static uint16_t		col;
 
+/* Covers `row`, `col` and drawing, interrupts off as `kprintf()` has them */
+static struct spinlock	vtlock = SPINLOCK_INIT;
+
 /* Initialize virtual terminal */
 void
 vt_init(struct kargtab *kargtab)
@@ -115,8 +120,9 @@ scroll()
 	row = rows-1;
 }
 
-void
-vt_putc(char ch)
+/* `vt_putc()`, with `vtlock` held */
+static void
+putch(char ch)
 {
 	uint32_t x, y;
 	uint32_t *base;
@@ -124,13 +130,13 @@ vt_putc(char ch)
 	if (col == cols) {
 		col = 0;
 		row++;
-		vt_putc(ch);
+		putch(ch);
 		return;
 	}
 
 	if (row == rows) {
 		scroll();
-		vt_putc(ch);
+		putch(ch);
 		return;
 	}
 
@@ -151,3 +157,12 @@ vt_putc(char ch)
 	col++;
 }
 
+void
+vt_putc(char ch)
+{
+	uint64_t flags;
+
+	flags = spin_lock_irqsave(&vtlock);
+	putch(ch);
+	spin_unlock_irqrestore(&vtlock, flags);
+}
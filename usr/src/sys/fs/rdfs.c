@@ -0,0 +1,133 @@
+/*
+ * ALIX: `sys/fs/rdfs.c` -- Initial ramdisk filesystem
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <initrd.h>
+#include <sys/kargtab.h>
+#include <sys/dev/console.h>
+
+/*
+ * Read-only, memory backed filesystem over the initial ramdisk archive the
+ * bootloader loaded (see `initrd.h`). Lookups hand out pointers straight
+ * into the archive, nothing is copied.
+ */
+
+static Initrd_hdr *	rd;	/* Archive, NULL if not mounted */
+static Initrd_ent *	ents;	/* Index, sorted by name */
+
+static int
+namecmp(const char *a, const char *b)
+{
+	for (; *a != '\0' && *a == *b; a++, b++)
+		;
+	return (uint8_t) *a - (uint8_t) *b;
+}
+
+/*
+ * Validate the archive handed over by the bootloader and mount it.
+ * Returns 0 on success, -1 if there is no archive or it is damaged.
+ */
+int
+rdfs_mount(struct kargtab *kargtab)
+{
+	Initrd_hdr *hdr;
+	Initrd_ent *e;
+	uint32_t i;
+
+	rd = NULL;
+	if (kargtab->initrd_base == 0
+	|| kargtab->initrd_size < sizeof(Initrd_hdr))
+		return -1;
+
+	hdr = (Initrd_hdr *) kargtab->initrd_base;
+	if (hdr->magic != INITRD_MAGIC || hdr->size > kargtab->initrd_size)
+		return -1;
+	if (sizeof(Initrd_hdr) + (uint64_t) hdr->nent * sizeof(Initrd_ent)
+			> hdr->size)
+		return -1;
+
+	e = (Initrd_ent *) (hdr + 1);
+	for (i = 0; i < hdr->nent; i++) {
+		if (e[i].name[INITRD_NAMESZ - 1] != '\0'
+		|| e[i].off > hdr->size || e[i].size > hdr->size - e[i].off)
+			return -1;
+		if (i > 0 && namecmp(e[i - 1].name, e[i].name) >= 0)
+			return -1;
+	}
+
+	ents = e;
+	rd = hdr;
+	return 0;
+}
+
+/*
+ * Look up a file by path. On success points `data` at its contents inside
+ * the archive and returns 0, otherwise -1.
+ */
+int
+rdfs_lookup(const char *name, const void **data, uint64_t *size)
+{
+	int lo, hi, mid, c;
+
+	if (rd == NULL)
+		return -1;
+
+	/* Index is sorted, binary search */
+	lo = 0;
+	hi = (int) rd->nent - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		c = namecmp(name, ents[mid].name);
+		if (c == 0) {
+			*data = (const uint8_t *) rd + ents[mid].off;
+			*size = ents[mid].size;
+			return 0;
+		}
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+/* Number of files in the mounted archive */
+int
+rdfs_count(void)
+{
+	return (rd == NULL) ? 0 : (int) rd->nent;
+}
+
+/* Name and size of the `i`th file. Returns 0 on success, -1 if none. */
+int
+rdfs_stat(int i, const char **name, uint64_t *size)
+{
+	if (i < 0 || i >= rdfs_count())
+		return -1;
+
+	*name = ents[i].name;
+	*size = ents[i].size;
+	return 0;
+}
+
+/* Print the contents of the mounted archive */
+void
+rdfs_list(void)
+{
+	const char *name;
+	uint64_t size;
+	int i;
+
+	kprintf("initrd: %d files\n", rdfs_count());
+	for (i = 0; rdfs_stat(i, &name, &size) == 0; i++)
+		kprintf("  %s %lu bytes\n", name, size);
+}
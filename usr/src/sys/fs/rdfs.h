@@ -0,0 +1,19 @@
+/*
+ * ALIX: `sys/fs/rdfs.h` -- Initial ramdisk filesystem
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _FS_RDFS_H_
+#define _FS_RDFS_H_
+
+int	rdfs_mount(struct kargtab *kargtab);
+int	rdfs_lookup(const char *name, const void **data, uint64_t *size);
+int	rdfs_count(void);
+int	rdfs_stat(int i, const char **name, uint64_t *size);
+void	rdfs_list(void);
+
+#endif /* _FS_RDFS_H_ */
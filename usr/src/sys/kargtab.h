@@ -10,21 +10,100 @@
 #ifndef _KARGTAB_H_
 #define _KARGTAB_H_
 
+/*
+ * Boot timeline: TSC stamps taken at the end of each phase, from firmware
+ * handing control to the bootloader up to the kernel's own milestones.
+ * Indices into `timeline` in `struct kargtab`.
+ */
+#define TL_ENTRY	0	/* bootloader entered by firmware */
+#define TL_FILESYS	1	/* filesys_init() */
+#define TL_KERNEL	2	/* find_kernel() */
+#define TL_FONT		3	/* find_font() */
+#define TL_INITRD	4	/* find_initrd() */
+#define TL_GOP		5	/* gop_init() */
+#define TL_TSC		6	/* tsc_calibrate() */
+#define TL_LOADK	7	/* kernel image read, loaded and mapped */
+#define TL_MMAP		8	/* getmmap() */
+#define TL_EXITBS	9	/* exit_boot_services() */
+#define TL_HANDOFF	10	/* er(), about to call the kernel */
+#define TL_KMAIN	11	/* kernel main() entered */
+#define TL_GDT		12	/* gdt_init() */
+#define TL_CONSOLE	13	/* console_init() */
+#define TL_MAX		16
+
+/*
+ * Compact memory map built by the bootloader from the EFI memory map: fixed
+ * size entries sorted by address, adjacent ranges of the same type and EFI
+ * attributes merged.
+ */
+#define KMM_USABLE	1	/* Free memory (EFI conventional) */
+#define KMM_BOOT	2	/* Boot services and loader code/data,
+				   reclaimed by the kernel (`pmm_reclaim()`) */
+#define KMM_RUNTIME	3	/* Runtime services code/data, keep */
+#define KMM_ACPI	4	/* ACPI tables, free once parsed */
+#define KMM_ACPI_NVS	5	/* ACPI non-volatile storage, keep */
+#define KMM_MMIO	6	/* Memory mapped I/O */
+#define KMM_RESERVED	7	/* Anything else, never touch */
+#define KMM_KERNEL	8	/* Bootloader allocations the kernel keeps */
+
+/*
+ * EFI memory type (from the range reserved for operating systems) of every
+ * bootloader allocation that outlives it: kernel image, page tables, kernel
+ * stack, font, initrd and memory maps. Anything else the bootloader and
+ * firmware allocated is `KMM_BOOT` and free for the taking.
+ */
+#define ALIX_MEMORY_TYPE	0x80000000
+
+struct kmmap {
+
+	uint64_t	base;		/* Physical base address */
+	uint64_t	size;		/* Size in bytes */
+	uint32_t	type;		/* `KMM_*` */
+	uint32_t	pad;
+	uint64_t	attr;		/* EFI memory attributes */
+
+};
+
 /*
  * Contains data required by the kernel, a pointer to it is passed to it at
- * runtime. All pointers are mapped virtual addresses (likely identity maps
- * remaining from UEFI).
+ * runtime. All pointers are virtual addresses in the physical direct map
+ * (`DMAP_BASE`) the bootloader sets up; addresses found inside firmware
+ * structures remain physical.
  */
 struct kargtab {
 
 	uintptr_t	this;		/* pointer to this structure */
+	uintptr_t	pml4;		/* Kernel PML4 (physical address) */
+	uintptr_t	kstack;		/* Top of the initial kernel stack */
+	uintptr_t	trampoline;	/* Page below 1 MiB for starting
+					   processors (physical), 0 if none */
+	uint64_t	dmap_top;	/* Physical memory direct mapped */
+	uint64_t	dmap_pgsz;	/* 	-page size used */
 	uintptr_t	mmap;		/* UEFI memory map */
 	uint64_t	mmap_sz;	/* 	-total size */
 	uint64_t	mmap_dsz;	/* 	-size of single descriptor */
+	uintptr_t	kmmap;		/* Compact memory map (`struct kmmap`)*/
+	uint64_t	kmmap_n;	/* 	-number of entries */
+	uint64_t	kmmap_lost;	/* 	-EFI descriptors left out */
 	uintptr_t	runtime_srv;	/* UEFI Runtime Services */
+	uintptr_t	efi_cfg;	/* UEFI configuration table */
+	uint64_t	efi_cfg_n;	/* 	-number of entries */
 	uintptr_t	gop_mode;	/* GOP mode/info (Framebuffer access) */
+	uintptr_t	fb_base;	/* Framebuffer, write-combining window */
 	uintptr_t	font_base;	/* Base address of loaded console font*/
 	uint64_t	font_size;	/* Size of loaded console font */
+	uintptr_t	initrd_base;	/* Initial ramdisk, 0 if none */
+	uint64_t	initrd_size;	/* 	-size in bytes */
+	uint64_t	kmap_large;	/* Kernel mapped with # of 2 MiB pages*/
+	uint64_t	kmap_small;	/* 	-# of 4 KiB pages */
+	uint64_t	kimg_fsz;	/* Kernel image bytes read from media */
+	uint64_t	kimg_sz;	/* 	-size once unpacked */
+	uint64_t	kimg_tsc;	/* 	-TSC cycles to read and unpack */
+	uint64_t	font_fsz;	/* Font bytes read from media */
+	uint64_t	font_tsc;	/* 	-TSC cycles to read and unpack */
+	uint64_t	tsc_khz;	/* TSC frequency, estimated at boot and
+					   refined by `clock_init()` */
+	uint64_t	timeline[TL_MAX];/* Boot timeline (TSC), see `TL_*` */
 
 };
 
@@ -0,0 +1,326 @@
+/*
+ * ALIX: `sys/kmalloc.c` -- General purpose kernel memory allocation
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/lock.h>
+#include <sys/cpu.h>
+#include <sys/kmem.h>
+#include <sys/kmalloc.h>
+#include <sys/string.h>
+#include <sys/x64/page.h>
+#include <sys/dev/console.h>
+
+/*
+ * Variable size allocations. Requests up to `MAXSLAB` bytes are rounded up to
+ * a size class, powers of two and the halfway points between them (1.5x),
+ * each served by a slab cache. Larger requests get their own run of pages.
+ *
+ * Nothing is stored next to the allocation. On free, the page owner word
+ * (`pmm_owner()`) of the first page says what it is: a slab header pointer
+ * for slab objects, or the page count of a run, tagged with the low bit.
+ *
+ * Built with `KMALLOC_DEBUG` every allocation is preceded by a header holding
+ * its size and a redzone and followed by another redzone, both checked on
+ * free, and freed memory is poisoned.
+ */
+
+#define MAXSLAB		16384
+#define NCLASS		(sizeof(classes) / sizeof(classes[0]))
+
+static const size_t classes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+	1536, 2048, 3072, 4096, 6144, 8192, 12288, MAXSLAB
+};
+static struct kmem_cache *	caches[NCLASS];
+
+/* Class of sizes up to 1024, indexed by 16 byte units */
+static uint8_t			smallclass[1024 / KM_ALIGN + 1];
+
+#define RUN_TAG(npages)		(((uintptr_t) (npages) << 1) | 1)
+#define RUN_PAGES(tag)		((tag) >> 1)
+
+static uint64_t			nruns;		/* Page runs out */
+static uint64_t			runpages;	/* Pages in them */
+
+#ifdef KMALLOC_DEBUG
+#define RZ_SIZE		16
+#define RZ_BYTE		0xA5
+#define POISON_BYTE	0x6B
+#define DBG_MAGIC	0x4B4D414C4C4F43ULL	/* "KMALLOC" */
+
+struct kmdbg {
+
+	uint64_t	size;		/* Requested */
+	uint64_t	magic;
+	uint8_t		redzone[RZ_SIZE];
+
+};
+
+#define DBG_EXTRA	(sizeof(struct kmdbg) + RZ_SIZE)
+#else
+#define DBG_EXTRA	0
+#endif
+
+static int
+sizeclass(size_t size)
+{
+	int i;
+
+	if (size <= 1024)
+		return smallclass[(size + KM_ALIGN - 1) / KM_ALIGN];
+
+	for (i = smallclass[1024 / KM_ALIGN] + 1; i < NCLASS; i++) {
+		if (size <= classes[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/* Allocate a run of whole pages, carved from the smallest block that fits */
+static void *
+runalloc(size_t size)
+{
+	uintptr_t pa;
+	uint64_t npages, pos, end;
+	int order, k;
+
+	npages = (size + PAGE_MASK) / PAGE_SIZE;
+	for (order = 0; (1ULL << order) < npages; order++)
+		;
+	if (order > PMM_MAXORDER || (pa = pmm_alloc(order)) == 0)
+		return NULL;
+
+	/* Give back the tail in the largest aligned blocks */
+	end = 1ULL << order;
+	for (pos = npages; pos < end; pos += 1ULL << k) {
+		for (k = 0; (pos & (1ULL << k)) == 0
+				&& pos + (2ULL << k) <= end; k++)
+			;
+		pmm_free(pa + pos * PAGE_SIZE, k);
+	}
+
+	*pmm_owner(pa) = RUN_TAG(npages);
+	__atomic_add_fetch(&nruns, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&runpages, npages, __ATOMIC_RELAXED);
+
+	return (void *) P2V(pa);
+}
+
+static void
+runfree(uintptr_t pa, uint64_t npages)
+{
+	uint64_t pos;
+	int k;
+
+	*pmm_owner(pa) = 0;
+	__atomic_sub_fetch(&nruns, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&runpages, npages, __ATOMIC_RELAXED);
+
+	/* Largest aligned blocks, the allocator merges them back together */
+	for (pos = 0; pos < npages; pos += 1ULL << k) {
+		for (k = 0; k < PMM_MAXORDER
+				&& ((pa / PAGE_SIZE + pos) & (1ULL << k)) == 0
+				&& pos + (2ULL << k) <= npages; k++)
+			;
+		pmm_free(pa + pos * PAGE_SIZE, k);
+	}
+}
+
+#ifndef KMALLOC_DEBUG
+/* Usable size of an allocation, 0 if `ptr` did not come from `kmalloc()` */
+static size_t
+rawsize(void *ptr)
+{
+	struct kmem_cache *cp;
+	uintptr_t *owner;
+
+	if (((uintptr_t) ptr & PAGE_MASK) == 0 && (uintptr_t) ptr >= DMAP_BASE
+	&& (owner = pmm_owner(V2P(ptr))) != NULL && (*owner & 1))
+		return RUN_PAGES(*owner) * PAGE_SIZE;
+
+	if ((cp = kmem_owner(ptr)) == NULL)
+		return 0;
+
+	return cp->size;
+}
+#endif
+
+static void
+rawfree(void *ptr)
+{
+	struct kmem_cache *cp;
+	uintptr_t *owner;
+
+	if (((uintptr_t) ptr & PAGE_MASK) == 0 && (uintptr_t) ptr >= DMAP_BASE
+	&& (owner = pmm_owner(V2P(ptr))) != NULL && (*owner & 1)) {
+		runfree(V2P(ptr), RUN_PAGES(*owner));
+		return;
+	}
+
+	if ((cp = kmem_owner(ptr)) == NULL) {
+		kprintf("kfree: %lx was not allocated\n", ptr);
+		return;
+	}
+	kmem_cache_free(cp, ptr);
+}
+
+static void *
+rawalloc(size_t size)
+{
+	int c;
+
+	if (size > MAXSLAB)
+		return runalloc(size);
+
+	c = sizeclass(size);
+	return kmem_cache_alloc(caches[c]);
+}
+
+/*
+ * Allocate `size` bytes aligned to `KM_ALIGN`. Returns NULL if `size` is 0 or
+ * memory ran out.
+ */
+void *
+kmalloc(size_t size, int flags)
+{
+	uint8_t *p;
+#ifdef KMALLOC_DEBUG
+	struct kmdbg *d;
+#endif
+
+	if (size == 0 || size > (PAGE_SIZE << PMM_MAXORDER) - DBG_EXTRA)
+		return NULL;
+
+	if ((p = rawalloc(size + DBG_EXTRA)) == NULL)
+		return NULL;
+
+#ifdef KMALLOC_DEBUG
+	d = (struct kmdbg *) p;
+	d->size = size;
+	d->magic = DBG_MAGIC;
+	memset(d->redzone, RZ_BYTE, RZ_SIZE);
+	p += sizeof(struct kmdbg);
+	memset(p + size, RZ_BYTE, RZ_SIZE);
+#endif
+
+	if (flags & KM_ZERO)
+		memset(p, 0, size);
+
+	return p;
+}
+
+#ifdef KMALLOC_DEBUG
+/* Check the redzones around `ptr`, returning its header if they are intact */
+static struct kmdbg *
+dbgcheck(void *ptr)
+{
+	struct kmdbg *d;
+	uint8_t *p;
+	int i;
+
+	d = (struct kmdbg *) ((uint8_t *) ptr - sizeof(struct kmdbg));
+	if (d->magic != DBG_MAGIC) {
+		kprintf("kmalloc: %lx: header overwritten or bad pointer\n",
+				ptr);
+		return NULL;
+	}
+
+	p = (uint8_t *) ptr + d->size;
+	for (i = 0; i < RZ_SIZE; i++) {
+		if (d->redzone[i] != RZ_BYTE)
+			kprintf("kmalloc: %lx: underrun at -%d\n", ptr,
+					RZ_SIZE - i);
+		if (p[i] != RZ_BYTE)
+			kprintf("kmalloc: %lx: overrun at +%lu\n", ptr,
+					d->size + i);
+	}
+
+	return d;
+}
+#endif
+
+/* Free memory from `kmalloc()`, NULL is ignored */
+void
+kfree(void *ptr)
+{
+#ifdef KMALLOC_DEBUG
+	struct kmdbg *d;
+#endif
+
+	if (ptr == NULL)
+		return;
+
+#ifdef KMALLOC_DEBUG
+	if ((d = dbgcheck(ptr)) == NULL)
+		return;
+	d->magic = 0;
+	memset(ptr, POISON_BYTE, d->size + RZ_SIZE);
+	ptr = d;
+#endif
+
+	rawfree(ptr);
+}
+
+/* Bytes usable at `ptr`, at least what was asked of `kmalloc()` */
+size_t
+ksize(void *ptr)
+{
+#ifdef KMALLOC_DEBUG
+	struct kmdbg *d;
+
+	if ((d = dbgcheck(ptr)) == NULL)
+		return 0;
+	return d->size;
+#else
+	return rawsize(ptr);
+#endif
+}
+
+void
+kmalloc_stats(void)
+{
+	kprintf("kmalloc: %lu page runs out, %lu KiB\n", nruns,
+			runpages * PAGE_SIZE / 1024);
+}
+
+void
+kmalloc_init(void)
+{
+	static const char prefix[] = "kmalloc-";
+	char name[KMEM_NAMELEN];
+	size_t sz, div;
+	int i, n;
+
+	for (i = 0; i < NCLASS; i++) {
+		/* "kmalloc-<size>" */
+		for (n = 0; prefix[n] != '\0'; n++)
+			name[n] = prefix[n];
+		for (div = 1; classes[i] / div >= 10; div *= 10)
+			;
+		for (; div > 0; div /= 10)
+			name[n++] = '0' + (classes[i] / div) % 10;
+		name[n] = '\0';
+
+		caches[i] = kmem_cache_create(name, classes[i], KM_ALIGN, NULL);
+		if (caches[i] == NULL)
+			kprintf("kmalloc: cannot create %s\n", name);
+	}
+
+	for (sz = 0, i = 0; sz <= 1024; sz += KM_ALIGN) {
+		while (classes[i] < sz)
+			i++;
+		smallclass[sz / KM_ALIGN] = i;
+	}
+}
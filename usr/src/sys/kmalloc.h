@@ -0,0 +1,24 @@
+/*
+ * ALIX: `sys/kmalloc.h` -- General purpose kernel memory allocation
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+/* `kmalloc()` flags */
+#define KM_ZERO		0x01		/* Clear the memory */
+
+#define KM_ALIGN	16		/* Alignment of every allocation */
+
+void	kmalloc_init(void);
+void *	kmalloc(size_t size, int flags);
+void	kfree(void *ptr);
+size_t	ksize(void *ptr);
+void	kmalloc_stats(void);
+
+#endif /* _KMALLOC_H_ */
@@ -0,0 +1,453 @@
+/*
+ * ALIX: `sys/kmem.c` -- Slab object allocator
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/lock.h>
+#include <sys/cpu.h>
+#include <sys/kmem.h>
+#include <sys/x64/page.h>
+#include <sys/dev/console.h>
+
+/*
+ * Slab allocator after Bonwick's, for fixed size kernel objects.
+ *
+ * A slab is a naturally aligned block of 2^order pages from the page
+ * allocator, so the slab owning an object is found by masking its address.
+ * The slab begins with its header and an array of free object indices, then
+ * a colour offset, then the objects. Free objects are never written, so the
+ * constructor only runs when a slab is created and freed objects stay
+ * constructed. Successive slabs shift their objects by a cache line
+ * ("colour") so equal offsets of different slabs do not all compete for the
+ * same cache sets.
+ *
+ * Each cache keeps partial, full and empty slab lists under its lock and,
+ * in front of those, a per-CPU magazine of objects which needs no lock.
+ */
+
+#define CACHE_LINE	64
+#define MAXORDER	4		/* Largest slab, 64 KiB */
+#define SLAB_END	0xFFFF		/* End of a slab's free list */
+
+struct slab {
+
+	struct slab *		next;
+	struct slab *		prev;
+	struct kmem_cache *	cache;
+	uintptr_t		objs;		/* First object */
+	uint32_t		inuse;
+	uint16_t		free;		/* First free index */
+	uint16_t		link[];		/* Next free index of each */
+
+};
+
+/* The cache of caches, and the list of all caches */
+static struct kmem_cache	kmem_caches;
+static struct kmem_cache *	caches;
+static struct spinlock		caches_lock;
+
+static void
+list_init(struct slablist *l)
+{
+	l->next = l->prev = (struct slab *) l;
+}
+
+static int
+list_empty(struct slablist *l)
+{
+	return l->next == (struct slab *) l;
+}
+
+static void
+list_insert(struct slablist *l, struct slab *s)
+{
+	s->next = l->next;
+	s->prev = (struct slab *) l;
+	l->next->prev = s;
+	l->next = s;
+}
+
+static void
+list_remove(struct slab *s)
+{
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+}
+
+static size_t
+roundup(size_t n, size_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+/*
+ * Pick a slab size for the cache: the smallest order that wastes at most an
+ * eighth of the slab (or the one wasting the least), then fit as many objects
+ * as the header leaves room for.
+ */
+static void
+cache_layout(struct kmem_cache *cp)
+{
+	size_t slabsz, hdr, waste, best;
+	uint32_t n;
+	int order, bestorder;
+
+	best = SIZE_MAX;
+	bestorder = MAXORDER;
+	for (order = 0; order <= MAXORDER; order++) {
+		slabsz = PAGE_SIZE << order;
+		n = (slabsz - sizeof(struct slab)) / (cp->size + 2);
+		if (n == 0)
+			continue;
+		if (n >= SLAB_END)
+			n = SLAB_END - 1;
+		while (n > 0 && roundup(sizeof(struct slab) + n * 2, cp->align)
+				+ n * cp->size > slabsz)
+			n--;
+		if (n == 0)
+			continue;
+
+		hdr = roundup(sizeof(struct slab) + n * 2, cp->align);
+		waste = slabsz - hdr - n * cp->size;
+		if (waste < best) {
+			best = waste;
+			bestorder = order;
+		}
+		if (waste * 8 <= slabsz)
+			break;
+	}
+
+	cp->order = bestorder;
+	slabsz = PAGE_SIZE << bestorder;
+	n = (slabsz - sizeof(struct slab)) / (cp->size + 2);
+	if (n >= SLAB_END)
+		n = SLAB_END - 1;
+	while (roundup(sizeof(struct slab) + n * 2, cp->align) + n * cp->size
+			> slabsz)
+		n--;
+	cp->nobj = n;
+	cp->hdrsz = roundup(sizeof(struct slab) + n * 2, cp->align);
+
+	/* Leftover space shifts objects one cache line (or alignment) more
+	 * per slab */
+	waste = slabsz - cp->hdrsz - n * cp->size;
+	cp->ncolour = waste / roundup(CACHE_LINE, cp->align) + 1;
+	cp->colour = 0;
+}
+
+static void
+cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		size_t align, void (*ctor)(void *))
+{
+	int i;
+
+	for (i = 0; i < KMEM_NAMELEN - 1 && name[i] != '\0'; i++)
+		cp->name[i] = name[i];
+	cp->name[i] = '\0';
+
+	cp->lock = (struct spinlock) SPINLOCK_INIT;
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	cp->align = align;
+	cp->size = roundup(size, align);
+	cp->ctor = ctor;
+
+	list_init(&cp->partial);
+	list_init(&cp->full);
+	list_init(&cp->empty);
+	cp->nslabs = cp->inuse = 0;
+	for (i = 0; i < NCPU; i++) {
+		cp->mag[i].count = 0;
+		cp->mag[i].allocs = 0;
+		cp->mag[i].frees = 0;
+	}
+
+	cache_layout(cp);
+
+	spin_lock(&caches_lock);
+	cp->next = caches;
+	caches = cp;
+	spin_unlock(&caches_lock);
+}
+
+/* Create a new slab, cache locked. Returns NULL if out of memory. */
+static struct slab *
+slab_create(struct kmem_cache *cp)
+{
+	struct slab *s;
+	uintptr_t pa;
+	uint32_t i;
+
+	if ((pa = pmm_alloc(cp->order)) == 0)
+		return NULL;
+
+	/* Let `kmem_owner()` find the slab from any object */
+	for (i = 0; i < (1U << cp->order); i++)
+		*pmm_owner(pa + i * PAGE_SIZE) = P2V(pa);
+
+	s = (struct slab *) P2V(pa);
+	s->cache = cp;
+	s->inuse = 0;
+	s->objs = (uintptr_t) s + cp->hdrsz
+		+ cp->colour * roundup(CACHE_LINE, cp->align);
+	if (++cp->colour == cp->ncolour)
+		cp->colour = 0;
+
+	for (i = 0; i < cp->nobj; i++) {
+		s->link[i] = (i + 1 == cp->nobj) ? SLAB_END : i + 1;
+		if (cp->ctor != NULL)
+			cp->ctor((void *) (s->objs + i * cp->size));
+	}
+	s->free = 0;
+
+	cp->nslabs++;
+	list_insert(&cp->empty, s);
+
+	return s;
+}
+
+/* Take one object out of the slabs, cache locked */
+static void *
+slab_alloc(struct kmem_cache *cp)
+{
+	struct slab *s;
+	uint16_t i;
+
+	if (!list_empty(&cp->partial)) {
+		s = cp->partial.next;
+	} else if (!list_empty(&cp->empty)) {
+		s = cp->empty.next;
+	} else if ((s = slab_create(cp)) == NULL) {
+		return NULL;
+	}
+
+	i = s->free;
+	s->free = s->link[i];
+	s->inuse++;
+	cp->inuse++;
+
+	/* Move between lists when the slab changes state */
+	if (s->inuse == 1 || s->free == SLAB_END) {
+		list_remove(s);
+		list_insert(s->free == SLAB_END ? &cp->full : &cp->partial, s);
+	}
+
+	return (void *) (s->objs + i * cp->size);
+}
+
+/* Return one object to its slab, cache locked */
+static void
+slab_free(struct kmem_cache *cp, void *obj)
+{
+	struct slab *s;
+	uint16_t i;
+	int wasfull;
+
+	s = (struct slab *) ((uintptr_t) obj
+			& ~((PAGE_SIZE << cp->order) - 1));
+	if (s->cache != cp) {
+		kprintf("kmem: %lx freed to wrong cache %s\n", obj, cp->name);
+		return;
+	}
+
+	i = ((uintptr_t) obj - s->objs) / cp->size;
+	wasfull = s->free == SLAB_END;
+	s->link[i] = s->free;
+	s->free = i;
+	s->inuse--;
+	cp->inuse--;
+
+	if (s->inuse == 0) {
+		list_remove(s);
+		/* Keep one empty slab around, give the rest back */
+		if (list_empty(&cp->empty)) {
+			list_insert(&cp->empty, s);
+		} else {
+			cp->nslabs--;
+			pmm_free(V2P(s), cp->order);
+		}
+	} else if (wasfull) {
+		list_remove(s);
+		list_insert(&cp->partial, s);
+	}
+}
+
+/*
+ * Returns the cache an object from any cache belongs to, NULL if `obj` does
+ * not point into a slab.
+ */
+struct kmem_cache *
+kmem_owner(void *obj)
+{
+	uintptr_t *owner;
+	struct slab *s;
+
+	if ((uintptr_t) obj < DMAP_BASE
+	|| (owner = pmm_owner(V2P(obj))) == NULL || *owner < DMAP_BASE)
+		return NULL;
+
+	s = (struct slab *) *owner;
+	if ((uintptr_t) obj < s->objs)
+		return NULL;
+
+	return s->cache;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		void (*ctor)(void *))
+{
+	struct kmem_cache *cp;
+
+	if (size == 0 || size > (PAGE_SIZE << MAXORDER) / 2
+	|| (align & (align - 1)) != 0)
+		return NULL;
+
+	if ((cp = kmem_cache_alloc(&kmem_caches)) == NULL)
+		return NULL;
+	cache_setup(cp, name, size, align, ctor);
+
+	return cp;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_mag *m;
+	void *obj;
+
+	preempt_disable();
+	m = &cp->mag[cpu_self()->id];
+	if (m->count == 0) {
+		/* Refill half a magazine */
+		spin_lock(&cp->lock);
+		while (m->count < KMEM_MAG / 2) {
+			if ((obj = slab_alloc(cp)) == NULL)
+				break;
+			m->objs[m->count++] = obj;
+		}
+		spin_unlock(&cp->lock);
+		if (m->count == 0) {
+			preempt_enable();
+			return NULL;
+		}
+	}
+
+	m->allocs++;
+	obj = m->objs[--m->count];
+	preempt_enable();
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_mag *m;
+
+	preempt_disable();
+	m = &cp->mag[cpu_self()->id];
+	if (m->count == KMEM_MAG) {
+		/* Flush half a magazine */
+		spin_lock(&cp->lock);
+		while (m->count > KMEM_MAG / 2)
+			slab_free(cp, m->objs[--m->count]);
+		spin_unlock(&cp->lock);
+	}
+
+	m->frees++;
+	m->objs[m->count++] = obj;
+	preempt_enable();
+}
+
+/* Flush the calling CPU's magazine and free every empty slab */
+void
+kmem_cache_reap(struct kmem_cache *cp)
+{
+	struct kmem_mag *m;
+	struct slab *s;
+
+	preempt_disable();
+	m = &cp->mag[cpu_self()->id];
+	spin_lock(&cp->lock);
+	while (m->count > 0)
+		slab_free(cp, m->objs[--m->count]);
+	while (!list_empty(&cp->empty)) {
+		s = cp->empty.next;
+		list_remove(s);
+		cp->nslabs--;
+		pmm_free(V2P(s), cp->order);
+	}
+	spin_unlock(&cp->lock);
+	preempt_enable();
+}
+
+static uint64_t
+list_count(struct slablist *l)
+{
+	struct slab *s;
+	uint64_t n;
+
+	n = 0;
+	for (s = l->next; s != (struct slab *) l; s = s->next)
+		n++;
+
+	return n;
+}
+
+/*
+ * Print every cache: objects in use (handed out, counting those resting in
+ * magazines as in use by the slabs), slabs on each list, and fragmentation,
+ * the share of slab memory not holding live objects.
+ */
+void
+kmem_stats(void)
+{
+	struct kmem_cache *cp;
+	uint64_t live, cached, total, allocs, frees;
+	uint32_t c;
+
+	kprintf("Slab caches:\n");
+	spin_lock(&caches_lock);
+	for (cp = caches; cp != NULL; cp = cp->next) {
+		spin_lock(&cp->lock);
+		cached = allocs = frees = 0;
+		for (c = 0; c < ncpu; c++) {
+			cached += cp->mag[c].count;
+			allocs += cp->mag[c].allocs;
+			frees += cp->mag[c].frees;
+		}
+		live = cp->inuse - cached;
+		total = cp->nslabs * (PAGE_SIZE << cp->order);
+
+		kprintf("  %s: %lu bytes, %u per %lu KiB slab, %lu live, "
+				"%lu in magazines\n", cp->name, cp->size,
+				cp->nobj, (PAGE_SIZE << cp->order) / 1024,
+				live, cached);
+		kprintf("    slabs %lu partial, %lu full, %lu empty, "
+				"%lu%% fragmented\n", list_count(&cp->partial),
+				list_count(&cp->full), list_count(&cp->empty),
+				total ? 100 - (live * cp->size * 100 / total)
+				: 0);
+		kprintf("    %lu allocs, %lu frees\n", allocs, frees);
+		spin_unlock(&cp->lock);
+	}
+	spin_unlock(&caches_lock);
+}
+
+void
+kmem_init(void)
+{
+	cache_setup(&kmem_caches, "kmem_cache", sizeof(struct kmem_cache),
+			CACHE_LINE, NULL);
+}
@@ -0,0 +1,77 @@
+/*
+ * ALIX: `sys/kmem.h` -- Slab object allocator
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/* Needs `sys/lock.h` and `sys/cpu.h` */
+
+#define KMEM_NAMELEN	24
+#define KMEM_MAG	13		/* Objects in a per-CPU magazine */
+
+struct slab;
+
+/* Doubly linked list of slabs */
+struct slablist {
+
+	struct slab *	next;
+	struct slab *	prev;
+
+};
+
+/*
+ * Per-CPU magazine, two cache lines no other CPU writes. The counts are
+ * summed over CPUs by `kmem_stats()`.
+ */
+struct kmem_mag {
+
+	uint64_t	count;
+	uint64_t	allocs;
+	uint64_t	frees;
+	void *		objs[KMEM_MAG];
+
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+
+	char		name[KMEM_NAMELEN];
+	struct spinlock	lock;
+	struct kmem_cache *	next;		/* All caches */
+
+	size_t		size;			/* Object size, aligned */
+	size_t		align;
+	void		(*ctor)(void *);	/* Run once per object */
+
+	int		order;			/* Slab size, 2^order pages */
+	uint32_t	nobj;			/* Objects per slab */
+	uint32_t	hdrsz;			/* Slab header with free list */
+	uint32_t	ncolour;		/* Distinct colour offsets */
+	uint32_t	colour;			/* Next colour to use */
+
+	struct slablist	partial;
+	struct slablist	full;
+	struct slablist	empty;
+
+	uint64_t	nslabs;
+	uint64_t	inuse;			/* Objects out of slabs */
+
+	struct kmem_mag	mag[NCPU];
+
+};
+
+void			kmem_init(void);
+struct kmem_cache *	kmem_cache_create(const char *name, size_t size,
+				size_t align, void (*ctor)(void *));
+void *			kmem_cache_alloc(struct kmem_cache *cp);
+void			kmem_cache_free(struct kmem_cache *cp, void *obj);
+void			kmem_cache_reap(struct kmem_cache *cp);
+struct kmem_cache *	kmem_owner(void *obj);
+void			kmem_stats(void);
+
+#endif /* _KMEM_H_ */
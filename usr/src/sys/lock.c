@@ -0,0 +1,485 @@
+/*
+ * ALIX: `sys/lock.c` -- Spinlocks
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/lock.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * The ticket lock's plain `spin_lock()` is inline in `lock.h`; everything
+ * else is here. The `_irqsave` variants disable interrupts before
+ * preemption, and on the way out enable preemption last, once interrupts
+ * are back: a switch that came due while the lock was held happens there
+ * and then rather than at the next interrupt.
+ *
+ * With `KOPTS=-DLOCKSTAT` every lock call is out of line and counted
+ * against its call site, the return address, in a table of `NLOCKSITE`:
+ * acquisitions, how many had to wait and for how many cycles, and for
+ * exclusive holds how long they held it. `lockstat_print()` lists the
+ * sites waited on longest; `addr2line -e alix.sys` turns them into lines.
+ */
+
+/* `state` of `struct rwlock` */
+#define RW_WRITER	0x80000000	/* Held for writing */
+#define RW_WAITING	0x40000000	/* A writer waits, readers hold off */
+
+#ifdef LOCKSTAT
+
+#define NLOCKSITE	256
+#define NLOCKTOP	10
+#define CALLER		((uintptr_t) __builtin_return_address(0))
+
+struct locksite {
+
+	uintptr_t	pc;		/* 0 while the entry is free */
+	uint64_t	nacquire;
+	uint64_t	ncontend;	/* Had to wait */
+	uint64_t	spin;		/* Cycles waited */
+	uint64_t	nhold;		/* Exclusive holds */
+	uint64_t	hold;		/* Cycles held, exclusive */
+	uint64_t	maxhold;
+
+};
+
+static struct locksite	sites[NLOCKSITE];
+static struct locksite	overflow;	/* Sites past `NLOCKSITE` */
+
+/* Entry of call site `pc`, claimed the first time it is seen */
+static struct locksite *
+sitefor(uintptr_t pc)
+{
+	uintptr_t cur;
+	uint32_t i, n;
+
+	i = (uint32_t) ((pc * 0x9E3779B97F4A7C15ULL) >> 32) % NLOCKSITE;
+	for (n = 0; n < NLOCKSITE; n++, i = (i + 1) % NLOCKSITE) {
+		cur = __atomic_load_n(&sites[i].pc, __ATOMIC_RELAXED);
+		if (cur == 0 && __atomic_compare_exchange_n(&sites[i].pc,
+				&cur, pc, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+			return &sites[i];
+		if (cur == pc)
+			return &sites[i];
+	}
+
+	return &overflow;
+}
+
+/*
+ * Count an acquisition at `pc` that started waiting at TSC `start`, or
+ * did not wait if `contended` is 0. Exclusive locks keep its site and the
+ * time to measure the hold from.
+ */
+static void
+taken(struct locksite **site, uint64_t *since, uintptr_t pc, int contended,
+    uint64_t start)
+{
+	struct locksite *s;
+	uint64_t now;
+
+	s = sitefor(pc);
+	now = tscread();
+	__atomic_add_fetch(&s->nacquire, 1, __ATOMIC_RELAXED);
+	if (contended) {
+		__atomic_add_fetch(&s->ncontend, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->spin, now - start, __ATOMIC_RELAXED);
+	}
+	if (site != NULL) {
+		*site = s;
+		*since = now;
+	}
+}
+
+/* Count the end of an exclusive hold, before the lock is let go */
+static void
+released(struct locksite *s, uint64_t since)
+{
+	uint64_t t, max;
+
+	if (s == NULL)
+		return;
+
+	t = tscread() - since;
+	__atomic_add_fetch(&s->nhold, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->hold, t, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&s->maxhold, __ATOMIC_RELAXED);
+	while (t > max && !__atomic_compare_exchange_n(&s->maxhold, &max, t,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#else
+
+#define CALLER		0
+
+#endif /* LOCKSTAT */
+
+/* Take ticket lock `l` for call site `pc`, preemption disabled */
+static void
+tickettake(struct spinlock *l, uintptr_t pc)
+{
+#ifdef LOCKSTAT
+	uint64_t start;
+	int contended;
+
+	contended = l->next != l->owner;
+	start = tscread();
+	spin_acquire(l);
+	taken(&l->site, &l->since, pc, contended, start);
+#else
+	(void) pc;
+	spin_acquire(l);
+#endif
+}
+
+static void
+ticketdrop(struct spinlock *l)
+{
+#ifdef LOCKSTAT
+	released(l->site, l->since);
+#endif
+	spin_release(l);
+}
+
+#ifdef LOCKSTAT
+void
+spin_lock(struct spinlock *l)
+{
+	preempt_disable();
+	tickettake(l, CALLER);
+}
+
+int
+spin_trylock(struct spinlock *l)
+{
+	preempt_disable();
+	if (!spin_tryacquire(l)) {
+		preempt_enable();
+		return 0;
+	}
+	taken(&l->site, &l->since, CALLER, 0, 0);
+
+	return 1;
+}
+
+void
+spin_unlock(struct spinlock *l)
+{
+	ticketdrop(l);
+	preempt_enable();
+}
+#endif
+
+uint64_t
+spin_lock_irqsave(struct spinlock *l)
+{
+	uint64_t flags;
+
+	flags = intr_save();
+	preempt_disable();
+	tickettake(l, CALLER);
+
+	return flags;
+}
+
+void
+spin_unlock_irqrestore(struct spinlock *l, uint64_t flags)
+{
+	ticketdrop(l);
+	intr_restore(flags);
+	preempt_enable();
+}
+
+/* Queue `n` on MCS lock `l` and spin on it until the one ahead lets go */
+static void
+mcstake(struct mcslock *l, struct mcsnode *n, uintptr_t pc)
+{
+	struct mcsnode *prev;
+#ifdef LOCKSTAT
+	uint64_t start;
+
+	start = tscread();
+#else
+	(void) pc;
+#endif
+
+	n->next = NULL;
+	n->locked = 1;
+	prev = __atomic_exchange_n(&l->tail, n, __ATOMIC_ACQ_REL);
+	if (prev != NULL) {
+		__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&n->locked, __ATOMIC_ACQUIRE))
+			__builtin_ia32_pause();
+	}
+
+#ifdef LOCKSTAT
+	taken(&l->site, &l->since, pc, prev != NULL, start);
+#endif
+}
+
+/* Hand `l` to the next in line behind `n`, or leave it free */
+static void
+mcsdrop(struct mcslock *l, struct mcsnode *n)
+{
+	struct mcsnode *next, *last;
+
+#ifdef LOCKSTAT
+	released(l->site, l->since);
+#endif
+
+	if ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == NULL) {
+		last = n;
+		if (__atomic_compare_exchange_n(&l->tail, &last, NULL, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		/* Someone swapped in behind, and is about to link up */
+		while ((next = __atomic_load_n(&n->next,
+				__ATOMIC_ACQUIRE)) == NULL)
+			__builtin_ia32_pause();
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+void
+mcs_lock(struct mcslock *l, struct mcsnode *n)
+{
+	preempt_disable();
+	mcstake(l, n, CALLER);
+}
+
+void
+mcs_unlock(struct mcslock *l, struct mcsnode *n)
+{
+	mcsdrop(l, n);
+	preempt_enable();
+}
+
+uint64_t
+mcs_lock_irqsave(struct mcslock *l, struct mcsnode *n)
+{
+	uint64_t flags;
+
+	flags = intr_save();
+	preempt_disable();
+	mcstake(l, n, CALLER);
+
+	return flags;
+}
+
+void
+mcs_unlock_irqrestore(struct mcslock *l, struct mcsnode *n, uint64_t flags)
+{
+	mcsdrop(l, n);
+	intr_restore(flags);
+	preempt_enable();
+}
+
+/* Add a reader to `l` once no writer holds it or waits for it */
+static void
+readtake(struct rwlock *l, uintptr_t pc)
+{
+	uint32_t s;
+	int contended;
+#ifdef LOCKSTAT
+	uint64_t start;
+
+	start = tscread();
+#else
+	(void) pc;
+#endif
+
+	contended = 0;
+	for (;;) {
+		s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+		if ((s & (RW_WRITER | RW_WAITING)) == 0
+		&& __atomic_compare_exchange_n(&l->state, &s, s + 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		contended = 1;
+		__builtin_ia32_pause();
+	}
+
+#ifdef LOCKSTAT
+	taken(NULL, NULL, pc, contended, start);
+#else
+	(void) contended;
+#endif
+}
+
+/* Take `l` alone once the readers drain, holding new ones off meanwhile */
+static void
+writetake(struct rwlock *l, uintptr_t pc)
+{
+	uint32_t s;
+	int contended;
+#ifdef LOCKSTAT
+	uint64_t start;
+
+	start = tscread();
+#else
+	(void) pc;
+#endif
+
+	contended = 0;
+	for (;;) {
+		s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+		if ((s & ~RW_WAITING) == 0
+		&& __atomic_compare_exchange_n(&l->state, &s, RW_WRITER, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+
+		/* Another writer taking it cleared the bit, set it again */
+		if ((s & RW_WAITING) == 0)
+			__atomic_fetch_or(&l->state, RW_WAITING,
+					__ATOMIC_RELAXED);
+		contended = 1;
+		__builtin_ia32_pause();
+	}
+
+#ifdef LOCKSTAT
+	taken(&l->site, &l->since, pc, contended, start);
+#else
+	(void) contended;
+#endif
+}
+
+static void
+readdrop(struct rwlock *l)
+{
+	__atomic_sub_fetch(&l->state, 1, __ATOMIC_RELEASE);
+}
+
+static void
+writedrop(struct rwlock *l)
+{
+#ifdef LOCKSTAT
+	released(l->site, l->since);
+#endif
+	/* Leave a waiting writer's bit */
+	__atomic_and_fetch(&l->state, ~RW_WRITER, __ATOMIC_RELEASE);
+}
+
+void
+read_lock(struct rwlock *l)
+{
+	preempt_disable();
+	readtake(l, CALLER);
+}
+
+void
+read_unlock(struct rwlock *l)
+{
+	readdrop(l);
+	preempt_enable();
+}
+
+void
+write_lock(struct rwlock *l)
+{
+	preempt_disable();
+	writetake(l, CALLER);
+}
+
+void
+write_unlock(struct rwlock *l)
+{
+	writedrop(l);
+	preempt_enable();
+}
+
+uint64_t
+read_lock_irqsave(struct rwlock *l)
+{
+	uint64_t flags;
+
+	flags = intr_save();
+	preempt_disable();
+	readtake(l, CALLER);
+
+	return flags;
+}
+
+void
+read_unlock_irqrestore(struct rwlock *l, uint64_t flags)
+{
+	readdrop(l);
+	intr_restore(flags);
+	preempt_enable();
+}
+
+uint64_t
+write_lock_irqsave(struct rwlock *l)
+{
+	uint64_t flags;
+
+	flags = intr_save();
+	preempt_disable();
+	writetake(l, CALLER);
+
+	return flags;
+}
+
+void
+write_unlock_irqrestore(struct rwlock *l, uint64_t flags)
+{
+	writedrop(l);
+	intr_restore(flags);
+	preempt_enable();
+}
+
+#ifdef LOCKSTAT
+/* Print the `NLOCKTOP` call sites that waited longest */
+void
+lockstat_print(void)
+{
+	struct locksite *s, *best;
+	uint8_t shown[NLOCKSITE];
+	uint32_t i, n, bi;
+
+	for (i = 0; i < NLOCKSITE; i++)
+		shown[i] = 0;
+
+	kprintf("Lock sites, by cycles waited:\n");
+	for (n = 0; n < NLOCKTOP; n++) {
+		best = NULL;
+		bi = 0;
+		for (i = 0; i < NLOCKSITE; i++) {
+			s = &sites[i];
+			if (s->pc == 0 || shown[i])
+				continue;
+			if (best == NULL || s->spin > best->spin
+			|| (s->spin == best->spin
+			&& s->nacquire > best->nacquire)) {
+				best = s;
+				bi = i;
+			}
+		}
+		if (best == NULL)
+			break;
+		shown[bi] = 1;
+
+		kprintf("  %lx: %lu taken, %lu contended, %lu cycles waited",
+				best->pc, best->nacquire, best->ncontend,
+				best->spin);
+		if (best->nhold != 0)
+			kprintf(", held %lu mean %lu max",
+					best->hold / best->nhold,
+					best->maxhold);
+		kprintf("\n");
+	}
+	if (overflow.nacquire != 0)
+		kprintf("  %lu more taken at sites past %d\n",
+				overflow.nacquire, NLOCKSITE);
+}
+#endif
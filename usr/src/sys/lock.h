@@ -0,0 +1,171 @@
+/*
+ * ALIX: `sys/lock.h` -- Spinlocks
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _LOCK_H_
+#define _LOCK_H_
+
+void	preempt_disable(void);		/* `x64/cpu.S` */
+void	preempt_enable(void);		/* `sched.c` */
+
+/*
+ * Every lock disables preemption while held: a waiter on the holder's
+ * processor would spin until the next slice. The `_irqsave` variants also
+ * disable interrupts, for locks interrupt handlers take too, and return
+ * the flags to give the matching `_irqrestore`. With `KOPTS=-DLOCKSTAT`
+ * each call site's waits and holds are counted, see `lock.c`.
+ */
+
+struct locksite;
+
+/*
+ * Ticket spinlock, for short sections. A waiter takes the next ticket and
+ * spins until `owner` comes to it: the lock goes round in the order it was
+ * asked for, so no waiter starves.
+ */
+struct spinlock {
+
+	volatile uint16_t	owner;		/* Ticket holding the lock */
+	volatile uint16_t	next;		/* Ticket handed out next */
+#ifdef LOCKSTAT
+	uint64_t		since;		/* TSC, when taken */
+	struct locksite *	site;		/* Taken at */
+#endif
+
+};
+
+#define SPINLOCK_INIT	{ 0 }
+
+/*
+ * MCS queue lock, for contended global structures. Each waiter brings its
+ * own node, usually on its stack, and spins on it alone, so a handover
+ * touches one other processor's cache line however many wait. The node
+ * given to the lock must be given to the unlock.
+ */
+struct mcsnode {
+
+	struct mcsnode *	next;		/* Waiting behind this one */
+	volatile uint32_t	locked;		/* Cleared by the one ahead */
+
+};
+
+struct mcslock {
+
+	struct mcsnode *	tail;		/* Last in line, NULL if free */
+#ifdef LOCKSTAT
+	uint64_t		since;
+	struct locksite *	site;
+#endif
+
+};
+
+#define MCSLOCK_INIT	{ NULL }
+
+/*
+ * Reader-writer spinlock. Readers share it, a writer has it alone; a
+ * waiting writer holds off new readers, so readers cannot starve it.
+ */
+struct rwlock {
+
+	volatile uint32_t	state;		/* Readers and `RW_*` bits */
+#ifdef LOCKSTAT
+	uint64_t		since;		/* Writer's */
+	struct locksite *	site;
+#endif
+
+};
+
+#define RWLOCK_INIT	{ 0 }
+
+/* Spin on `l` until it is this ticket's turn, preemption disabled */
+static inline void
+spin_acquire(struct spinlock *l)
+{
+	uint16_t ticket, ahead;
+
+	ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	for (;;) {
+		ahead = ticket - __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE);
+		if (ahead == 0)
+			break;
+
+		/* Each one ahead holds it for a while yet */
+		while (ahead-- != 0)
+			__builtin_ia32_pause();
+	}
+}
+
+/* Take `l` if it is free, returns 0 if it was not */
+static inline int
+spin_tryacquire(struct spinlock *l)
+{
+	uint16_t owner;
+
+	/* Free if no ticket is out past the owner's */
+	owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&l->next, &owner, owner + 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+spin_release(struct spinlock *l)
+{
+	__atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef LOCKSTAT
+void	spin_lock(struct spinlock *l);
+int	spin_trylock(struct spinlock *l);
+void	spin_unlock(struct spinlock *l);
+void	lockstat_print(void);
+#else
+static inline void
+spin_lock(struct spinlock *l)
+{
+	preempt_disable();
+	spin_acquire(l);
+}
+
+static inline int
+spin_trylock(struct spinlock *l)
+{
+	preempt_disable();
+	if (spin_tryacquire(l))
+		return 1;
+	preempt_enable();
+
+	return 0;
+}
+
+static inline void
+spin_unlock(struct spinlock *l)
+{
+	spin_release(l);
+	preempt_enable();
+}
+#endif
+
+uint64_t	spin_lock_irqsave(struct spinlock *l);
+void		spin_unlock_irqrestore(struct spinlock *l, uint64_t flags);
+
+void		mcs_lock(struct mcslock *l, struct mcsnode *n);
+void		mcs_unlock(struct mcslock *l, struct mcsnode *n);
+uint64_t	mcs_lock_irqsave(struct mcslock *l, struct mcsnode *n);
+void		mcs_unlock_irqrestore(struct mcslock *l, struct mcsnode *n,
+		    uint64_t flags);
+
+void		read_lock(struct rwlock *l);
+void		read_unlock(struct rwlock *l);
+void		write_lock(struct rwlock *l);
+void		write_unlock(struct rwlock *l);
+uint64_t	read_lock_irqsave(struct rwlock *l);
+void		read_unlock_irqrestore(struct rwlock *l, uint64_t flags);
+uint64_t	write_lock_irqsave(struct rwlock *l);
+void		write_unlock_irqrestore(struct rwlock *l, uint64_t flags);
+
+#endif /* _LOCK_H_ */
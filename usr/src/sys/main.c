@@ -13,20 +13,122 @@
 
 #include <efi.h>
 #include <sys/kargtab.h>
+#include <sys/acpi.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/kmem.h>
+#include <sys/kmalloc.h>
+#include <sys/vmm.h>
+#include <sys/timeline.h>
+#include <sys/clock.h>
+#include <sys/timer.h>
+#include <sys/sched.h>
+#include <sys/topo.h>
+#include <sys/rcu.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
 #include <sys/x64/gdt.h>
+#include <sys/x64/idt.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/mp.h>
+#include <sys/x64/pat.h>
 #include <sys/dev/console.h>
+#include <sys/fs/rdfs.h>
+#include <sys/bench/bench.h>
 
 extern uintptr_t *kbase;	/* Kernel base address defined in `link.ld`. */
 
+/* Copy of the bootloader's `kargtab`, which sits in memory reclaimed later */
+static struct kargtab karg;
+
 void
 main(struct kargtab *kargtab)
 {
+	karg = *kargtab;
+	kargtab = &karg;
+	kargtab->this = (uintptr_t) kargtab;
+	tl_stamp(kargtab, TL_KMAIN);
+
+	/* Before anything is drawn through the write-combining framebuffer */
+	pat_init();
+
+	/* The GS base, for the console lock's preemption count */
+	gdt_init(0, NULL);
+	tl_stamp(kargtab, TL_GDT);
+
 	console_init(kargtab);
+	tl_stamp(kargtab, TL_CONSOLE);
+
 	kprintf("ALIX...\n");
 	kprintf("Kernel loaded at %lx\n", &kbase);
+	kprintf("Kernel mapped with %lu 2 MiB pages, %lu 4 KiB pages\n",
+			kargtab->kmap_large, kargtab->kmap_small);
+	kprintf("Physical memory direct mapped up to %lx with %s pages\n",
+			kargtab->dmap_top,
+			kargtab->dmap_pgsz == HPAGE_SIZE ? "1 GiB" : "2 MiB");
+
+	/* Compare boots with `make alz` against raw images */
+	kprintf("Kernel image: %lu bytes read, %lu unpacked, %lu cycles\n",
+			kargtab->kimg_fsz, kargtab->kimg_sz, kargtab->kimg_tsc);
+	kprintf("Console font: %lu bytes read, %lu unpacked, %lu cycles\n",
+			kargtab->font_fsz, kargtab->font_size, kargtab->font_tsc);
+
+	idt_init();
+
+	/* Firmware tables, before the memory they sit next to is reclaimed */
+	acpi_init(kargtab);
+	numa_init();
+
+	cpu_init();
+	pmm_init(kargtab);
+	kmem_init();
+	kmalloc_init();
+	vmm_init(kargtab);
+	clock_init(kargtab);
+	mp_init(kargtab);
+	timer_init(kargtab);
+	sched_init();
+	rcu_init();
+
+	/* Preemptible from here on, and answering shootdowns and RCU */
+	intr_restore(RFLAGS_IF);
+
+	mp_start(kargtab);
+	topo_init();
+
+	if (rdfs_mount(kargtab) == 0)
+		rdfs_list();
+	else if (kargtab->initrd_base != 0)
+		kprintf("initrd: invalid archive, not mounted\n");
+
+	/* Nothing in firmware or bootloader memory is needed past here */
+	pmm_reclaim();
+
+	tl_print(kargtab);
+
+#ifdef BENCH
+	bench_vt(kargtab);
+	bench_pmm(kargtab);
+	bench_kmalloc(kargtab);
+	bench_tlb(kargtab);
+	bench_trap(kargtab);
+	bench_timer(kargtab);
+	bench_clock(kargtab);
+	bench_sched(kargtab);
+	bench_topo(kargtab);
+	bench_lock(kargtab);
+	bench_rcu(kargtab);
+#endif
+
+	trap_stats();
+	timer_stats();
+#ifdef LOCKSTAT
+	lockstat_print();
+#endif
 
-	gdt_init();
-        
-	for(;;);
+	/* The idle threads take over */
+	thread_exit();
 }
 
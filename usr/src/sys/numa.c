@@ -0,0 +1,255 @@
+/*
+ * ALIX: `sys/numa.c` -- NUMA topology
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/acpi.h>
+#include <sys/numa.h>
+#include <sys/dev/console.h>
+
+/*
+ * Nodes come from the proximity domains of the SRAT, numbered densely in the
+ * order they first appear. Each memory range and processor the SRAT lists
+ * belongs to one, the SLIT says how far nodes are from each other. Without
+ * an SRAT everything is node 0.
+ *
+ * Memory the SRAT does not cover is treated as node 0's.
+ */
+
+#define NMEMRANGE	32
+#define NCPUAFF		256
+
+int			nnode = 1;
+
+static uint32_t		domains[MAXNODE];	/* Proximity domain of nodes */
+static uint8_t		dist[MAXNODE][MAXNODE];
+
+/* Memory ranges, sorted by address and not overlapping */
+static struct {
+
+	uintptr_t	base;
+	uintptr_t	end;
+	int		node;
+
+} ranges[NMEMRANGE];
+static int nranges;
+
+/* Processors by APIC id */
+static struct {
+
+	uint32_t	apicid;
+	int		node;
+
+} cpuaff[NCPUAFF];
+static int ncpuaff;
+
+/* Node of proximity domain `domain`, allocating one if it is new */
+static int
+nodeof(uint32_t domain)
+{
+	int i;
+
+	for (i = 0; i < nnode; i++) {
+		if (domains[i] == domain)
+			return i;
+	}
+
+	if (nnode == MAXNODE) {
+		kprintf("NUMA: too many nodes, domain %u folded into node 0\n",
+				domain);
+		return 0;
+	}
+	domains[nnode] = domain;
+
+	return nnode++;
+}
+
+static void
+addrange(uintptr_t base, uint64_t size, uint32_t domain)
+{
+	int i;
+
+	if (size == 0)
+		return;
+
+	if (nranges == NMEMRANGE) {
+		kprintf("NUMA: too many memory ranges, %lx ignored\n", base);
+		return;
+	}
+
+	/* Insert sorted */
+	for (i = nranges; i > 0 && ranges[i - 1].base > base; i--)
+		ranges[i] = ranges[i - 1];
+	ranges[i].base = base;
+	ranges[i].end = base + size;
+	ranges[i].node = nodeof(domain);
+	nranges++;
+}
+
+static void
+addcpu(uint32_t apicid, uint32_t domain)
+{
+	if (ncpuaff == NCPUAFF)
+		return;
+
+	cpuaff[ncpuaff].apicid = apicid;
+	cpuaff[ncpuaff].node = nodeof(domain);
+	ncpuaff++;
+}
+
+static void
+srat_parse(Acpi_srat *srat)
+{
+	Acpi_srat_entry *e;
+	Acpi_srat_lapic *lapic;
+	Acpi_srat_memory *mem;
+	Acpi_srat_x2apic *x2apic;
+	uint8_t *p, *end;
+
+	p = (uint8_t *) (srat + 1);
+	end = (uint8_t *) srat + srat->hdr.length;
+	for (; p + sizeof(Acpi_srat_entry) <= end; p += e->length) {
+		e = (Acpi_srat_entry *) p;
+		if (e->length < sizeof(Acpi_srat_entry) || p + e->length > end)
+			break;
+
+		switch (e->type) {
+		case SRAT_LAPIC:
+			lapic = (Acpi_srat_lapic *) e;
+			if ((lapic->flags & SRAT_ENABLED) == 0)
+				break;
+			addcpu(lapic->apicid, lapic->domain_lo
+					| (lapic->domain_hi[0] << 8)
+					| (lapic->domain_hi[1] << 16)
+					| ((uint32_t) lapic->domain_hi[2] << 24));
+			break;
+		case SRAT_MEMORY:
+			mem = (Acpi_srat_memory *) e;
+			if ((mem->flags & SRAT_ENABLED) == 0)
+				break;
+			addrange(mem->base, mem->size, mem->domain);
+			break;
+		case SRAT_X2APIC:
+			x2apic = (Acpi_srat_x2apic *) e;
+			if ((x2apic->flags & SRAT_ENABLED) == 0)
+				break;
+			addcpu(x2apic->x2apicid, x2apic->domain);
+			break;
+		}
+	}
+}
+
+static void
+slit_parse(Acpi_slit *slit)
+{
+	uint64_t n;
+	int a, b;
+
+	n = slit->nlocality;
+	if (sizeof(Acpi_slit) + n * n > slit->hdr.length)
+		return;
+
+	for (a = 0; a < nnode; a++) {
+		for (b = 0; b < nnode; b++) {
+			if (domains[a] < n && domains[b] < n)
+				dist[a][b] = slit->dist[domains[a] * n
+						+ domains[b]];
+		}
+	}
+}
+
+/* Read the SRAT and SLIT, needs `acpi_init()` */
+void
+numa_init(void)
+{
+	Acpi_srat *srat;
+	Acpi_slit *slit;
+	int a, b;
+
+	if ((srat = (Acpi_srat *) acpi_find("SRAT")) != NULL) {
+		nnode = 0;
+		srat_parse(srat);
+
+		/* Processors but no memory, it is all the same */
+		if (nranges == 0) {
+			nnode = 1;
+			ncpuaff = 0;
+		}
+	}
+	if (nnode == 0)
+		nnode = 1;
+
+	for (a = 0; a < nnode; a++) {
+		for (b = 0; b < nnode; b++)
+			dist[a][b] = (a == b) ? NUMA_LOCAL : NUMA_REMOTE;
+	}
+	if ((slit = (Acpi_slit *) acpi_find("SLIT")) != NULL)
+		slit_parse(slit);
+
+	if (nnode == 1 && nranges <= 1)
+		return;
+
+	kprintf("NUMA: %d nodes\n", nnode);
+	for (a = 0; a < nranges; a++)
+		kprintf("  %lx - %lx node %d\n", ranges[a].base,
+				ranges[a].end - 1, ranges[a].node);
+	for (a = 0; a < nnode; a++) {
+		kprintf("  node %d (domain %u) distances:", a, domains[a]);
+		for (b = 0; b < nnode; b++)
+			kprintf(" %u", dist[a][b]);
+		kprintf("\n");
+	}
+}
+
+/*
+ * Returns the node of physical address `pa`. `*end` is set to where the run
+ * of memory of that node containing `pa` ends.
+ */
+int
+numa_node(uintptr_t pa, uintptr_t *end)
+{
+	int i;
+
+	for (i = 0; i < nranges; i++) {
+		if (pa < ranges[i].base) {
+			*end = ranges[i].base;
+			return 0;
+		}
+		if (pa < ranges[i].end) {
+			*end = ranges[i].end;
+			return ranges[i].node;
+		}
+	}
+
+	*end = UINTPTR_MAX;
+	return 0;
+}
+
+/* Returns the node of the processor with local APIC id `apicid` */
+int
+numa_cpunode(uint32_t apicid)
+{
+	int i;
+
+	for (i = 0; i < ncpuaff; i++) {
+		if (cpuaff[i].apicid == apicid)
+			return cpuaff[i].node;
+	}
+
+	return 0;
+}
+
+/* SLIT distance between two nodes, `NUMA_LOCAL` is the nearest */
+int
+numa_distance(int a, int b)
+{
+	return dist[a][b];
+}
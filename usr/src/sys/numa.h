@@ -0,0 +1,26 @@
+/*
+ * ALIX: `sys/numa.h` -- NUMA topology
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#define MAXNODE		8
+
+/* SLIT distances */
+#define NUMA_LOCAL	10
+#define NUMA_REMOTE	20		/* Default without a SLIT */
+
+extern int	nnode;			/* Nodes, at least 1 */
+
+void		numa_init(void);
+int		numa_node(uintptr_t pa, uintptr_t *end);
+int		numa_cpunode(uint32_t apicid);
+int		numa_distance(int a, int b);
+
+#endif /* _NUMA_H_ */
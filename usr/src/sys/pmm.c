@@ -12,22 +12,1067 @@
 
 #include <efi.h>
 #include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
 #include <sys/dev/console.h>
 
-#define PAGE_SIZE	0x1000
+/*
+ * Binary buddy allocator. A block of order `n` is 2^n contiguous pages
+ * aligned to its own size. Each order has a doubly linked free list threaded
+ * through the free blocks themselves (reached through the direct map), so
+ * push, pop and unlinking a given buddy are all O(1). A bitmap per order
+ * marks the blocks currently on that order's free list, which is how a
+ * freed block finds out whether its buddy can be merged with it.
+ *
+ * Memory is kept in one zone per NUMA node, each spanning the usable memory
+ * of its node. A zone's base is aligned to the largest block so that a
+ * block's physical address is aligned to its size, not just its offset
+ * within the zone. Spans of different nodes may overlap, every page is only
+ * ever free in the zone of its own node (`numa_node()`), so no block crosses
+ * nodes.
+ *
+ * Allocations go to the calling CPU's node first, then to the other nodes
+ * nearest first (`fallback`).
+ *
+ * In front of the zone of its node and that zone's lock every CPU keeps a
+ * small cache of 4 KiB and 2 MiB blocks (`struct pcp`). Most allocations and
+ * frees touch only the calling CPU's cache, the zone lock is taken once per
+ * batch of blocks.
+ */
+
+extern uintptr_t *kbase;	/* From `link.ld` */
+extern uintptr_t *kend;
+
+/* Free block header, stored in the first bytes of the free block */
+struct fblk {
+
+	struct fblk *	next;
+	struct fblk *	prev;
+
+};
+
+struct zone {
+
+	struct spinlock	lock;
+	int		node;
+	uintptr_t	base;			/* Physical base address */
+	uint64_t	npages;			/* Pages spanned, holes too */
+	struct fblk	free[PMM_NORDER];	/* Free list heads */
+	uint64_t *	map[PMM_NORDER];	/* Free block bitmaps */
+	uint64_t	nfree[PMM_NORDER];	/* Blocks on each list */
+	uint64_t	freepages;		/* Pages on all lists */
+	uintptr_t *	owner;			/* Word per page, `pmm_owner()` */
+	uint64_t	present;		/* Pages given to the zone */
+	struct zone *	fallback[MAXNODE];	/* Zones by distance, this first */
+	int		nfallback;
+
+};
+
+static struct zone zones[MAXNODE];
+
+/* Cached orders and their default watermarks */
+static const struct {
+
+	int		order;
+	uint32_t	high;
+	uint32_t	low;
+
+} pcp_orders[PCP_NORDER] = {
+	{ 0, 48, 16 },		/* 4 KiB: batches of 16 */
+	{ 9, 8, 2 },		/* 2 MiB: at most 16 MiB per CPU */
+};
+
+/*
+ * Watermarks the caches of each order are to have, `high` in the upper half
+ * and `low` in the lower. A cache belongs to its CPU alone, which takes
+ * changes up at its next allocation or free (`pcp_sync()`).
+ */
+static uint64_t			pcpwant[PCP_NORDER];
+
+/* Compact memory map from the bootloader, sorted and coalesced */
+static struct kmmap *		kmmap;		/* Entries */
+static uint64_t			kmmap_n;	/* Number of entries */
+
+static const char *kmm_names[] = {
+	[KMM_USABLE]	= "usable",
+	[KMM_BOOT]	= "boot",
+	[KMM_RUNTIME]	= "runtime",
+	[KMM_ACPI]	= "ACPI",
+	[KMM_ACPI_NVS]	= "ACPI NVS",
+	[KMM_MMIO]	= "MMIO",
+	[KMM_RESERVED]	= "reserved",
+	[KMM_KERNEL]	= "kernel",
+};
+
+/*
+ * Physical ranges that must never be handed out even if the memory map says
+ * they are usable: what the kernel was handed by the bootloader. All of it
+ * is `KMM_KERNEL` memory, this guards against firmware maps that say
+ * otherwise.
+ */
+#define NRESV	32
+
+static struct {
+
+	uintptr_t	base;
+	uintptr_t	end;
+
+} resv[NRESV];
+static int nresv;
+
+static void
+reserve(uintptr_t base, uint64_t size)
+{
+	if (size == 0)
+		return;
+
+	if (nresv == NRESV) {
+		kprintf("pmm: reservation table full, %lx lost\n", base);
+		return;
+	}
+
+	resv[nresv].base = base & ~PAGE_MASK;
+	resv[nresv].end = (base + size + PAGE_MASK) & ~PAGE_MASK;
+	nresv++;
+}
+
+/* Physical address `va` is mapped to in the kernel's tables, 0 if none */
+static uintptr_t
+kvtophys(struct kargtab *kargtab, uintptr_t va)
+{
+	uint64_t *table, e;
+
+	table = (uint64_t *) P2V(kargtab->pml4);
+	e = table[PML4_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PDPT_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+	if (e & PTE_PS)
+		return (e & PTE_ADDR & ~HPAGE_MASK) | (va & HPAGE_MASK);
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PD_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+	if (e & PTE_PS)
+		return (e & PTE_ADDR & ~LPAGE_MASK) | (va & LPAGE_MASK);
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PT_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+
+	return (e & PTE_ADDR) | (va & PAGE_MASK);
+}
+
+/* Reserve the kernel image, one run of physically contiguous pages at once */
+static void
+reserve_kernel(struct kargtab *kargtab)
+{
+	uintptr_t va, pa, run, runva;
+
+	run = runva = 0;
+	for (va = (uintptr_t) &kbase; va < (uintptr_t) &kend;
+			va += PAGE_SIZE) {
+		pa = kvtophys(kargtab, va);
+		if (pa == 0)
+			continue;
+		if (run != 0 && pa == run + (va - runva))
+			continue;
+		if (run != 0)
+			reserve(run, va - runva);
+		run = pa;
+		runva = va;
+	}
+	if (run != 0)
+		reserve(run, va - runva);
+}
+
+/* Bitmap helpers, `i` is a block index within its order */
+static inline int
+mapget(struct zone *z, int order, uint64_t i)
+{
+	return (z->map[order][i / 64] >> (i % 64)) & 1;
+}
+
+static inline void
+mapflip(struct zone *z, int order, uint64_t i)
+{
+	z->map[order][i / 64] ^= 1ULL << (i % 64);
+}
+
+static inline struct fblk *
+blkaddr(struct zone *z, uint64_t pfn)
+{
+	return (struct fblk *) P2V(z->base + (pfn * PAGE_SIZE));
+}
+
+/* Push the block at page `pfn` (relative to the zone) onto a free list */
+static void
+push(struct zone *z, int order, uint64_t pfn)
+{
+	struct fblk *b, *head;
+
+	head = &z->free[order];
+	b = blkaddr(z, pfn);
+	b->next = head->next;
+	b->prev = head;
+	head->next->prev = b;
+	head->next = b;
+
+	mapflip(z, order, pfn >> order);
+	z->nfree[order]++;
+	z->freepages += 1ULL << order;
+}
+
+/* Unlink the block at page `pfn` from its free list */
+static void
+unlink(struct zone *z, int order, uint64_t pfn)
+{
+	struct fblk *b;
+
+	b = blkaddr(z, pfn);
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+
+	mapflip(z, order, pfn >> order);
+	z->nfree[order]--;
+	z->freepages -= 1ULL << order;
+}
+
+/* Free the block at page `pfn`, merging it with its buddies while possible */
+static void
+release(struct zone *z, int order, uint64_t pfn)
+{
+	uint64_t buddy;
 
-/* UEFI Memory Map */
-static Efi_memory_descriptor *	mmap;		/* Root descriptor */
-static uint64_t			mmap_sz;	/* Total mmap size */
-static uint64_t 		mmap_dsz;	/* Size of single descriptor */
+	for (; order < PMM_MAXORDER; order++) {
+		buddy = pfn ^ (1ULL << order);
+		if (buddy >= z->npages || !mapget(z, order, buddy >> order))
+			break;
+		unlink(z, order, buddy);
+		pfn &= ~(1ULL << order);
+	}
 
+	push(z, order, pfn);
+}
+
+/* Take a block of 2^`order` pages off `z`, 0 if there is none */
+static uintptr_t
+zone_alloc(struct zone *z, int order)
+{
+	struct fblk *b;
+	uint64_t pfn;
+	int k;
+
+	for (k = order; k <= PMM_MAXORDER; k++) {
+		if (z->nfree[k] != 0)
+			break;
+	}
+	if (k > PMM_MAXORDER)
+		return 0;
+
+	b = z->free[k].next;
+	pfn = (V2P(b) - z->base) / PAGE_SIZE;
+	unlink(z, k, pfn);
+
+	/* Split, returning upper halves to the free lists */
+	while (k > order) {
+		k--;
+		push(z, k, pfn + (1ULL << k));
+	}
+
+	return z->base + (pfn * PAGE_SIZE);
+}
+
+/* Return a block to `z`, 0 on success or -1 if it was not allocated */
+static int
+zone_free(struct zone *z, uintptr_t pa, int order)
+{
+	uint64_t pfn;
+
+	if (pa < z->base || (pa & ((PAGE_SIZE << order) - 1)) != 0)
+		return -1;
+
+	pfn = (pa - z->base) / PAGE_SIZE;
+	if (pfn >= z->npages || mapget(z, order, pfn >> order))
+		return -1;
+
+	release(z, order, pfn);
+	return 0;
+}
+
+/* Zone of the page holding `pa`, NULL if it is outside the allocator */
+static struct zone *
+zone_of(uintptr_t pa)
+{
+	struct zone *z;
+	uintptr_t end;
+
+	z = &zones[numa_node(pa, &end)];
+	if (pa < z->base || (pa - z->base) / PAGE_SIZE >= z->npages)
+		return NULL;
+
+	return z;
+}
+
+/* Index of `order` in the per-CPU caches, -1 if it is not cached */
+static int
+pcp_index(int order)
+{
+	int i;
+
+	for (i = 0; i < PCP_NORDER; i++) {
+		if (pcp_orders[i].order == order)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Return blocks from the top of `pcp` to `z`, the zone of the CPU's node,
+ * until `keep` are left
+ */
+static void
+pcp_drain(struct zone *z, struct pcp *pcp, int order, uint32_t keep)
+{
+	spin_lock(&z->lock);
+	while (pcp->count > keep) {
+		pcp->count--;
+		if (zone_free(z, pcp->blks[pcp->count], order) != 0)
+			kprintf("pmm: bad cached block %lx order %d\n",
+					pcp->blks[pcp->count], order);
+	}
+	spin_unlock(&z->lock);
+}
+
+/*
+ * Bring cache `i` of the calling CPU to the watermarks in `pcpwant`,
+ * preemption disabled
+ */
+static void
+pcp_sync(struct cpu *cpu, int i)
+{
+	struct pcp *pcp;
+	uint64_t w;
+
+	pcp = &cpu->pcp[i];
+	w = __atomic_load_n(&pcpwant[i], __ATOMIC_RELAXED);
+	if (w == ((uint64_t) pcp->high << 32 | pcp->low))
+		return;
+
+	pcp->high = w >> 32;
+	pcp->low = (uint32_t) w;
+	if (pcp->count > pcp->high)
+		pcp_drain(&zones[cpu->node], pcp, pcp_orders[i].order,
+				pcp->high);
+}
+
+/*
+ * Allocate from `z`, through the calling CPU's cache if `order` is cached
+ * and `z` is the zone of the CPU's node
+ */
+static uintptr_t
+alloc(struct zone *z, int order)
+{
+	struct cpu *cpu;
+	struct pcp *pcp;
+	uintptr_t pa;
+	int i;
+
+	cpu = cpu_self();
+	if ((i = pcp_index(order)) >= 0)
+		pcp_sync(cpu, i);
+	if (i < 0 || cpu->pcp[i].high == 0 || z->node != cpu->node) {
+		spin_lock(&z->lock);
+		pa = zone_alloc(z, order);
+		spin_unlock(&z->lock);
+		return pa;
+	}
+
+	pcp = &cpu->pcp[i];
+	if (pcp->count != 0) {
+		pcp->hits++;
+		return pcp->blks[--pcp->count];
+	}
+
+	/* Empty, refill a batch */
+	pcp->misses++;
+	spin_lock(&z->lock);
+	while (pcp->count < pcp->low) {
+		if ((pa = zone_alloc(z, order)) == 0)
+			break;
+		pcp->blks[pcp->count++] = pa;
+	}
+	if (pcp->count == 0)
+		pa = zone_alloc(z, order);	/* `low` of 0 */
+	else
+		pa = pcp->blks[--pcp->count];
+	spin_unlock(&z->lock);
+
+	return pa;
+}
+
+/* Account 2^`order` pages of `got` handed out for an allocation on `want` */
+static void
+numacount(int want, int got, int order)
+{
+	struct cpu *cpu;
+	uint64_t n;
+
+	cpu = cpu_self();
+	n = 1ULL << order;
+	if (want == got) {
+		cpu->numa[got].hit += n;
+	} else {
+		cpu->numa[got].miss += n;
+		cpu->numa[want].foreign += n;
+	}
+	if (got == cpu->node)
+		cpu->numa[got].local += n;
+	else
+		cpu->numa[got].other += n;
+}
+
+/*
+ * Pre-zeroed pages. Idle CPUs take order 0 pages off the zone of their node,
+ * zero them with non-temporal stores and park them in the node's pool, a
+ * stack of physical addresses kept outside the pages so they stay entirely
+ * zero. `pmm_zalloc()` of one page then costs no zeroing, and never pulls a
+ * page of zeroes through the cache either.
+ */
+#define ZPOOL_MAX	1024		/* 4 MiB */
+#define ZPOOL_BATCH	16		/* Pages zeroed per lock round trip */
+#define ZPOOL_RESERVE	4096		/* Free pages never taken for it */
+
+struct zpool {
+
+	struct spinlock	lock;
+	uint32_t	count;
+	uint64_t	hits;		/* `pmm_zalloc()` served from the pool */
+	uint64_t	demand;		/* Pages zeroed on allocation */
+	uint64_t	idle;		/* Pages zeroed by idle CPUs */
+	uintptr_t	pages[ZPOOL_MAX];
+
+};
+
+static struct zpool zpools[MAXNODE];
+
+static uintptr_t
+zpool_pop(struct zpool *zp)
+{
+	uintptr_t pa;
+
+	pa = 0;
+	spin_lock(&zp->lock);
+	if (zp->count != 0)
+		pa = zp->pages[--zp->count];
+	spin_unlock(&zp->lock);
+
+	return pa;
+}
+
+/*
+ * Allocate a block of 2^`order` pages, of `node` if it has one or else of the
+ * nearest node that does. Returns its physical address, or 0 if no block
+ * that large is free anywhere.
+ */
+uintptr_t
+pmm_alloc_node(int node, int order)
+{
+	struct zone *z;
+	uintptr_t pa;
+	int i;
+
+	if (order < 0 || order > PMM_MAXORDER || node < 0 || node >= nnode)
+		return 0;
+
+	/* The CPU's caches and counts, it must stay the same one */
+	preempt_disable();
+	z = &zones[node];
+	for (i = 0; i < z->nfallback; i++) {
+		if ((pa = alloc(z->fallback[i], order)) != 0) {
+			numacount(node, z->fallback[i]->node, order);
+			goto done;
+		}
+	}
+
+	/* Last resort, pages set aside zeroed */
+	for (i = 0; order == 0 && i < z->nfallback; i++) {
+		if ((pa = zpool_pop(&zpools[z->fallback[i]->node])) != 0) {
+			numacount(node, z->fallback[i]->node, order);
+			goto done;
+		}
+	}
+	pa = 0;
+
+done:
+	preempt_enable();
+	return pa;
+}
+
+/*
+ * Allocate a block of 2^`order` pages, local to the calling CPU if possible.
+ * Returns its physical address, or 0 if no block that large is free.
+ */
+uintptr_t
+pmm_alloc(int order)
+{
+	return pmm_alloc_node(cpu_self()->node, order);
+}
+
+/*
+ * Allocate a block of 2^`order` pages filled with zeroes. Single pages come
+ * from the pre-zeroed pool of the calling CPU's node when it has any.
+ */
+uintptr_t
+pmm_zalloc(int order)
+{
+	struct zpool *zp;
+	uintptr_t pa;
+	uint64_t i;
+	int node;
+
+	preempt_disable();
+	node = cpu_self()->node;
+	zp = &zpools[node];
+	if (order == 0 && (pa = zpool_pop(zp)) != 0) {
+		__atomic_add_fetch(&zp->hits, 1, __ATOMIC_RELAXED);
+		numacount(node, node, 0);
+		preempt_enable();
+		return pa;
+	}
+	preempt_enable();
+
+	if ((pa = pmm_alloc(order)) == 0)
+		return 0;
+
+	for (i = 0; i < (1ULL << order); i++)
+		pagezero((void *) P2V(pa + i * PAGE_SIZE));
+
+	/* Against the node it came from, which may not be this CPU's */
+	zp = &zpools[zone_of(pa)->node];
+	__atomic_add_fetch(&zp->demand, 1ULL << order, __ATOMIC_RELAXED);
+
+	return pa;
+}
+
+/*
+ * Zero up to `max` pages of the calling CPU's node into its pool, called by
+ * idle CPUs. Returns the number zeroed, 0 once the pool is full (or memory
+ * is short).
+ */
+int
+pmm_zero_idle(int max)
+{
+	uintptr_t batch[ZPOOL_BATCH];
+	struct zone *z;
+	struct zpool *zp;
+	int n, i, done;
+
+	z = &zones[cpu_self()->node];
+	zp = &zpools[z->node];
+	if (z->npages == 0)
+		return 0;
+
+	for (done = 0; done < max; done += n) {
+		if (__atomic_load_n(&zp->count, __ATOMIC_RELAXED)
+				+ ZPOOL_BATCH > ZPOOL_MAX)
+			break;
+
+		/* Leave the last free pages to real allocations */
+		spin_lock(&z->lock);
+		for (n = 0; n < ZPOOL_BATCH && n < max - done
+				&& z->freepages > ZPOOL_RESERVE; n++)
+			batch[n] = zone_alloc(z, 0);
+		spin_unlock(&z->lock);
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++)
+			pagezero((void *) P2V(batch[i]));
+
+		/* Another CPU may have filled the pool meanwhile */
+		spin_lock(&zp->lock);
+		for (i = 0; i < n && zp->count < ZPOOL_MAX; i++)
+			zp->pages[zp->count++] = batch[i];
+		zp->idle += i;
+		spin_unlock(&zp->lock);
+
+		if (i < n) {
+			spin_lock(&z->lock);
+			for (; i < n; i++)
+				zone_free(z, batch[i], 0);
+			spin_unlock(&z->lock);
+			break;
+		}
+	}
+
+	return done;
+}
+
+/* Free a block of 2^`order` pages previously returned by `pmm_alloc()` */
 void
-pmm_init(struct kargtab *kargtab)
+pmm_free(uintptr_t pa, int order)
+{
+	struct cpu *cpu;
+	struct zone *z;
+	struct pcp *pcp;
+	int i, bad;
+
+	if (order < 0 || order > PMM_MAXORDER
+	|| (pa & ((PAGE_SIZE << order) - 1)) != 0
+	|| (z = zone_of(pa)) == NULL) {
+		kprintf("pmm: bad free of %lx order %d\n", pa, order);
+		return;
+	}
+
+	/* Only memory of its own node goes into a CPU's cache */
+	preempt_disable();
+	cpu = cpu_self();
+	if ((i = pcp_index(order)) >= 0)
+		pcp_sync(cpu, i);
+	if (i < 0 || cpu->pcp[i].high == 0 || z->node != cpu->node) {
+		preempt_enable();
+		spin_lock(&z->lock);
+		bad = zone_free(z, pa, order);
+		spin_unlock(&z->lock);
+		if (bad)
+			kprintf("pmm: bad free of %lx order %d\n", pa, order);
+		return;
+	}
+
+	pcp = &cpu->pcp[i];
+	pcp->blks[pcp->count++] = pa;
+	if (pcp->count > pcp->high)
+		pcp_drain(z, pcp, order, pcp->low);
+	preempt_enable();
+}
+
+/*
+ * Set the watermarks of the per-CPU caches of `order` on every CPU. A
+ * `high` of 0 turns caching off. The calling CPU's cache changes now, every
+ * other CPU's at its next allocation or free of `order`, draining what is
+ * over `high` then. Returns 0, or -1 if the order is not cached or the
+ * watermarks are out of range.
+ */
+int
+pmm_pcp_tune(int order, uint32_t high, uint32_t low)
+{
+	int i;
+
+	if ((i = pcp_index(order)) < 0 || high >= PCP_MAX || low > high)
+		return -1;
+
+	__atomic_store_n(&pcpwant[i], (uint64_t) high << 32 | low,
+			__ATOMIC_RELAXED);
+
+	preempt_disable();
+	pcp_sync(cpu_self(), i);
+	preempt_enable();
+
+	return 0;
+}
+
+/* Return everything the calling CPU has cached to the zone */
+void
+pmm_pcp_drain(void)
+{
+	int i;
+
+	preempt_disable();
+	for (i = 0; i < PCP_NORDER; i++)
+		pcp_drain(&zones[cpu_self()->node], &cpu_self()->pcp[i],
+				pcp_orders[i].order, 0);
+	preempt_enable();
+}
+
+/*
+ * Returns the owner word of the page holding `pa`, NULL if it is outside the
+ * allocator. Whoever allocated a page may keep anything there, e.g. `kmem.c`
+ * points each page of a slab at the slab header. It is not cleared on free.
+ */
+uintptr_t *
+pmm_owner(uintptr_t pa)
+{
+	struct zone *z;
+
+	if ((z = zone_of(pa)) == NULL)
+		return NULL;
+
+	return &z->owner[(pa - z->base) / PAGE_SIZE];
+}
+
+/* Bytes of free memory, including what the CPUs have cached */
+uint64_t
+pmm_freemem(void)
+{
+	uint64_t bytes;
+	uint32_t c;
+	int i, n;
+
+	bytes = 0;
+	for (n = 0; n < nnode; n++)
+		bytes += (zones[n].freepages + zpools[n].count) * PAGE_SIZE;
+	for (c = 0; c < ncpu; c++) {
+		for (i = 0; i < PCP_NORDER; i++)
+			bytes += cpus[c].pcp[i].count
+				* (PAGE_SIZE << pcp_orders[i].order);
+	}
+
+	return bytes;
+}
+
+/* Sum of every CPU's allocation statistics for `node` */
+void
+pmm_numastat(int node, struct numastat *ns)
+{
+	struct numastat *s;
+	uint32_t c;
+
+	ns->hit = ns->miss = ns->foreign = ns->local = ns->other = 0;
+	for (c = 0; c < ncpu; c++) {
+		s = &cpus[c].numa[node];
+		ns->hit += s->hit;
+		ns->miss += s->miss;
+		ns->foreign += s->foreign;
+		ns->local += s->local;
+		ns->other += s->other;
+	}
+}
+
+/* Print the free blocks of each order */
+void
+pmm_stats(void)
+{
+	struct numastat ns;
+	struct zpool *zp;
+	struct pcp *pcp;
+	uint64_t nfree;
+	uint32_t c;
+	int i, n;
+
+	kprintf("Free memory by order:\n");
+	for (i = 0; i <= PMM_MAXORDER; i++) {
+		for (nfree = 0, n = 0; n < nnode; n++)
+			nfree += zones[n].nfree[i];
+		if (nfree == 0)
+			continue;
+		kprintf("  order %d (%lu KiB): %lu blocks, %lu KiB\n", i,
+				(PAGE_SIZE << i) / 1024, nfree,
+				nfree * (PAGE_SIZE << i) / 1024);
+	}
+	kprintf("Per-CPU page caches:\n");
+	for (c = 0; c < ncpu; c++) {
+		for (i = 0; i < PCP_NORDER; i++) {
+			pcp = &cpus[c].pcp[i];
+			kprintf("  cpu %u order %d: %u cached (%u-%u), "
+					"%lu hits, %lu misses\n", c,
+					pcp_orders[i].order, pcp->count,
+					pcp->low, pcp->high, pcp->hits,
+					pcp->misses);
+		}
+	}
+	kprintf("Zeroed pages:\n");
+	for (n = 0; n < nnode; n++) {
+		zp = &zpools[n];
+		kprintf("  node %d: %u pooled, %lu hits, %lu zeroed on demand, "
+				"%lu zeroed idle\n", n, zp->count, zp->hits,
+				zp->demand, zp->idle);
+	}
+	kprintf("Nodes (pages):\n");
+	for (n = 0; n < nnode; n++) {
+		pmm_numastat(n, &ns);
+		kprintf("  node %d: %lu KiB of %lu KiB free, %lu hit, "
+				"%lu miss, %lu foreign, %lu local, %lu other\n",
+				n, zones[n].freepages * PAGE_SIZE / 1024,
+				zones[n].present * PAGE_SIZE / 1024, ns.hit,
+				ns.miss, ns.foreign, ns.local, ns.other);
+	}
+	kprintf("  %lu KiB free\n", pmm_freemem() / 1024);
+}
+
+/* Free the pages of `base`..`end` not covered by a reservation into `z` */
+static void
+seed(struct zone *z, uintptr_t base, uintptr_t end)
+{
+	uint64_t pfn, npg;
+	int i, order;
+
+	base = (base + PAGE_MASK) & ~PAGE_MASK;
+	end &= ~PAGE_MASK;
+	if (base >= end)
+		return;
+
+	for (i = 0; i < nresv; i++) {
+		if (resv[i].end <= base || resv[i].base >= end)
+			continue;
+		if (resv[i].base > base)
+			seed(z, base, resv[i].base);
+		if (resv[i].end < end)
+			seed(z, resv[i].end, end);
+		return;
+	}
+
+	/* Largest blocks that are aligned and fit */
+	pfn = (base - z->base) / PAGE_SIZE;
+	npg = (end - base) / PAGE_SIZE;
+	z->present += npg;
+	while (npg > 0) {
+		for (order = PMM_MAXORDER; order > 0; order--) {
+			if ((pfn & ((1ULL << order) - 1)) == 0
+			&& (1ULL << order) <= npg)
+				break;
+		}
+		release(z, order, pfn);
+		pfn += 1ULL << order;
+		npg -= 1ULL << order;
+	}
+}
+
+/* Seed `base`..`end` into the zones of the nodes it belongs to */
+static void
+seednodes(uintptr_t base, uintptr_t end)
+{
+	struct zone *z;
+	uintptr_t next;
+
+	for (; base < end; base = next) {
+		z = &zones[numa_node(base, &next)];
+		if (next > end)
+			next = end;
+		spin_lock(&z->lock);
+		seed(z, base, next);
+		spin_unlock(&z->lock);
+	}
+}
+
+/*
+ * Give boot services and bootloader memory (`KMM_BOOT`) to the allocator.
+ * Everything the kernel still needed from there must have been copied out
+ * by now: `kargtab` itself, the firmware's GDT and GOP mode information.
+ * The kernel runs on its own stack from the start.
+ */
+void
+pmm_reclaim(void)
+{
+	uint64_t i, bytes;
+
+	bytes = 0;
+	for (i = 0; i < kmmap_n; i++) {
+		if (kmmap[i].type != KMM_BOOT)
+			continue;
+		seednodes(kmmap[i].base, kmmap[i].base + kmmap[i].size);
+		kmmap[i].type = KMM_USABLE;
+		bytes += kmmap[i].size;
+	}
+
+	kprintf("pmm: reclaimed %lu KiB of boot memory\n", bytes / 1024);
+}
+
+/*
+ * Carve `sz` bytes of allocator metadata out of the first usable range with
+ * room for it, preferring memory of `node`. Returns its physical address.
+ */
+static uintptr_t
+mapalloc(uint64_t sz, int node)
+{
+	uintptr_t base, end, next;
+	uint64_t i;
+	int j, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < kmmap_n; i++) {
+			if (kmmap[i].type != KMM_USABLE)
+				continue;
+
+			base = (kmmap[i].base + PAGE_MASK) & ~PAGE_MASK;
+			end = (kmmap[i].base + kmmap[i].size) & ~PAGE_MASK;
+			for (; base < end; base = next) {
+				if (numa_node(base, &next) != node && pass == 0)
+					continue;
+				if (next > end)
+					next = end;
+
+				/* Step past reservations, rescanning after each */
+				for (j = 0; j < nresv; ) {
+					if (resv[j].base < base + sz
+					&& resv[j].end > base) {
+						base = resv[j].end;
+						j = 0;
+						continue;
+					}
+					j++;
+				}
+				if (base + sz <= next)
+					return base;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Set up the free lists and metadata of `z`, to span `lo`..`hi` */
+static int
+zone_init(struct zone *z, uintptr_t lo, uintptr_t hi)
+{
+	uintptr_t bitmaps;
+	uint64_t i, sz, words[PMM_NORDER];
+	uint64_t *p;
+	int j;
+
+	z->base = lo & ~((PAGE_SIZE << PMM_MAXORDER) - 1);
+	z->npages = (hi - z->base) / PAGE_SIZE;
+
+	/* One bit per block of each order, and the owner words */
+	sz = 0;
+	for (j = 0; j <= PMM_MAXORDER; j++) {
+		words[j] = ((z->npages >> j) + 64) / 64;
+		sz += words[j] * sizeof(uint64_t);
+	}
+	sz += z->npages * sizeof(uintptr_t);
+	sz = (sz + PAGE_MASK) & ~PAGE_MASK;
+
+	if ((bitmaps = mapalloc(sz, z->node)) == 0) {
+		kprintf("pmm: no room for %lu KiB of node %d metadata\n",
+				sz / 1024, z->node);
+		z->npages = 0;
+		return -1;
+	}
+	reserve(bitmaps, sz);
+
+	p = (uint64_t *) P2V(bitmaps);
+	for (i = 0; i < sz / sizeof(uint64_t); i++)
+		p[i] = 0;
+	for (j = 0; j <= PMM_MAXORDER; j++) {
+		z->map[j] = p;
+		p += words[j];
+		z->free[j].next = z->free[j].prev = &z->free[j];
+		z->nfree[j] = 0;
+	}
+	z->owner = (uintptr_t *) p;
+
+	kprintf("pmm: node %d: %lu pages from %lx, %lu KiB of metadata\n",
+			z->node, z->npages, z->base, sz / 1024);
+
+	return 0;
+}
+
+/* Order the zones with memory by distance from each node */
+static void
+fallback_init(void)
 {
-	mmap = (Efi_memory_descriptor *) kargtab->mmap;
-	mmap_sz = kargtab->mmap_sz;
-	mmap_dsz = kargtab->mmap_dsz;
-	
-	
+	struct zone *z, *t;
+	int n, m, i;
+
+	for (n = 0; n < nnode; n++) {
+		z = &zones[n];
+		z->nfallback = 0;
+		for (m = 0; m < nnode; m++) {
+			if (zones[m].npages == 0)
+				continue;
+
+			/* Insertion sort, stable so ties go to the lower node */
+			t = &zones[m];
+			for (i = z->nfallback; i > 0
+					&& numa_distance(n, z->fallback[i - 1]->node)
+					> numa_distance(n, m); i--)
+				z->fallback[i] = z->fallback[i - 1];
+			z->fallback[i] = t;
+			z->nfallback++;
+		}
+	}
 }
 
+/* Needs `numa_init()` and `cpu_init()` */
+void
+pmm_init(struct kargtab *kargtab)
+{
+	uintptr_t lo[MAXNODE], hi[MAXNODE], base, end, next;
+	uint64_t i, usable;
+	int j, n;
+
+	kmmap = (struct kmmap *) kargtab->kmmap;
+	kmmap_n = kargtab->kmmap_n;
+
+	for (n = 0; n < nnode; n++) {
+		lo[n] = UINTPTR_MAX;
+		hi[n] = 0;
+	}
+
+	usable = 0;
+	kprintf("Memory map:\n");
+	for (i = 0; i < kmmap_n; i++) {
+		kprintf("  %lx - %lx %s\n", kmmap[i].base,
+				kmmap[i].base + kmmap[i].size - 1,
+				kmm_names[kmmap[i].type]);
+		if (kmmap[i].type == KMM_USABLE)
+			usable += kmmap[i].size;
+
+		/* Zones span boot memory too, for `pmm_reclaim()` */
+		if (kmmap[i].type != KMM_USABLE && kmmap[i].type != KMM_BOOT)
+			continue;
+		end = kmmap[i].base + kmmap[i].size;
+		for (base = kmmap[i].base; base < end; base = next) {
+			n = numa_node(base, &next);
+			if (next > end)
+				next = end;
+			if (base < lo[n])
+				lo[n] = base;
+			if (next > hi[n])
+				hi[n] = next;
+		}
+	}
+	kprintf("  %lu ranges, %lu KiB usable\n", kmmap_n, usable / 1024);
+	if (kargtab->kmmap_lost != 0)
+		kprintf("  %lu memory map entries did not fit, their memory "
+				"is not used\n", kargtab->kmmap_lost);
+
+	/* Page 0 doubles as the failure return of `pmm_alloc()` */
+	reserve(0, PAGE_SIZE);
+	reserve_kernel(kargtab);
+	reserve(V2P(kargtab->font_base), kargtab->font_size);
+	reserve(V2P(kargtab->mmap), kargtab->mmap_sz);
+	reserve(V2P(kargtab->kmmap), kargtab->kmmap_n * sizeof(struct kmmap));
+	reserve(V2P(kargtab->initrd_base), kargtab->initrd_size);
+	reserve(kargtab->trampoline, kargtab->trampoline ? PAGE_SIZE : 0);
+
+	for (n = 0; n < nnode; n++) {
+		zones[n].node = n;
+		if (hi[n] != 0)
+			zone_init(&zones[n], lo[n], hi[n]);
+	}
+	fallback_init();
+	if (zones[0].fallback[0] == NULL) {
+		kprintf("pmm: no usable memory\n");
+		return;
+	}
+
+	for (j = 0; j < PCP_NORDER; j++)
+		pcpwant[j] = (uint64_t) pcp_orders[j].high << 32
+				| pcp_orders[j].low;
+	for (i = 0; i < NCPU; i++) {
+		for (j = 0; j < PCP_NORDER; j++) {
+			cpus[i].pcp[j].high = pcp_orders[j].high;
+			cpus[i].pcp[j].low = pcp_orders[j].low;
+		}
+	}
+
+	for (i = 0; i < kmmap_n; i++) {
+		if (kmmap[i].type == KMM_USABLE)
+			seednodes(kmmap[i].base,
+					kmmap[i].base + kmmap[i].size);
+	}
+
+	pmm_stats();
+}
@@ -10,7 +10,58 @@
 #ifndef _PMM_H_
 #define _PMM_H_
 
-void	pmm_init(struct kargtab *kargtab);
+/* Needs `sys/numa.h` */
 
-#endif /*_PMM_H_ */
+/* Block orders, 2^order pages: 4 KiB (0) through 1 GiB (18) */
+#define PMM_MAXORDER	18
+#define PMM_NORDER	(PMM_MAXORDER + 1)
+
+/*
+ * Per-CPU page cache ("magazine"), a LIFO stack of free blocks of one order
+ * refilled from and drained to the zone in batches. Orders 0 (4 KiB) and 9
+ * (2 MiB) are cached.
+ */
+#define PCP_NORDER	2
+#define PCP_MAX		64		/* Capacity */
+
+struct pcp {
+
+	uint32_t	count;			/* Blocks cached */
+	uint32_t	high;			/* Drain to `low` above this */
+	uint32_t	low;			/* Refill to this when empty */
+	uint64_t	hits;			/* Served from the cache */
+	uint64_t	misses;			/* Went to the zone */
+	uintptr_t	blks[PCP_MAX];		/* Physical addresses */
+
+};
 
+/*
+ * NUMA allocation statistics, in pages, kept per CPU for each node. An
+ * allocation meant for node A that got memory of node B is a miss for B and
+ * foreign for A.
+ */
+struct numastat {
+
+	uint64_t	hit;			/* Got memory of the node asked */
+	uint64_t	miss;			/* Asked another, got this one */
+	uint64_t	foreign;		/* Asked this one, got another */
+	uint64_t	local;			/* Allocated by a CPU of the node */
+	uint64_t	other;			/* 	-of another node */
+
+};
+
+void		pmm_init(struct kargtab *kargtab);
+void		pmm_reclaim(void);
+uintptr_t	pmm_alloc(int order);
+uintptr_t	pmm_alloc_node(int node, int order);
+void		pmm_free(uintptr_t pa, int order);
+uintptr_t	pmm_zalloc(int order);
+int		pmm_zero_idle(int max);
+uintptr_t *	pmm_owner(uintptr_t pa);
+uint64_t	pmm_freemem(void);
+void		pmm_stats(void);
+void		pmm_numastat(int node, struct numastat *ns);
+int		pmm_pcp_tune(int order, uint32_t high, uint32_t low);
+void		pmm_pcp_drain(void);
+
+#endif /*_PMM_H_ */
@@ -0,0 +1,329 @@
+/*
+ * ALIX: `sys/rcu.c` -- Read-copy-update
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/timer.h>
+#include <sys/sched.h>
+#include <sys/rcu.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/lapic.h>
+#include <sys/dev/console.h>
+
+/*
+ * Quiescent state RCU. A read-side section runs with preemption disabled,
+ * so a processor is outside of any when the scheduler (`sched.c`) switches
+ * threads, loops in the idle thread, or ends an interrupt that came with
+ * preemption enabled; each reports that through `rcu_qs()`. A grace
+ * period is over once every processor running at its start has reported,
+ * and nothing removed before it started can be referenced any more.
+ *
+ * `qsmask` holds the processors yet to report, `rcu_qs()` clears its own
+ * bit: one load when there is no grace period to report to. Starting one
+ * interrupts every other processor, so the idle ones halted with nothing to
+ * do report at once; those inside a read-side section, or with interrupts
+ * off, report at their next switch or interrupt, and are interrupted
+ * again every `RCU_KICK_NS` until they have.
+ *
+ * Callbacks are batched: all those queued while a grace period runs wait
+ * for the next one together, which starts as the current one ends. When it
+ * ends they are handed to the "rcu" thread, which calls them in the order
+ * they were queued.
+ */
+
+struct cblist {
+
+	struct rcuhead *	head;
+	struct rcuhead **	tail;
+
+};
+
+static struct spinlock	rculock = SPINLOCK_INIT;	/* Grace periods
+							   and callbacks */
+static uint64_t		qsmask;		/* Processors yet to report */
+static int		gpactive;	/* A grace period is running */
+static struct thread *	rcuthread;	/* Calls the `donecb` callbacks */
+
+/* Callbacks for the next grace period, the current one, and done with */
+static struct cblist	nextcb = { NULL, &nextcb.head };
+static struct cblist	waitcb = { NULL, &waitcb.head };
+static struct cblist	donecb = { NULL, &donecb.head };
+
+static uint64_t		ngp;		/* Grace periods completed */
+static uint64_t		ncalled;	/* Callbacks called */
+static uint64_t		maxbatch;	/* Most callbacks called at once */
+static uint64_t		nkick;		/* Processors interrupted */
+
+/* Each processor's `kick()`, only touched by that processor */
+static struct timer	kicks[NCPU];
+static int		kicking[NCPU];
+
+static void
+cbinit(struct cblist *l)
+{
+	l->head = NULL;
+	l->tail = &l->head;
+}
+
+/* Move all of `from` to the end of `to` */
+static void
+cbmove(struct cblist *to, struct cblist *from)
+{
+	if (from->head == NULL)
+		return;
+	*to->tail = from->head;
+	to->tail = from->tail;
+	cbinit(from);
+}
+
+/* Interrupt the processors in `mask`, ending in `sched_intr()` */
+static void
+interrupt(uint64_t mask)
+{
+	uint32_t i;
+
+	for (; mask != 0; mask &= mask - 1) {
+		i = __builtin_ctzll(mask);
+		lapic_ipi(cpus[i].apicid, T_RESCHED);
+		__atomic_add_fetch(&nkick, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Keep interrupting processors late to report, interrupts off */
+static void
+kick(void *arg)
+{
+	uint64_t mask;
+	uint32_t id;
+
+	(void) arg;
+
+	id = cpu_self()->id;
+	kicking[id] = 0;
+	if (!__atomic_load_n(&gpactive, __ATOMIC_RELAXED))
+		return;
+
+	/* This one reports at the end of the timer interrupt */
+	mask = __atomic_load_n(&qsmask, __ATOMIC_RELAXED) & ~(1ULL << id);
+	interrupt(mask);
+	kicking[id] = 1;
+	timer_add(&kicks[id], RCU_KICK_NS);
+}
+
+/* Start a grace period for the `nextcb` callbacks, `rculock` held */
+static void
+gpstart(void)
+{
+	uint64_t mask;
+	uint32_t n, id;
+
+	cbmove(&waitcb, &nextcb);
+	gpactive = 1;
+
+	/* Ordered after the removals the callbacks wait on */
+	n = __atomic_load_n(&ncpu, __ATOMIC_ACQUIRE);
+	mask = n == 64 ? ~0ULL : (1ULL << n) - 1;
+	__atomic_store_n(&qsmask, mask, __ATOMIC_SEQ_CST);
+
+	id = cpu_self()->id;
+	interrupt(mask & ~(1ULL << id));
+	if (!kicking[id]) {
+		kicking[id] = 1;
+		timer_add(&kicks[id], RCU_KICK_NS);
+	}
+}
+
+/* Call the callbacks from `h` on, returns how many */
+static uint64_t
+invoke(struct rcuhead *h)
+{
+	struct rcuhead *next;
+	uint64_t n;
+
+	for (n = 0; h != NULL; h = next, n++) {
+		next = h->next;
+		h->func(h);
+	}
+
+	return n;
+}
+
+/*
+ * The last processor reported: the waiting callbacks are done with, and
+ * the next grace period starts if any are queued for one. Interrupts off,
+ * the calling processor in a quiescent state.
+ */
+static void
+gpend(void)
+{
+	struct rcuhead *h;
+	uint64_t flags, bit;
+	int again;
+
+	bit = 1ULL << cpu_self()->id;
+	flags = spin_lock_irqsave(&rculock);
+	do {
+		cbmove(&donecb, &waitcb);
+		ngp++;
+		gpactive = 0;
+		again = 0;
+		if (nextcb.head != NULL) {
+			gpstart();
+			again = __atomic_fetch_and(&qsmask, ~bit,
+					__ATOMIC_SEQ_CST) == bit;
+		}
+	} while (again);
+
+	/* Without a thread, here and now */
+	h = NULL;
+	if (rcuthread == NULL) {
+		h = donecb.head;
+		cbinit(&donecb);
+	}
+	spin_unlock_irqrestore(&rculock, flags);
+
+	if (rcuthread != NULL)
+		thread_unpark(rcuthread);
+	else
+		__atomic_add_fetch(&ncalled, invoke(h), __ATOMIC_RELAXED);
+}
+
+/*
+ * The calling processor is in a quiescent state, holding no reference
+ * from a read-side section. Interrupts off, no run queue locked.
+ */
+void
+rcu_qs(void)
+{
+	uint64_t bit;
+
+	bit = 1ULL << cpu_self()->id;
+	if ((__atomic_load_n(&qsmask, __ATOMIC_RELAXED) & bit) == 0)
+		return;
+
+	if (__atomic_fetch_and(&qsmask, ~bit, __ATOMIC_SEQ_CST) == bit)
+		gpend();
+}
+
+/*
+ * Have `func(head)` called once a grace period has passed, from the "rcu"
+ * thread. May be called from a read-side section, not from interrupts.
+ */
+void
+call_rcu(struct rcuhead *head, void (*func)(struct rcuhead *))
+{
+	uint64_t flags;
+
+	head->next = NULL;
+	head->func = func;
+
+	flags = spin_lock_irqsave(&rculock);
+	*nextcb.tail = head;
+	nextcb.tail = &head->next;
+	if (!gpactive)
+		gpstart();
+	spin_unlock_irqrestore(&rculock, flags);
+}
+
+struct waiter {
+
+	struct rcuhead	head;
+	struct thread *	thread;
+	int		done;
+
+};
+
+static void
+wakeup(struct rcuhead *head)
+{
+	struct waiter *w;
+	struct thread *t;
+
+	/* The waiter may return the moment `done` is set */
+	w = (struct waiter *) head;
+	t = w->thread;
+	__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	thread_unpark(t);
+}
+
+/*
+ * Wait for a grace period, outside of any read-side section. Callbacks run
+ * in order, so those queued before have all been called when it returns.
+ */
+void
+synchronize_rcu(void)
+{
+	struct waiter w;
+
+	w.thread = thread_self();
+	w.done = 0;
+	call_rcu(&w.head, wakeup);
+
+	while (!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE))
+		thread_park();
+}
+
+static void
+rcumain(void *arg)
+{
+	struct rcuhead *h;
+	uint64_t flags, n, max;
+
+	(void) arg;
+
+	for (;;) {
+		flags = spin_lock_irqsave(&rculock);
+		h = donecb.head;
+		cbinit(&donecb);
+		spin_unlock_irqrestore(&rculock, flags);
+
+		if (h == NULL) {
+			thread_park();
+			continue;
+		}
+
+		n = invoke(h);
+		__atomic_add_fetch(&ncalled, n, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&maxbatch, __ATOMIC_RELAXED);
+		if (n > max)
+			__atomic_store_n(&maxbatch, n, __ATOMIC_RELAXED);
+	}
+}
+
+/* Start the callback thread, needs `sched_init()` */
+void
+rcu_init(void)
+{
+	struct thread *t;
+	uint32_t i;
+
+	for (i = 0; i < NCPU; i++)
+		kicks[i].func = kick;
+
+	if ((t = thread_create("rcu", rcumain, NULL, PRIO_DEFAULT, -1))
+	    == NULL)
+		kprintf("rcu: no thread, callbacks run where grace periods "
+				"end\n");
+	__atomic_store_n(&rcuthread, t, __ATOMIC_RELEASE);
+}
+
+void
+rcu_stats(void)
+{
+	kprintf("RCU: %lu grace periods, %lu callbacks, at most %lu at once, "
+			"%lu processors interrupted\n", ngp, ncalled, maxbatch,
+			nkick);
+}
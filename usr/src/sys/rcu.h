@@ -0,0 +1,60 @@
+/*
+ * ALIX: `sys/rcu.h` -- Read-copy-update
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/* Needs `sys/lock.h` */
+
+#define RCU_KICK_NS	1000000		/* Interrupt CPUs holding up a grace
+					   period this often */
+
+/*
+ * A callback for after a grace period, embedded in what it is to free.
+ * Owned by the RCU code from `call_rcu()` until `func` is called.
+ */
+struct rcuhead {
+
+	struct rcuhead *	next;
+	void			(*func)(struct rcuhead *head);
+
+};
+
+/*
+ * Pointers readers follow are loaded with `rcu_dereference()` and published
+ * with `rcu_assign_pointer()`, after what they point to is filled in.
+ */
+#define rcu_dereference(p)	__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) \
+	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/*
+ * A read-side section. It may nest but not block. Threads are preempted at
+ * the end of interrupts, so it holds preemption off: a per-CPU count, no
+ * shared cache line is written.
+ */
+static inline void
+rcu_read_lock(void)
+{
+	preempt_disable();
+}
+
+static inline void
+rcu_read_unlock(void)
+{
+	preempt_enable();
+}
+
+void	rcu_init(void);
+void	rcu_qs(void);
+void	call_rcu(struct rcuhead *head, void (*func)(struct rcuhead *));
+void	synchronize_rcu(void);
+void	rcu_stats(void);
+
+#endif /* _RCU_H_ */
@@ -0,0 +1,774 @@
+/*
+ * ALIX: `sys/sched.c` -- Kernel threads and scheduling
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/kmalloc.h>
+#include <sys/timer.h>
+#include <sys/sched.h>
+#include <sys/topo.h>
+#include <sys/rcu.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/lapic.h>
+#include <sys/dev/console.h>
+
+/*
+ * Every processor runs threads off its own run queue: a FIFO list per
+ * priority and a bitmap of the non-empty ones, so adding a thread and taking
+ * the best one are a few instructions whatever the number queued. A thread
+ * runs until it blocks, yields, or its slice runs out while another of its
+ * priority waits; one of a higher priority preempts it as soon as it is
+ * queued. Slices are a timer on the processor's wheel, only armed while
+ * there is a thread to hand over to, so a processor with one thread to run
+ * still takes no timer interrupts. Switching does not touch the timer: when
+ * it fires the slice is measured from when the current thread started.
+ *
+ * With its queue empty a processor runs its idle thread, which first looks
+ * for the busiest other queue and steals a waiting thread from it, going
+ * through its scheduling domains (`topo.c`) from the smallest: a thread
+ * moved between SMT siblings keeps its caches, one moved to another node
+ * loses them and its memory is remote. Threads not pinned are woken, and
+ * new ones started, on an idle CPU sharing the last level cache with where
+ * they ran, preferring a core whose threads are all idle, if their own CPU
+ * is busy. Queuing a thread on another processor sends it a `T_RESCHED`
+ * interrupt, to wake it from `halt()` or start a slice.
+ *
+ * A run queue's lock is held, with interrupts off, across the switch away
+ * from a thread; the thread switched to releases it (`finish()`). Nothing
+ * can catch a thread on a queue before it is off its processor.
+ *
+ * Threads are switched out from interrupts as well as where they block, at
+ * the end of `trap()`, unless preemption is disabled: spinlock holders,
+ * RCU readers and users of per-CPU data hold it off with
+ * `preempt_disable()`. Switches, the idle loop and the end of interrupts
+ * with preemption enabled are thus RCU quiescent states (`rcu_qs()`).
+ */
+
+struct runq {
+
+	struct spinlock	lock;
+	uint32_t	bitmap;		/* Non-empty `head`s */
+	uint32_t	nqueued;	/* Read unlocked by stealers */
+	struct thread *	head[NPRIO];
+	struct thread *	tail[NPRIO];
+	struct thread *	cur;		/* Running, NULL before it is set up */
+	struct thread *	idle;
+	struct thread *	dead;		/* Exited, freed after the switch */
+	struct timer	slice;
+	int		slicing;	/* `slice` pending */
+	uint64_t	slicestart;	/* TSC, `cur` switched to */
+	uint64_t	nswitch;
+	uint64_t	npreempt;	/* Switched out by an interrupt */
+	uint64_t	nsteal;		/* Threads taken from other CPUs */
+
+};
+
+static struct runq	runqs[NCPU];
+static struct thread	idlethreads[NCPU];
+static struct thread	mainthread;
+static uint64_t		slicetsc;	/* `SLICE_NS` in TSC cycles */
+
+void	swtch(uintptr_t *old, uintptr_t new);		/* `x64/swtch.S` */
+void	thread_trampoline(void);
+void	thread_start(void (*func)(void *), void *arg);
+
+static void
+enqueue(struct runq *rq, struct thread *t)
+{
+	t->state = TS_RUNNABLE;
+	t->next = NULL;
+	if (rq->head[t->prio] == NULL)
+		rq->head[t->prio] = t;
+	else
+		rq->tail[t->prio]->next = t;
+	rq->tail[t->prio] = t;
+	rq->bitmap |= 1U << t->prio;
+	__atomic_store_n(&rq->nqueued, rq->nqueued + 1, __ATOMIC_RELAXED);
+}
+
+/* Take the first thread of the highest priority, NULL if there is none */
+static struct thread *
+dequeue(struct runq *rq)
+{
+	struct thread *t;
+	int p;
+
+	if (rq->bitmap == 0)
+		return NULL;
+
+	p = __builtin_ctz(rq->bitmap);
+	t = rq->head[p];
+	if ((rq->head[p] = t->next) == NULL)
+		rq->bitmap &= ~(1U << p);
+	__atomic_store_n(&rq->nqueued, rq->nqueued - 1, __ATOMIC_RELAXED);
+
+	return t;
+}
+
+/* Take the first thread not pinned to its CPU, NULL if there is none */
+static struct thread *
+unpinned(struct runq *rq)
+{
+	struct thread **pp, *t, *prev;
+	uint32_t bits;
+	int p;
+
+	for (bits = rq->bitmap; bits != 0; bits &= bits - 1) {
+		p = __builtin_ctz(bits);
+		prev = NULL;
+		for (pp = &rq->head[p]; (t = *pp) != NULL; pp = &t->next) {
+			if (t->flags & TF_PINNED) {
+				prev = t;
+				continue;
+			}
+
+			*pp = t->next;
+			if (rq->tail[p] == t)
+				rq->tail[p] = prev;
+			if (rq->head[p] == NULL)
+				rq->bitmap &= ~(1U << p);
+			__atomic_store_n(&rq->nqueued, rq->nqueued - 1,
+					__ATOMIC_RELAXED);
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+/* Have the slice timer pending if another thread waits, own CPU */
+static void
+slicearm(struct runq *rq)
+{
+	if (!rq->slicing && rq->nqueued != 0
+	&& (rq->cur->flags & TF_IDLE) == 0) {
+		rq->slicing = 1;
+		timer_add_at(&rq->slice, rq->slicestart + slicetsc);
+	}
+}
+
+static void
+sliceend(void *arg)
+{
+	struct runq *rq;
+
+	rq = arg;
+	rq->slicing = 0;
+	if (rq->nqueued == 0 || (rq->cur->flags & TF_IDLE))
+		return;
+
+	/* Up, or the thread started after the timer was set */
+	if (tscread() >= rq->slicestart + slicetsc)
+		__atomic_store_n(&cpu_self()->needresched, 1, __ATOMIC_RELAXED);
+	else
+		slicearm(rq);
+}
+
+/* `t` was queued on CPU `cpu`'s `rq`, locked: make that CPU take notice */
+static void
+kick(struct runq *rq, struct thread *t, uint32_t cpu)
+{
+	if ((rq->cur->flags & TF_IDLE) || t->prio < rq->cur->prio)
+		__atomic_store_n(&cpus[cpu].needresched, 1, __ATOMIC_RELAXED);
+
+	if (cpu == cpu_self()->id)
+		slicearm(rq);
+	else
+		lapic_ipi(cpus[cpu].apicid, T_RESCHED);
+}
+
+static void
+threadfree(struct thread *t)
+{
+	if (t->stack != 0)
+		pmm_free(t->stack, TSTACK_ORDER);
+	if ((t->flags & TF_STATIC) == 0)
+		kfree(t);
+}
+
+/* First thing after a switch, in the thread switched to */
+static void
+finish(void)
+{
+	struct runq *rq;
+	struct thread *dead;
+
+	rq = &runqs[cpu_self()->id];
+	dead = rq->dead;
+	rq->dead = NULL;
+	spin_unlock(&rq->lock);
+	rcu_qs();
+
+	if (dead != NULL)
+		threadfree(dead);
+}
+
+/*
+ * Switch to the next thread of the calling CPU's `rq`, locked with
+ * interrupts off. The current one goes back on the queue if it is still
+ * running. Returns unlocked, once the caller is switched back to.
+ */
+static void
+schedule(struct runq *rq)
+{
+	struct thread *prev, *next;
+
+	prev = rq->cur;
+	if (prev->state == TS_RUNNING && (prev->flags & TF_IDLE) == 0)
+		enqueue(rq, prev);
+	if ((next = dequeue(rq)) == NULL)
+		next = rq->idle;
+
+	__atomic_store_n(&cpu_self()->needresched, 0, __ATOMIC_RELAXED);
+	next->state = TS_RUNNING;
+	rq->cur = next;
+	rq->slicestart = tscread();
+	slicearm(rq);
+
+	if (next == prev) {
+		spin_unlock(&rq->lock);
+		return;
+	}
+
+	if (prev->state == TS_DEAD)
+		rq->dead = prev;
+	next->nswitch++;
+	rq->nswitch++;
+	swtch(&prev->rsp, next->rsp);
+
+	finish();
+}
+
+/* Switch if a switch is due and the caller can be preempted */
+static void
+resched(void)
+{
+	struct runq *rq;
+	struct cpu *self;
+	uint64_t flags;
+
+	flags = intr_save();
+	self = cpu_self();
+	rq = &runqs[self->id];
+	if ((flags & RFLAGS_IF) && self->preempt == 0 && self->needresched
+	&& rq->cur != NULL) {
+		spin_lock(&rq->lock);
+		schedule(rq);
+	}
+	intr_restore(flags);
+}
+
+void
+preempt_enable(void)
+{
+	if (preempt_dec() && cpu_self()->needresched)
+		resched();
+}
+
+/* At the end of every interrupt, switch if a switch is due */
+void
+sched_intr(void)
+{
+	struct runq *rq;
+	struct cpu *self;
+
+	self = cpu_self();
+	rq = &runqs[self->id];
+	if (self->preempt != 0)
+		return;
+	rcu_qs();
+	if (!self->needresched || rq->cur == NULL)
+		return;
+
+	if ((rq->cur->flags & TF_IDLE) == 0)
+		rq->npreempt++;
+	spin_lock(&rq->lock);
+	schedule(rq);
+}
+
+/* Another CPU queued a thread here */
+static void
+reschedipi(struct trapframe *tf)
+{
+	struct runq *rq;
+
+	(void) tf;
+
+	lapic_eoi();
+	rq = &runqs[cpu_self()->id];
+	if (rq->cur == NULL)
+		return;
+	spin_lock(&rq->lock);
+	slicearm(rq);
+	spin_unlock(&rq->lock);
+}
+
+/* Lock the run queue of `t`, which may move until it is locked */
+static struct runq *
+lockrq(struct thread *t)
+{
+	struct runq *rq;
+	uint32_t cpu;
+
+	for (;;) {
+		cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+		rq = &runqs[cpu];
+		spin_lock(&rq->lock);
+		if (t->cpu == cpu)
+			return rq;
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* CPU `cpu` runs its idle thread and has none waiting, read unlocked */
+static int
+isidle(uint32_t cpu)
+{
+	struct thread *cur;
+
+	cur = __atomic_load_n(&runqs[cpu].cur, __ATOMIC_RELAXED);
+
+	return cur != NULL && (cur->flags & TF_IDLE)
+	    && __atomic_load_n(&runqs[cpu].nqueued, __ATOMIC_RELAXED) == 0;
+}
+
+/* Every hardware thread of the core of CPU `cpu` is idle */
+static int
+coreidle(uint32_t cpu)
+{
+	uint64_t span;
+
+	for (span = topo_span(cpu, TOPO_SMT); span != 0; span &= span - 1)
+		if (!isidle(__builtin_ctzll(span)))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * CPU to run a thread that last ran on `cpu`: that one if it is idle, or
+ * else an idle one sharing its last level cache, a whole idle core first,
+ * then a sibling, or else `cpu` after all.
+ */
+static uint32_t
+selectcpu(uint32_t cpu)
+{
+	uint64_t llc, span;
+	uint32_t i;
+	int l;
+
+	if (isidle(cpu))
+		return cpu;
+
+	llc = topo_span(cpu, TOPO_LLC);
+	for (span = llc; span != 0; span &= span - 1) {
+		if ((i = __builtin_ctzll(span)) >= ncpu)
+			break;
+		if (coreidle(i))
+			return i;
+	}
+	for (l = TOPO_SMT; l <= TOPO_LLC; l++) {
+		for (span = topo_span(cpu, l); span != 0; span &= span - 1) {
+			if ((i = __builtin_ctzll(span)) >= ncpu)
+				break;
+			if (isidle(i))
+				return i;
+		}
+	}
+
+	return cpu;
+}
+
+/*
+ * Take a waiting thread off the busiest other queue, looking one domain
+ * level further out each time the ones closer have none. Returns it, now
+ * the calling CPU's but on no queue, or NULL.
+ */
+static struct thread *
+steal(void)
+{
+	struct runq *rq;
+	struct thread *t;
+	struct cpu *self;
+	uint64_t span, seen;
+	uint32_t i, n, best, max;
+	int l;
+
+	self = cpu_self();
+	seen = 1ULL << self->id;
+	for (l = 0; l < NTOPO; l++) {
+		if ((span = topo_span(self->id, l) & ~seen) == 0)
+			continue;
+		seen |= span;
+
+		best = NCPU;
+		max = 0;
+		for (; span != 0; span &= span - 1) {
+			i = __builtin_ctzll(span);
+			if (i >= ncpu)
+				break;
+			n = __atomic_load_n(&runqs[i].nqueued,
+					__ATOMIC_RELAXED);
+			if (n > max) {
+				best = i;
+				max = n;
+			}
+		}
+		if (best == NCPU)
+			continue;
+
+		rq = &runqs[best];
+		spin_lock(&rq->lock);
+		if ((t = unpinned(rq)) != NULL)
+			__atomic_store_n(&t->cpu, self->id, __ATOMIC_RELAXED);
+		spin_unlock(&rq->lock);
+		if (t != NULL)
+			return t;
+	}
+
+	return NULL;
+}
+
+/*
+ * Called by the idle loop with interrupts off: run the threads of the
+ * calling CPU's queue, or one stolen from another. Returns 1 if it did, 0
+ * if there was nothing to run.
+ */
+int
+sched_idle(void)
+{
+	struct runq *rq;
+	struct thread *t;
+
+	rq = &runqs[cpu_self()->id];
+	if (rq->cur == NULL)
+		return 0;
+	rcu_qs();
+
+	t = NULL;
+	if (__atomic_load_n(&rq->nqueued, __ATOMIC_RELAXED) == 0
+	&& (t = steal()) == NULL)
+		return 0;
+
+	spin_lock(&rq->lock);
+	if (t != NULL) {
+		enqueue(rq, t);
+		rq->nsteal++;
+	}
+	schedule(rq);
+
+	return 1;
+}
+
+/* Stack of a new thread, to return from `swtch()` into `thread_trampoline` */
+static int
+newstack(struct thread *t, int node, void (*func)(void *), void *arg)
+{
+	uintptr_t *sp;
+	uintptr_t top;
+
+	if ((t->stack = pmm_alloc_node(node, TSTACK_ORDER)) == 0)
+		return -1;
+	top = P2V(t->stack) + (PAGE_SIZE << TSTACK_ORDER);
+
+	/*
+	 * r15, r14, r13, r12, rbx, rbp, return address: `swtch()` returns to
+	 * `thread_trampoline` with rsp at `top`, 16 byte aligned
+	 */
+	sp = (uintptr_t *) (top - 7 * sizeof(uintptr_t));
+	sp[0] = 0;
+	sp[1] = 0;
+	sp[2] = (uintptr_t) arg;
+	sp[3] = (uintptr_t) func;
+	sp[4] = 0;
+	sp[5] = 0;
+	sp[6] = (uintptr_t) thread_trampoline;
+	t->rsp = (uintptr_t) sp;
+
+	return 0;
+}
+
+/* Where new threads begin, from `thread_trampoline` */
+void
+thread_start(void (*func)(void *), void *arg)
+{
+	finish();
+	intr_restore(RFLAGS_IF);
+	resched();
+
+	func(arg);
+	thread_exit();
+}
+
+static void
+setname(struct thread *t, const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int) sizeof(t->name) - 1 && name[i] != '\0'; i++)
+		t->name[i] = name[i];
+	t->name[i] = '\0';
+}
+
+/*
+ * Create a thread running `func(arg)` at priority `prio`, on CPU `cpu` and
+ * pinned to it, or if `cpu` is -1 on the calling CPU or an idle one sharing
+ * its cache (`selectcpu()`) to begin with.
+ * Returns the thread, NULL if it could not be allocated. It is freed when
+ * `func` returns or calls `thread_exit()`.
+ */
+struct thread *
+thread_create(const char *name, void (*func)(void *), void *arg, int prio,
+    int cpu)
+{
+	struct thread *t;
+	struct runq *rq;
+	uint64_t flags;
+	uint32_t c;
+
+	if (cpu >= (int) __atomic_load_n(&ncpu, __ATOMIC_ACQUIRE)
+	|| prio < 0 || prio >= NPRIO)
+		return NULL;
+	if ((t = kmalloc(sizeof(struct thread), KM_ZERO)) == NULL)
+		return NULL;
+
+	flags = intr_save();
+	c = cpu < 0 ? selectcpu(cpu_self()->id) : (uint32_t) cpu;
+	intr_restore(flags);
+	if (runqs[c].cur == NULL) {
+		kfree(t);
+		return NULL;
+	}
+	if (newstack(t, cpus[c].node, func, arg) != 0) {
+		kfree(t);
+		return NULL;
+	}
+	setname(t, name);
+	t->prio = prio;
+	t->flags = cpu < 0 ? 0 : TF_PINNED;
+	t->cpu = c;
+	t->func = func;
+	t->arg = arg;
+
+	flags = intr_save();
+	rq = &runqs[c];
+	spin_lock(&rq->lock);
+	enqueue(rq, t);
+	kick(rq, t, c);
+	spin_unlock(&rq->lock);
+	intr_restore(flags);
+	resched();
+
+	return t;
+}
+
+/* The calling thread */
+struct thread *
+thread_self(void)
+{
+	struct thread *t;
+	uint64_t flags;
+
+	flags = intr_save();
+	t = runqs[cpu_self()->id].cur;
+	intr_restore(flags);
+
+	return t;
+}
+
+/* Let the next thread of the same or a higher priority run */
+void
+thread_yield(void)
+{
+	struct runq *rq;
+	uint64_t flags;
+
+	flags = intr_save();
+	rq = &runqs[cpu_self()->id];
+	spin_lock(&rq->lock);
+	schedule(rq);
+	intr_restore(flags);
+}
+
+/*
+ * Block until `thread_unpark()`. An unpark that came first is not lost,
+ * it makes the next park return at once.
+ */
+void
+thread_park(void)
+{
+	struct runq *rq;
+	struct thread *t;
+	uint64_t flags;
+
+	flags = intr_save();
+	rq = &runqs[cpu_self()->id];
+	spin_lock(&rq->lock);
+	t = rq->cur;
+	if (t->wakeup) {
+		t->wakeup = 0;
+		spin_unlock(&rq->lock);
+	} else {
+		t->state = TS_BLOCKED;
+		schedule(rq);
+	}
+	intr_restore(flags);
+}
+
+/*
+ * Make parked thread `t` runnable, on the CPU it last ran on, or if it is
+ * not pinned there and that CPU is busy on `selectcpu()`'s choice.
+ */
+void
+thread_unpark(struct thread *t)
+{
+	struct runq *rq;
+	uint64_t flags;
+	uint32_t cpu, to;
+
+	flags = intr_save();
+	rq = lockrq(t);
+	if (t->state != TS_BLOCKED) {
+		t->wakeup = 1;
+		spin_unlock(&rq->lock);
+		intr_restore(flags);
+		return;
+	}
+
+	cpu = t->cpu;
+	if ((t->flags & TF_PINNED) == 0 && (to = selectcpu(cpu)) != cpu) {
+		/*
+		 * Runnable but on no queue until it is on the new one, as when
+		 * stolen; an unpark meanwhile only leaves a wakeup behind
+		 */
+		t->state = TS_RUNNABLE;
+		__atomic_store_n(&t->cpu, to, __ATOMIC_RELAXED);
+		spin_unlock(&rq->lock);
+		cpu = to;
+		rq = &runqs[cpu];
+		spin_lock(&rq->lock);
+	}
+	enqueue(rq, t);
+	kick(rq, t, cpu);
+	spin_unlock(&rq->lock);
+	intr_restore(flags);
+	resched();
+}
+
+/* End the calling thread */
+void
+thread_exit(void)
+{
+	struct runq *rq;
+
+	intr_save();
+	rq = &runqs[cpu_self()->id];
+	if (rq->cur == NULL)
+		cpu_idle();		/* No scheduler, never returns */
+
+	spin_lock(&rq->lock);
+	rq->cur->state = TS_DEAD;
+	schedule(rq);
+
+	for (;;)
+		;
+}
+
+static void
+initthread(struct thread *t, const char *name, int flags, int prio,
+    uint32_t cpu)
+{
+	setname(t, name);
+	t->flags = flags | TF_STATIC;
+	t->prio = prio;
+	t->cpu = cpu;
+	t->state = TS_RUNNING;
+}
+
+/* The calling CPU's boot context becomes its idle thread */
+void
+sched_cpu_init(void)
+{
+	struct runq *rq;
+	uint32_t id;
+
+	id = cpu_self()->id;
+	rq = &runqs[id];
+	initthread(&idlethreads[id], "idle", TF_IDLE | TF_PINNED, NPRIO - 1,
+			id);
+	rq->idle = &idlethreads[id];
+	rq->cur = rq->idle;
+	rq->slicestart = tscread();
+}
+
+static void
+idlemain(void *arg)
+{
+	(void) arg;
+
+	intr_save();
+	cpu_idle();
+}
+
+/*
+ * Make the bootstrap processor's boot context the "main" thread, pinned to
+ * it, and give the processor an idle thread. Needs `kmalloc_init()` and
+ * `timer_init()`. Interrupts stay off until `main()` turns them on once
+ * the rest of the boot processor is set up, from then on the main thread is
+ * preempted like any other.
+ */
+void
+sched_init(void)
+{
+	struct runq *rq;
+	uint32_t i;
+
+	slicetsc = timer_ns2tsc(SLICE_NS);
+	for (i = 0; i < NCPU; i++) {
+		runqs[i].slice.func = sliceend;
+		runqs[i].slice.arg = &runqs[i];
+	}
+	trap_register(T_RESCHED, reschedipi);
+
+	rq = &runqs[0];
+	initthread(&idlethreads[0], "idle", TF_IDLE | TF_PINNED, NPRIO - 1, 0);
+	if (newstack(&idlethreads[0], cpus[0].node, idlemain, NULL) != 0) {
+		kprintf("sched: no idle stack, no threads\n");
+		return;
+	}
+	idlethreads[0].state = TS_RUNNABLE;
+	rq->idle = &idlethreads[0];
+
+	initthread(&mainthread, "main", TF_PINNED, PRIO_DEFAULT, 0);
+	rq->cur = &mainthread;
+	rq->slicestart = tscread();
+}
+
+/* Print each processor's switches, preemptions and steals */
+void
+sched_stats(void)
+{
+	struct runq *rq;
+	uint32_t i;
+
+	kprintf("Scheduler:\n");
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqs[i];
+		kprintf("  cpu %u: %lu switches, %lu preempted, %lu stolen\n",
+				i, rq->nswitch, rq->npreempt, rq->nsteal);
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * ALIX: `sys/sched.h` -- Kernel threads and scheduling
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#define NPRIO		32		/* 0 is the highest */
+#define PRIO_DEFAULT	16
+
+#define TSTACK_ORDER	2		/* 16 KiB kernel stacks */
+#define SLICE_NS	10000000	/* Run before the next of a priority */
+
+/* `state` */
+#define TS_RUNNING	0
+#define TS_RUNNABLE	1		/* On a run queue */
+#define TS_BLOCKED	2		/* Parked */
+#define TS_DEAD		3
+
+/* `flags` */
+#define TF_PINNED	0x01		/* Never stolen by another CPU */
+#define TF_IDLE		0x02		/* A CPU's idle thread */
+#define TF_STATIC	0x04		/* Not allocated, never freed */
+
+/*
+ * A kernel thread. Its run queue's lock covers `state`, `next` and
+ * `wakeup`, and the thread's CPU changes only under it too.
+ */
+struct thread {
+
+	uintptr_t	rsp;		/* Saved by `swtch()` */
+	struct thread *	next;		/* On a run queue */
+	int		state;		/* `TS_*` */
+	int		flags;		/* `TF_*` */
+	int		prio;
+	uint32_t	cpu;		/* Run queue, or last ran on */
+	int		wakeup;		/* `thread_unpark()` came first */
+	uintptr_t	stack;		/* Kernel stack block (physical), 0
+					   if it is not the thread's own */
+	void		(*func)(void *arg);
+	void *		arg;
+	uint64_t	nswitch;	/* Times switched to */
+	char		name[16];
+
+};
+
+void		sched_init(void);
+void		sched_cpu_init(void);
+int		sched_idle(void);
+void		sched_intr(void);
+void		sched_stats(void);
+struct thread *	thread_create(const char *name, void (*func)(void *),
+		    void *arg, int prio, int cpu);
+struct thread *	thread_self(void);
+void		thread_yield(void);
+void		thread_park(void);
+void		thread_unpark(struct thread *t);
+void		thread_exit(void);
+
+#endif /* _SCHED_H_ */
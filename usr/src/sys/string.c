@@ -0,0 +1,68 @@
+/*
+ * ALIX: `sys/string.c` -- Memory and string routines
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/string.h>
+
+/*
+ * The compiler may emit calls to these for structure assignment and
+ * initialization even in a freestanding build, so they keep their C library
+ * names.
+ */
+
+void *
+memset(void *dst, int c, size_t n)
+{
+	uint8_t *d;
+	uint64_t v;
+
+	d = dst;
+	if (n >= 8 && ((uintptr_t) d & 7) == 0) {
+		v = (uint8_t) c * 0x0101010101010101ULL;
+		for (; n >= 8; n -= 8, d += 8)
+			*(volatile uint64_t *) d = v;
+	}
+	for (; n > 0; n--)
+		*(volatile uint8_t *) d++ = c;
+
+	return dst;
+}
+
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+	uint8_t *d;
+	const uint8_t *s;
+
+	d = dst;
+	s = src;
+	if (n >= 8 && (((uintptr_t) d | (uintptr_t) s) & 7) == 0) {
+		for (; n >= 8; n -= 8, d += 8, s += 8)
+			*(volatile uint64_t *) d = *(const uint64_t *) s;
+	}
+	for (; n > 0; n--)
+		*(volatile uint8_t *) d++ = *s++;
+
+	return dst;
+}
+
+int
+memcmp(const void *a, const void *b, size_t n)
+{
+	const uint8_t *x, *y;
+
+	for (x = a, y = b; n > 0; n--, x++, y++) {
+		if (*x != *y)
+			return *x - *y;
+	}
+
+	return 0;
+}
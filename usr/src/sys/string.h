@@ -0,0 +1,17 @@
+/*
+ * ALIX: `sys/string.h` -- Memory and string routines
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _STRING_H_
+#define _STRING_H_
+
+void *	memset(void *dst, int c, size_t n);
+void *	memcpy(void *dst, const void *src, size_t n);
+int	memcmp(const void *a, const void *b, size_t n);
+
+#endif /* _STRING_H_ */
@@ -0,0 +1,79 @@
+/*
+ * ALIX: `sys/timeline.c` -- Boot timeline
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * The bootloader stamps the TSC at the end of each of its phases into
+ * `kargtab->timeline`, the kernel keeps adding its own milestones to the same
+ * table. Printing it gives every boot its own latency breakdown.
+ */
+
+static const char *tl_names[TL_MAX] = {
+	[TL_ENTRY]	= "firmware entry",
+	[TL_FILESYS]	= "filesys_init",
+	[TL_KERNEL]	= "find_kernel",
+	[TL_FONT]	= "find_font",
+	[TL_INITRD]	= "find_initrd",
+	[TL_GOP]	= "gop_init",
+	[TL_TSC]	= "tsc_calibrate",
+	[TL_LOADK]	= "loadk",
+	[TL_MMAP]	= "getmmap",
+	[TL_EXITBS]	= "exit_boot_services",
+	[TL_HANDOFF]	= "er (handoff)",
+	[TL_KMAIN]	= "kernel main",
+	[TL_GDT]	= "gdt_init",
+	[TL_CONSOLE]	= "console_init",
+};
+
+/* Record the end of `phase` */
+void
+tl_stamp(struct kargtab *kargtab, int phase)
+{
+	kargtab->timeline[phase] = tscread();
+}
+
+/* Convert TSC cycles to microseconds using the boot calibration */
+static uint64_t
+tl_us(struct kargtab *kargtab, uint64_t cycles)
+{
+	if (kargtab->tsc_khz == 0)
+		return 0;
+
+	return (cycles * 1000) / kargtab->tsc_khz;
+}
+
+/* Print every recorded phase, its own duration and time since entry */
+void
+tl_print(struct kargtab *kargtab)
+{
+	uint64_t *tl;
+	uint64_t prev;
+	int i;
+
+	tl = kargtab->timeline;
+
+	kprintf("Boot timeline (TSC %lu kHz):\n", kargtab->tsc_khz);
+
+	prev = tl[TL_ENTRY];
+	for (i = 0; i < TL_MAX; i++) {
+		if (tl_names[i] == NULL || tl[i] == 0)
+			continue;
+
+		kprintf("  %s: +%lu us, at %lu us\n", tl_names[i],
+				tl_us(kargtab, tl[i] - prev),
+				tl_us(kargtab, tl[i] - tl[TL_ENTRY]));
+		prev = tl[i];
+	}
+}
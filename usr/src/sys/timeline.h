@@ -0,0 +1,16 @@
+/*
+ * ALIX: `sys/timeline.h` -- Boot timeline
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _TIMELINE_H_
+#define _TIMELINE_H_
+
+void	tl_stamp(struct kargtab *kargtab, int phase);
+void	tl_print(struct kargtab *kargtab);
+
+#endif /* _TIMELINE_H_ */
@@ -0,0 +1,479 @@
+/*
+ * ALIX: `sys/timer.c` -- Timers and clock events
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/timer.h>
+#include <sys/sched.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/lapic.h>
+#include <sys/dev/console.h>
+
+/*
+ * Every processor keeps its own timers in a hierarchical timing wheel and
+ * arms its local APIC timer for the earliest of them, if there is one.
+ * There is no periodic tick: a processor with nothing pending takes no
+ * timer interrupts at all.
+ *
+ * Time is the TSC. The wheel turns in units of 2^`WHEEL_SHIFT` cycles
+ * (about 20 us). Level 0 has a slot for each of the next 64 units, and
+ * each level above has a slot for 64 slots of the one below. As the wheel
+ * turns past a slot of a higher level, its timers cascade down into the
+ * levels below. Within a level, slots are in time order from the current
+ * one. So the earliest timer is in the first non-empty slot of some level,
+ * and the bitmaps of non-empty slots find those slots in a few
+ * instructions.
+ *
+ * Wheels are only touched by their own processor, with interrupts off.
+ */
+
+#define WHEEL_SHIFT	16
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	5		/* 2^46 cycles, hours */
+#define LVL_SHIFT(l)	((l) * WHEEL_BITS)
+
+#define NONE		UINT64_MAX
+
+struct wheel {
+
+	uint64_t	clk;		/* Current unit, those before are done */
+	uint64_t	next;		/* Deadline armed, `NONE` */
+	uint64_t	pending[WHEEL_LEVELS];	/* Non-empty slots */
+	struct timer *	slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+};
+
+static struct wheel	wheels[NCPU];
+
+/* Interrupts and TSC at the last `timer_stats()` */
+static struct {
+
+	uint64_t	intr;
+	uint64_t	tsc;
+
+} laststat[NCPU];
+static uint64_t		tsc_khz;
+int			timer_ready;
+
+/* Convert nanoseconds to TSC cycles */
+uint64_t
+timer_ns2tsc(uint64_t ns)
+{
+	return (ns / 1000000) * tsc_khz + (ns % 1000000) * tsc_khz / 1000000;
+}
+
+static uint64_t
+rotr(uint64_t x, int n)
+{
+	return (x >> n) | (x << ((64 - n) & 63));
+}
+
+static int
+empty(struct wheel *w)
+{
+	int l;
+
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		if (w->pending[l] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+insert(struct wheel *w, struct timer *t)
+{
+	uint64_t idx, delta;
+	int l, s;
+
+	idx = t->expires >> WHEEL_SHIFT;
+	if (idx < w->clk)
+		idx = w->clk;
+	delta = idx - w->clk;
+
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if (delta < (1ULL << LVL_SHIFT(l + 1)))
+			break;
+	}
+	/* Beyond the wheel, parked in the farthest slot until it comes round */
+	if (delta >= (1ULL << LVL_SHIFT(WHEEL_LEVELS)))
+		idx = w->clk + (1ULL << LVL_SHIFT(WHEEL_LEVELS)) - 1;
+
+	s = (idx >> LVL_SHIFT(l)) & WHEEL_MASK;
+	t->next = w->slots[l][s];
+	if (t->next != NULL)
+		t->next->prev = &t->next;
+	t->prev = &w->slots[l][s];
+	w->slots[l][s] = t;
+	w->pending[l] |= 1ULL << s;
+}
+
+static void
+unlink(struct wheel *w, struct timer *t)
+{
+	uintptr_t p, slots;
+	uint64_t i;
+
+	*t->prev = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+
+	/* Emptied a wheel slot, rather than a list taken off one */
+	p = (uintptr_t) t->prev;
+	slots = (uintptr_t) w->slots;
+	if (*t->prev == NULL && p >= slots && p < slots + sizeof(w->slots)) {
+		i = (p - slots) / sizeof(struct timer *);
+		w->pending[i / WHEEL_SIZE] &= ~(1ULL << (i % WHEEL_SIZE));
+	}
+
+	t->prev = NULL;
+}
+
+/* Take the timers off slot `s` of level `l`, return them as a list */
+static struct timer *
+detach(struct wheel *w, int l, int s, struct timer **head)
+{
+	*head = w->slots[l][s];
+	w->slots[l][s] = NULL;
+	w->pending[l] &= ~(1ULL << s);
+	if (*head != NULL)
+		(*head)->prev = head;
+
+	return *head;
+}
+
+/* Move the timers of slot `s` of level `l` down to where they now belong */
+static void
+cascade(struct wheel *w, int l, int s)
+{
+	struct timer *head, *t;
+
+	detach(w, l, s, &head);
+	while ((t = head) != NULL) {
+		unlink(w, t);
+		insert(w, t);
+	}
+}
+
+/* Run the timers of level 0 slot `s` due by `now`, keep the others */
+static void
+runslot(struct wheel *w, int s, uint64_t now)
+{
+	struct timer *head, *t;
+
+	detach(w, 0, s, &head);
+	while ((t = head) != NULL) {
+		unlink(w, t);
+		if (t->expires <= now)
+			t->func(t->arg);
+		else
+			insert(w, t);
+	}
+}
+
+/* Turn the wheel up to `now`, running everything due */
+static void
+advance(struct wheel *w, uint64_t now)
+{
+	uint64_t target, next, step;
+	int l, s;
+
+	target = now >> WHEEL_SHIFT;
+	while (w->clk < target) {
+		if (w->pending[0] != 0) {
+			runslot(w, w->clk & WHEEL_MASK, now);
+			w->clk++;
+		} else {
+			/* Nothing can be due before the next cascade */
+			for (l = 1; l < WHEEL_LEVELS && w->pending[l] == 0;
+					l++)
+				;
+			if (l == WHEEL_LEVELS) {
+				w->clk = target;
+				break;
+			}
+			step = 1ULL << LVL_SHIFT(l);
+			next = (w->clk | (step - 1)) + 1;
+			w->clk = next < target ? next : target;
+		}
+
+		if ((w->clk & WHEEL_MASK) != 0)
+			continue;
+		for (l = 1; l < WHEEL_LEVELS; l++) {
+			s = (w->clk >> LVL_SHIFT(l)) & WHEEL_MASK;
+			cascade(w, l, s);
+			if (s != 0)
+				break;
+		}
+	}
+
+	runslot(w, w->clk & WHEEL_MASK, now);
+}
+
+/* Earliest deadline on the wheel, `NONE` if it is empty */
+static uint64_t
+earliest(struct wheel *w)
+{
+	struct timer *t;
+	uint64_t min;
+	int l, start, s;
+
+	min = NONE;
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		if (w->pending[l] == 0)
+			continue;
+
+		/* Level 0 includes the current slot, the others are past it */
+		start = (w->clk >> LVL_SHIFT(l)) & WHEEL_MASK;
+		if (l != 0)
+			start = (start + 1) & WHEEL_MASK;
+		s = (start + __builtin_ctzll(rotr(w->pending[l], start)))
+				& WHEEL_MASK;
+		for (t = w->slots[l][s]; t != NULL; t = t->next) {
+			if (t->expires < min)
+				min = t->expires;
+		}
+	}
+
+	return min;
+}
+
+/* Arm the timer for the earliest deadline, or leave it off */
+static void
+program(struct wheel *w)
+{
+	uint64_t next;
+
+	next = earliest(w);
+	if (next == w->next)
+		return;
+
+	w->next = next;
+	if (next == NONE)
+		lapic_timer_stop();
+	else
+		lapic_timer_arm(next);
+}
+
+static void
+timer_intr(struct trapframe *tf)
+{
+	struct wheel *w;
+
+	(void) tf;
+
+	w = &wheels[cpu_self()->id];
+	lapic_eoi();
+
+	/* Fired, or fired early with a count too long for one-shot mode */
+	w->next = NONE;
+	advance(w, tscread());
+	program(w);
+}
+
+/*
+ * Add timer `t` to the calling processor's wheel, to run at TSC `deadline`
+ * on it. If it is already pending it moves.
+ */
+void
+timer_add_at(struct timer *t, uint64_t deadline)
+{
+	struct wheel *w;
+	uint64_t flags;
+
+	flags = intr_save();
+	w = &wheels[cpu_self()->id];
+
+	if (t->prev != NULL)
+		unlink(&wheels[t->cpu], t);
+
+	/* Idle wheels do not turn, catch up before measuring from it */
+	if (empty(w) && w->clk < tscread() >> WHEEL_SHIFT)
+		w->clk = tscread() >> WHEEL_SHIFT;
+
+	t->expires = deadline;
+	t->cpu = cpu_self()->id;
+	insert(w, t);
+	if (timer_ready && deadline < w->next) {
+		w->next = deadline;
+		lapic_timer_arm(deadline);
+	}
+
+	intr_restore(flags);
+}
+
+/* Add timer `t` to run `ns` nanoseconds from now */
+void
+timer_add(struct timer *t, uint64_t ns)
+{
+	timer_add_at(t, tscread() + timer_ns2tsc(ns));
+}
+
+/*
+ * Cancel timer `t`, on the processor it was added on. Returns 1 if it was
+ * pending, 0 if it already ran or never was. An earlier deadline it was
+ * armed for is left to fire and find nothing due.
+ */
+int
+timer_del(struct timer *t)
+{
+	uint64_t flags;
+	int pending;
+
+	flags = intr_save();
+	pending = t->prev != NULL;
+	if (pending)
+		unlink(&wheels[t->cpu], t);
+	intr_restore(flags);
+
+	return pending;
+}
+
+struct sleeper {
+
+	struct thread *	thread;		/* Parked, NULL if halting */
+	int		state;		/* `SLEEP_*` */
+
+};
+
+#define SLEEP_WAIT	0
+#define SLEEP_WAKING	1		/* Fired, still unparking the thread */
+#define SLEEP_DONE	2		/* The sleeper may return */
+
+static void
+wake(void *arg)
+{
+	struct sleeper *s;
+
+	/*
+	 * The sleeper may return, and its thread exit, the moment it sees
+	 * `SLEEP_DONE`, so that comes last. Until then it spins on
+	 * `SLEEP_WAKING` rather than park again and miss the unpark.
+	 */
+	s = arg;
+	__atomic_store_n(&s->state, SLEEP_WAKING, __ATOMIC_RELEASE);
+	if (s->thread != NULL)
+		thread_unpark(s->thread);
+	__atomic_store_n(&s->state, SLEEP_DONE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait `ns` nanoseconds. A thread parks until the timer fires; before
+ * `sched_init()`, or in a CPU's idle thread, the processor halts with
+ * interrupts on instead. Without a timer it spins on the TSC.
+ */
+void
+timer_sleep(uint64_t ns)
+{
+	struct timer t;
+	struct sleeper s;
+	uint64_t flags, end;
+	int state;
+
+	if (!timer_ready) {
+		end = tscread() + timer_ns2tsc(ns);
+		while (tscread() < end)
+			__builtin_ia32_pause();
+		return;
+	}
+
+	s.thread = thread_self();
+	if (s.thread != NULL && (s.thread->flags & TF_IDLE))
+		s.thread = NULL;
+	s.state = SLEEP_WAIT;
+	t.prev = NULL;
+	t.func = wake;
+	t.arg = &s;
+
+	flags = intr_save();
+	timer_add(&t, ns);
+	while ((state = __atomic_load_n(&s.state, __ATOMIC_ACQUIRE))
+	    != SLEEP_DONE) {
+		if (state == SLEEP_WAKING)
+			__builtin_ia32_pause();
+		else if (s.thread != NULL)
+			thread_park();
+		else
+			halt();
+	}
+	intr_restore(flags);
+}
+
+/* Set up the calling processor's wheel and timer */
+void
+timer_cpu_init(void)
+{
+	struct wheel *w;
+
+	if (!timer_ready)
+		return;
+
+	w = &wheels[cpu_self()->id];
+	w->clk = tscread() >> WHEEL_SHIFT;
+	w->next = NONE;
+	laststat[cpu_self()->id].tsc = tscread();
+	lapic_timer_enable();
+}
+
+/*
+ * Choose the clock event device, needs the bootstrap processor's local APIC
+ * enabled (`mp_init()`). Application processors call `timer_cpu_init()`.
+ */
+void
+timer_init(struct kargtab *kargtab)
+{
+	uint32_t i;
+
+	tsc_khz = kargtab->tsc_khz;
+	for (i = 0; i < NCPU; i++)
+		wheels[i].next = NONE;
+
+	if (lapic_timer_init(tsc_khz) != 0) {
+		kprintf("timer: no local APIC timer, timers will not fire\n");
+		return;
+	}
+	trap_register(T_TIMER, timer_intr);
+	timer_ready = 1;
+	timer_cpu_init();
+
+	kprintf("timer: local APIC, %s, tickless\n",
+			tscdeadline ? "TSC-deadline" : "one-shot");
+}
+
+/*
+ * Print the timer interrupts each processor took, and how many a second
+ * since the last call.
+ */
+void
+timer_stats(void)
+{
+	uint64_t n, now, dt;
+	uint32_t i;
+
+	now = tscread();
+	kprintf("Timer interrupts:\n");
+	for (i = 0; i < ncpu; i++) {
+		n = __atomic_load_n(&cpus[i].ntrap[T_TIMER], __ATOMIC_RELAXED);
+		dt = now - laststat[i].tsc;
+		kprintf("  cpu %u: %lu, %lu/s\n", i, n,
+				dt != 0 ? (n - laststat[i].intr) * tsc_khz
+				* 1000 / dt : 0);
+		laststat[i].intr = n;
+		laststat[i].tsc = now;
+	}
+}
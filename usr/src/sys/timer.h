@@ -0,0 +1,40 @@
+/*
+ * ALIX: `sys/timer.h` -- Timers and clock events
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * A pending timeout. Owned by the caller, who fills in `func` and `arg`;
+ * the rest belongs to the timer code while it is pending.
+ */
+struct timer {
+
+	struct timer *	next;		/* In a wheel slot */
+	struct timer **	prev;		/* 	-what points to this, NULL
+					   when not pending */
+	uint64_t	expires;	/* TSC */
+	uint32_t	cpu;		/* Wheel it is on */
+	void		(*func)(void *arg);	/* Called with interrupts off */
+	void *		arg;
+
+};
+
+extern int	timer_ready;		/* Timers fire */
+
+void		timer_init(struct kargtab *kargtab);
+void		timer_cpu_init(void);
+void		timer_add(struct timer *t, uint64_t ns);
+void		timer_add_at(struct timer *t, uint64_t deadline);
+int		timer_del(struct timer *t);
+void		timer_sleep(uint64_t ns);
+uint64_t	timer_ns2tsc(uint64_t ns);
+void		timer_stats(void);
+
+#endif /* _TIMER_H_ */
@@ -0,0 +1,295 @@
+/*
+ * ALIX: `sys/topo.c` -- CPU topology and scheduling domains
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/topo.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * An APIC id is made of bit fields: the thread within its core, the core
+ * within its package, the package. CPUID leaf 0x1F, or 0xB before it, gives
+ * the width of each field below the package; processors without either
+ * give counts per package in leaves 1 and 4. The cache leaves (4, or
+ * 0x8000001D on AMD) say how many ids share the last level cache, as a field
+ * width the same way. The bootstrap processor reads the widths once and
+ * decodes the APIC id of every processor the MADT listed and `mp_start()`
+ * brought up, assuming, as every system does, that all packages are alike.
+ *
+ * Each CPU then gets a scheduling domain per level, the mask of CPUs it
+ * shares a core, a cache, a package, a NUMA node with. A level is made to
+ * cover the one below it, so a node smaller than its package (a package
+ * split into several) still spans the package. Until `topo_init()` every
+ * level spans every CPU.
+ */
+
+static struct {
+
+	uint32_t	pkg;
+	uint32_t	core;		/* Within the package */
+	uint32_t	thread;		/* Within the core */
+
+} ids[NCPU];
+
+static uint64_t		spans[NCPU][NTOPO];
+static int		ready;
+
+static const char *	names[NTOPO] = {
+	"SMT", "LLC", "package", "node", "all"
+};
+
+/* Bits to hold values 0 to `n` - 1 */
+static uint32_t
+order(uint32_t n)
+{
+	return n <= 1 ? 0 : 32 - __builtin_clz(n - 1);
+}
+
+/*
+ * Field widths from extended topology leaf `leaf` (0x1F or 0xB): of the
+ * thread id, and of everything below the package id. Returns 0 if the
+ * leaf is not there.
+ */
+static int
+extleaf(uint32_t leaf, uint32_t *smtshift, uint32_t *pkgshift)
+{
+	uint32_t regs[4];
+	uint32_t sub, type;
+
+	cpuid(0, 0, regs);
+	if (regs[0] < leaf)
+		return 0;
+
+	*smtshift = 0;
+	for (sub = 0; sub < 8; sub++) {
+		cpuid(leaf, sub, regs);
+		if ((type = (regs[2] >> 8) & 0xFF) == 0 || regs[1] == 0)
+			break;
+		if (type == 1)
+			*smtshift = regs[0] & 0x1F;
+		*pkgshift = regs[0] & 0x1F;
+	}
+
+	return sub != 0;
+}
+
+/* Field widths from the logical and core counts of leaves 1 and 4 */
+static void
+legacy(uint32_t *smtshift, uint32_t *pkgshift)
+{
+	uint32_t regs[4];
+	uint32_t max, logical, cores;
+
+	cpuid(0, 0, regs);
+	max = regs[0];
+	cpuid(1, 0, regs);
+	if ((regs[3] & (1 << 28)) == 0) {	/* No HTT, 1 per package */
+		*smtshift = 0;
+		*pkgshift = 0;
+		return;
+	}
+	logical = (regs[1] >> 16) & 0xFF;
+
+	cores = 1;
+	if (max >= 4) {
+		cpuid(4, 0, regs);
+		cores = (regs[0] >> 26) + 1;
+	}
+	if (cores > logical)
+		cores = logical;
+
+	*smtshift = order(logical / cores);
+	*pkgshift = order(logical);
+}
+
+/*
+ * Width of the ids sharing the highest level cache, from deterministic
+ * cache leaf `leaf`. Returns 0 if the leaf is not there.
+ */
+static int
+cacheleaf(uint32_t leaf, uint32_t *llcshift)
+{
+	uint32_t regs[4];
+	uint32_t sub, level, best;
+
+	cpuid(leaf & 0x80000000, 0, regs);
+	if (regs[0] < leaf)
+		return 0;
+
+	best = 0;
+	for (sub = 0; sub < 16; sub++) {
+		cpuid(leaf, sub, regs);
+		if ((regs[0] & 0x1F) == 0)	/* No more caches */
+			break;
+		if ((level = (regs[0] >> 5) & 0x7) >= best) {
+			best = level;
+			*llcshift = order(((regs[0] >> 14) & 0xFFF) + 1);
+		}
+	}
+
+	return best != 0;
+}
+
+/* Mask of the started CPUs in the same `level` domain as `cpu`, unnested */
+static uint64_t
+span(uint32_t cpu, int level, uint32_t llcshift)
+{
+	uint64_t mask;
+	uint32_t i, a, b;
+	int same;
+
+	mask = 0;
+	for (i = 0; i < ncpu; i++) {
+		a = cpus[cpu].apicid;
+		b = cpus[i].apicid;
+		switch (level) {
+		case TOPO_SMT:
+			same = ids[i].pkg == ids[cpu].pkg
+			    && ids[i].core == ids[cpu].core;
+			break;
+		case TOPO_LLC:
+			same = a >> llcshift == b >> llcshift;
+			break;
+		case TOPO_PKG:
+			same = ids[i].pkg == ids[cpu].pkg;
+			break;
+		case TOPO_NODE:
+			same = cpus[i].node == cpus[cpu].node;
+			break;
+		default:
+			same = 1;
+			break;
+		}
+		if (same)
+			mask |= 1ULL << i;
+	}
+
+	return mask;
+}
+
+/* Number of distinct domains of `level` among the started CPUs */
+static uint32_t
+count(int level)
+{
+	uint32_t i, n;
+
+	n = 0;
+	for (i = 0; i < ncpu; i++)
+		if ((uint32_t) __builtin_ctzll(spans[i][level]) == i)
+			n++;
+
+	return n;
+}
+
+static void
+printmap(uint32_t leaf, uint32_t llcshift)
+{
+	uint32_t i;
+	int l;
+
+	kprintf("topo: %u packages, %u cores, %u threads, %u LLCs (",
+			count(TOPO_PKG), count(TOPO_SMT), ncpu, count(TOPO_LLC));
+	if (leaf != 0)
+		kprintf("CPUID leaf %x", leaf);
+	else
+		kprintf("CPUID leaves 1 and 4");
+	kprintf(", LLC id shift %u)\n", llcshift);
+
+	for (i = 0; i < ncpu; i++)
+		kprintf("  cpu %u: APIC id %u, package %u core %u thread %u, "
+				"node %d\n", i, cpus[i].apicid, ids[i].pkg,
+				ids[i].core, ids[i].thread, cpus[i].node);
+
+	kprintf("  cpu 0 domains:");
+	for (l = 0; l < NTOPO; l++)
+		kprintf(" %s %lx", names[l], spans[0][l]);
+	kprintf("\n");
+}
+
+/* Place every running CPU and build its domains, after `mp_start()` */
+void
+topo_init(void)
+{
+	uint32_t smtshift, pkgshift, llcshift, leaf, i, apic;
+	int l;
+
+	smtshift = pkgshift = 0;
+	leaf = 0x1F;
+	if (!extleaf(0x1F, &smtshift, &pkgshift)) {
+		leaf = 0xB;
+		if (!extleaf(0xB, &smtshift, &pkgshift)) {
+			leaf = 0;
+			legacy(&smtshift, &pkgshift);
+		}
+	}
+	if (smtshift > pkgshift)
+		smtshift = pkgshift;
+
+	/* Without cache information take the package */
+	llcshift = pkgshift;
+	if (!cacheleaf(4, &llcshift) && !cacheleaf(0x8000001D, &llcshift))
+		llcshift = pkgshift;
+	if (llcshift > pkgshift)
+		llcshift = pkgshift;
+	if (llcshift < smtshift)
+		llcshift = smtshift;
+
+	for (i = 0; i < ncpu; i++) {
+		apic = cpus[i].apicid;
+		ids[i].thread = apic & ((1U << smtshift) - 1);
+		ids[i].core = (apic & ((1ULL << pkgshift) - 1)) >> smtshift;
+		ids[i].pkg = apic >> pkgshift;
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		for (l = 0; l < NTOPO; l++) {
+			spans[i][l] = span(i, l, llcshift);
+			if (l > 0)
+				spans[i][l] |= spans[i][l - 1];
+		}
+	}
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+
+	printmap(leaf, llcshift);
+}
+
+/* CPUs sharing domain `level` with `cpu`, `cpu` included */
+uint64_t
+topo_span(uint32_t cpu, int level)
+{
+	if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+		return ~0ULL;
+
+	return spans[cpu][level];
+}
+
+/* Lowest level at which CPUs `a` and `b` share a domain */
+int
+topo_level(uint32_t a, uint32_t b)
+{
+	int l;
+
+	for (l = 0; l < TOPO_ALL; l++)
+		if (topo_span(a, l) & (1ULL << b))
+			return l;
+
+	return TOPO_ALL;
+}
+
+const char *
+topo_name(int level)
+{
+	return names[level];
+}
@@ -0,0 +1,29 @@
+/*
+ * ALIX: `sys/topo.h` -- CPU topology and scheduling domains
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+/*
+ * Scheduling domain levels, each spanning the one below. Spans are masks
+ * of CPU ids.
+ */
+#define TOPO_SMT	0		/* Hardware threads of a core */
+#define TOPO_LLC	1		/* Cores sharing the last level cache */
+#define TOPO_PKG	2		/* Package */
+#define TOPO_NODE	3		/* NUMA node */
+#define TOPO_ALL	4		/* Every CPU */
+#define NTOPO		5
+
+void		topo_init(void);
+uint64_t	topo_span(uint32_t cpu, int level);
+int		topo_level(uint32_t a, uint32_t b);
+const char *	topo_name(int level);
+
+#endif /* _TOPO_H_ */
@@ -0,0 +1,995 @@
+/*
+ * ALIX: `sys/vmm.c` -- Kernel virtual memory
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/lock.h>
+#include <sys/kmem.h>
+#include <sys/vmm.h>
+#include <sys/string.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/lapic.h>
+#include <sys/dev/console.h>
+
+/*
+ * The kernel PML4 the bootloader built is adopted as it is, the direct map,
+ * framebuffer window and kernel image keep their mappings. New mappings go
+ * in `vmalloc()` space (`VM_BASE` to `VM_END`), handed out in areas by a
+ * first fit allocator over a sorted list of free extents. An unmapped guard
+ * page follows every area.
+ *
+ * Areas are populated lazily: nothing is mapped until a page is first
+ * touched, then the page fault handler backs it with a zeroed page. A large
+ * buffer costs only the memory actually used. `VM_NOW` maps it all up front.
+ *
+ * Areas of 2 MiB or more start on a 2 MiB boundary, and every 2 MiB of them
+ * that is populated at once is mapped by a single page directory entry.
+ * Touched a page at a time, they start out as 4 KiB pages which idle CPUs
+ * later collapse into 2 MiB pages (`vmm_collapse()`) once all 512 are there.
+ * Unmapping or changing the protection of part of a 2 MiB page splits it
+ * back into 4 KiB pages.
+ *
+ * Page tables are made as needed and kept. The PDPT of `vmalloc()` space is
+ * made up front, so address spaces copying the kernel half of the PML4 later
+ * all see the same mappings.
+ *
+ * Every change to a mapping is shot down in the TLBs of all CPUs before
+ * `vm.lock` is let go or a page it pointed to is freed (`flush()`): the
+ * others are interrupted (`T_TLB`) and waited for. A CPU with interrupts
+ * off answers once it turns them on, or while it waits for `vm.lock`
+ * (`vmlock()`), as the one holding it may be waiting on that CPU.
+ */
+
+/* Pages invalidated one at a time, above this the whole TLB is flushed */
+#define TLB_FLUSH_MAX	32
+
+#define NPTE		512
+#define LPAGE_ORDER	9
+
+/*
+ * Entry bits that are the same in 4 KiB and 2 MiB page entries, as callers
+ * may give them. Not `PTE_G`: a whole TLB flush reloads cr3, which keeps
+ * global entries.
+ */
+#define PTE_PROT	(PTE_W | PTE_U | PTE_PWT | PTE_PCD | PTE_NX)
+
+/* An area, or on the free list a free extent */
+struct vmarea {
+
+	uintptr_t	base;
+	size_t		size;		/* Bytes, guard page not included */
+	int		flags;		/* `VM_*` */
+	uint64_t	prot;		/* `PTE_PROT` bits of its pages */
+	struct vmarea *	next;
+
+};
+
+static struct {
+
+	struct spinlock		lock;
+	uint64_t *		pml4;
+	struct vmarea *		free;		/* Sorted by address */
+	struct vmarea *		areas;
+	struct kmem_cache *	cache;		/* `struct vmarea` */
+	uint32_t		pending;	/* Pages faulted in since the
+						   last `vmm_collapse()` */
+
+	uint64_t		nareas;
+	uint64_t		mapped;		/* Pages, 4 KiB */
+	uint64_t		huge;		/* 2 MiB pages mapped */
+	uint64_t		promotions;	/* 4 KiB runs collapsed */
+	uint64_t		splits;		/* 2 MiB pages split */
+	uint64_t		faults;		/* Populated on touch */
+	uint64_t		invlpgs;
+	uint64_t		flushes;	/* Whole TLB */
+	uint64_t		shootdowns;	/* Other CPUs interrupted */
+
+} vm;
+
+/* The shootdown in progress, under `vm.lock` */
+static struct {
+
+	uintptr_t	va;
+	uint64_t	npages;
+	uint64_t	pending;	/* CPUs yet to flush */
+
+} shoot;
+
+/*
+ * Table entry `e` points to, made if missing and `alloc`. NULL if there is
+ * none or `e` maps a large page.
+ */
+static uint64_t *
+tablenext(uint64_t *e, int alloc)
+{
+	uintptr_t pa;
+
+	if (*e & PTE_P) {
+		if (*e & PTE_PS)
+			return NULL;
+		return (uint64_t *) P2V(*e & PTE_ADDR);
+	}
+
+	if (!alloc || (pa = pmm_zalloc(0)) == 0)
+		return NULL;
+	*e = pa | PTE_P | PTE_W;
+
+	return (uint64_t *) P2V(pa);
+}
+
+/* Page directory entry of `va`, making missing tables if `alloc` */
+static uint64_t *
+walkpd(uintptr_t va, int alloc)
+{
+	uint64_t *t;
+
+	if ((t = tablenext(&vm.pml4[PML4_INDEX(va)], alloc)) == NULL
+	|| (t = tablenext(&t[PDPT_INDEX(va)], alloc)) == NULL)
+		return NULL;
+
+	return &t[PD_INDEX(va)];
+}
+
+/*
+ * Page table entry of `va`, making missing tables if `alloc`. NULL if there
+ * is none or `va` is in a 2 MiB page.
+ */
+static uint64_t *
+walk(uintptr_t va, int alloc)
+{
+	uint64_t *pde, *t;
+
+	if ((pde = walkpd(va, alloc)) == NULL
+	|| (t = tablenext(pde, alloc)) == NULL)
+		return NULL;
+
+	return &t[PT_INDEX(va)];
+}
+
+/*
+ * Invalidate `npages` pages from `va` in the calling CPU's TLB, with
+ * `invlpg` or by reloading `cr3` if there are many. Kernel mappings are not
+ * global, the reload drops them too.
+ */
+static void
+flushlocal(uintptr_t va, uint64_t npages)
+{
+	uint64_t i;
+
+	if (npages > TLB_FLUSH_MAX) {
+		lcr3(rcr3());
+		__atomic_add_fetch(&vm.flushes, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = 0; i < npages; i++)
+		invlpg(va + i * PAGE_SIZE);
+	__atomic_add_fetch(&vm.invlpgs, npages, __ATOMIC_RELAXED);
+}
+
+/* Flush the calling CPU's part of the shootdown in progress, if it has one */
+static void
+answer(void)
+{
+	uint64_t bit;
+
+	bit = 1ULL << cpu_self()->id;
+	if ((__atomic_load_n(&shoot.pending, __ATOMIC_ACQUIRE) & bit) == 0)
+		return;
+
+	flushlocal(shoot.va, shoot.npages);
+	__atomic_and_fetch(&shoot.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void
+tlbipi(struct trapframe *tf)
+{
+	(void) tf;
+
+	lapic_eoi();
+	answer();
+}
+
+/* Take `vm.lock`, answering shootdowns while it is held elsewhere */
+static void
+vmlock(void)
+{
+	while (!spin_trylock(&vm.lock)) {
+		preempt_disable();
+		answer();
+		preempt_enable();
+		__builtin_ia32_pause();
+	}
+}
+
+/*
+ * Invalidate `npages` pages from `va` in every CPU's TLB, returning once
+ * all have: nothing can reach what was mapped there any more. Lock held.
+ */
+static void
+flush(uintptr_t va, uint64_t npages)
+{
+	uint64_t mask, m;
+	uint32_t n;
+
+	flushlocal(va, npages);
+
+	n = __atomic_load_n(&ncpu, __ATOMIC_ACQUIRE);
+	if (n == 1)
+		return;
+	mask = n == 64 ? ~0ULL : (1ULL << n) - 1;
+	mask &= ~(1ULL << cpu_self()->id);
+
+	shoot.va = va;
+	shoot.npages = npages;
+	__atomic_store_n(&shoot.pending, mask, __ATOMIC_RELEASE);
+	for (m = mask; m != 0; m &= m - 1)
+		lapic_ipi(cpus[__builtin_ctzll(m)].apicid, T_TLB);
+	while (__atomic_load_n(&shoot.pending, __ATOMIC_ACQUIRE) != 0)
+		__builtin_ia32_pause();
+	vm.shootdowns++;
+}
+
+/* Invalidate `npages` pages from `va` in every CPU's TLB */
+void
+vmm_flush(uintptr_t va, uint64_t npages)
+{
+	vmlock();
+	flush(va, npages);
+	spin_unlock(&vm.lock);
+}
+
+/*
+ * Split the 2 MiB page `pde` maps at `va` into 4 KiB pages of the same
+ * physical memory and protection. Returns -1 if there is no memory for the
+ * page table.
+ */
+static int
+split(uintptr_t va, uint64_t *pde)
+{
+	uintptr_t pt, pa;
+	uint64_t *t, prot;
+	int i;
+
+	if ((pt = pmm_alloc(0)) == 0)
+		return -1;
+
+	t = (uint64_t *) P2V(pt);
+	pa = *pde & PTE_ADDR & ~LPAGE_MASK;
+	prot = *pde & PTE_PROT;
+	for (i = 0; i < NPTE; i++)
+		t[i] = (pa + i * PAGE_SIZE) | PTE_P | prot;
+
+	*pde = pt | PTE_P | PTE_W;
+	flush(va & ~LPAGE_MASK, 1);		/* Drops the whole entry */
+	vm.huge--;
+	vm.splits++;
+
+	return 0;
+}
+
+/* Like `walk()`, but a 2 MiB page in the way is split */
+static uint64_t *
+walksplit(uintptr_t va, int alloc)
+{
+	uint64_t *pde;
+
+	if ((pde = walkpd(va, alloc)) == NULL)
+		return NULL;
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)
+	&& split(va, pde) != 0)
+		return NULL;
+
+	return walk(va, alloc);
+}
+
+static int
+map(uintptr_t va, uintptr_t pa, uint64_t prot)
+{
+	uint64_t *pte, old;
+
+	if ((pte = walksplit(va, 1)) == NULL)
+		return -1;
+
+	old = *pte;
+	*pte = (pa & PTE_ADDR) | PTE_P | prot;
+	if (old & PTE_P)
+		flush(va, 1);
+	else
+		vm.mapped++;
+
+	return 0;
+}
+
+/*
+ * Map 2 MiB at aligned `va` to aligned `pa` with one page directory entry.
+ * Returns -1 if any 4 KiB page is mapped there.
+ */
+static int
+maplarge(uintptr_t va, uintptr_t pa, uint64_t prot)
+{
+	uint64_t *pde, *t;
+	uintptr_t pt;
+	int i;
+
+	if ((pde = walkpd(va, 1)) == NULL)
+		return -1;
+
+	if (*pde & PTE_P) {
+		if (*pde & PTE_PS)
+			return -1;
+
+		/* An empty page table left by an earlier area goes */
+		t = (uint64_t *) P2V(*pde & PTE_ADDR);
+		for (i = 0; i < NPTE; i++) {
+			if (t[i] != 0)
+				return -1;
+		}
+		pt = *pde & PTE_ADDR;
+		*pde = 0;
+		flush(va, 1);
+		pmm_free(pt, 0);
+	}
+
+	*pde = pa | PTE_P | PTE_PS | prot;
+	vm.mapped += NPTE;
+	vm.huge++;
+
+	return 0;
+}
+
+/*
+ * Map the page at `va` to physical `pa` with `PTE_*` `flags` (present is
+ * implied), replacing any mapping there. Returns 0, or -1 if a page table
+ * could not be allocated.
+ */
+int
+vmm_map(uintptr_t va, uintptr_t pa, uint64_t flags)
+{
+	int r;
+
+	vmlock();
+	r = map(va & ~PAGE_MASK, pa, flags & PTE_PROT);
+	spin_unlock(&vm.lock);
+
+	return r;
+}
+
+/* Unmap the page at `va`, returning the physical page it was mapped to or 0 */
+uintptr_t
+vmm_unmap(uintptr_t va)
+{
+	uint64_t *pte;
+	uintptr_t pa;
+
+	va &= ~PAGE_MASK;
+	pa = 0;
+	vmlock();
+	if ((pte = walksplit(va, 0)) != NULL && (*pte & PTE_P)) {
+		pa = *pte & PTE_ADDR;
+		*pte = 0;
+		vm.mapped--;
+		flush(va, 1);
+	}
+	spin_unlock(&vm.lock);
+
+	return pa;
+}
+
+/* Physical address `va` is mapped to, large pages included, 0 if none */
+uintptr_t
+vmm_translate(uintptr_t va)
+{
+	uint64_t *table, e;
+
+	table = vm.pml4;
+	e = table[PML4_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PDPT_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+	if (e & PTE_PS)
+		return (e & PTE_ADDR & ~HPAGE_MASK) | (va & HPAGE_MASK);
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PD_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+	if (e & PTE_PS)
+		return (e & PTE_ADDR & ~LPAGE_MASK) | (va & LPAGE_MASK);
+
+	table = (uint64_t *) P2V(e & PTE_ADDR);
+	e = table[PT_INDEX(va)];
+	if ((e & PTE_P) == 0)
+		return 0;
+
+	return (e & PTE_ADDR) | (va & PAGE_MASK);
+}
+
+/* Area holding `va`, lock held */
+static struct vmarea *
+areafind(uintptr_t va)
+{
+	struct vmarea *a;
+
+	for (a = vm.areas; a != NULL; a = a->next) {
+		if (va >= a->base && va < a->base + a->size)
+			return a;
+	}
+
+	return NULL;
+}
+
+/* Is `va` mapped writable right now */
+static int
+writable(uintptr_t va)
+{
+	uint64_t *pde, *pte;
+
+	if ((pde = walkpd(va, 0)) == NULL)
+		return 0;
+	if (*pde & PTE_PS)
+		return (*pde & (PTE_P | PTE_W)) == (PTE_P | PTE_W);
+	if ((pte = walk(va, 0)) == NULL)
+		return 0;
+
+	return (*pte & (PTE_P | PTE_W)) == (PTE_P | PTE_W);
+}
+
+/*
+ * Page fault on `va` with error code `err`. Touching an unpopulated page of
+ * an area maps a zeroed page there. Returns 0 if the fault was resolved, -1
+ * if it is a real one.
+ */
+int
+vmm_fault(uintptr_t va, uint64_t err)
+{
+	struct vmarea *a;
+	uint64_t *pde, *pte;
+	uintptr_t pa;
+	int r;
+
+	if ((err & PF_U) != 0 || va < VM_BASE || va >= VM_END)
+		return -1;
+
+	va &= ~PAGE_MASK;
+	r = -1;
+	vmlock();
+	if ((a = areafind(va)) == NULL || (a->flags & VM_PHYS))
+		goto out;
+
+	/* A write held off while `collapse()` copied the page, retry it */
+	if (err & PF_P) {
+		if ((err & PF_W) && (a->prot & PTE_W) && writable(va))
+			r = 0;
+		goto out;
+	}
+
+	if ((pde = walkpd(va, 1)) == NULL)
+		goto out;
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+		r = 0;			/* Collapsed meanwhile */
+		goto out;
+	}
+	if ((pte = walk(va, 1)) == NULL)
+		goto out;
+	if (*pte & PTE_P) {
+		r = 0;			/* Another CPU got there first */
+	} else if ((pa = pmm_zalloc(0)) != 0) {
+		*pte = pa | PTE_P | a->prot;
+		vm.mapped++;
+		vm.faults++;
+		if ((a->flags & VM_NOHUGE) == 0)
+			vm.pending++;
+		r = 0;
+	}
+out:
+	spin_unlock(&vm.lock);
+
+	return r;
+}
+
+/*
+ * Promote the 512 pages under `pde`, at aligned `va` within area `a`, to a
+ * 2 MiB page if all are mapped with the area's protection. Pages already
+ * physically contiguous and aligned stay where they are, anything else is
+ * copied into a fresh 2 MiB block. Returns 1 if promoted.
+ */
+static int
+collapse(struct vmarea *a, uintptr_t va, uint64_t *pde)
+{
+	uintptr_t pt, blk, first;
+	uint64_t *t;
+	int i, inplace;
+
+	pt = *pde & PTE_ADDR;
+	t = (uint64_t *) P2V(pt);
+	first = t[0] & PTE_ADDR;
+	inplace = (first & LPAGE_MASK) == 0;
+	for (i = 0; i < NPTE; i++) {
+		if ((t[i] & PTE_P) == 0 || (t[i] & PTE_PROT) != a->prot)
+			return 0;
+		if ((t[i] & PTE_ADDR) != first + i * PAGE_SIZE)
+			inplace = 0;
+	}
+
+	if (inplace) {
+		*pde = first | PTE_P | PTE_PS | a->prot;
+		flush(va, NPTE);
+		pmm_free(pt, 0);
+		goto done;
+	}
+
+	if ((blk = pmm_alloc(LPAGE_ORDER)) == 0)
+		return 0;
+
+	/* Writes during the copy would be lost, hold them off */
+	if (a->prot & PTE_W) {
+		for (i = 0; i < NPTE; i++)
+			t[i] &= ~PTE_W;
+		flush(va, NPTE);
+	}
+	for (i = 0; i < NPTE; i++)
+		memcpy((void *) P2V(blk + i * PAGE_SIZE),
+				(void *) P2V(t[i] & PTE_ADDR), PAGE_SIZE);
+
+	*pde = blk | PTE_P | PTE_PS | a->prot;
+	flush(va, NPTE);
+	for (i = 0; i < NPTE; i++)
+		pmm_free(t[i] & PTE_ADDR, 0);
+	pmm_free(pt, 0);
+
+done:
+	vm.huge++;
+	vm.promotions++;
+
+	return 1;
+}
+
+/*
+ * Background pass for idle CPUs: collapse up to `max` fully populated 2 MiB
+ * runs of `vmalloc()` areas into 2 MiB pages. Returns the number collapsed,
+ * 0 once there is nothing left to do.
+ */
+int
+vmm_collapse(int max)
+{
+	struct vmarea *a;
+	uintptr_t va;
+	uint64_t *pde;
+	int n;
+
+	if (__atomic_load_n(&vm.pending, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	n = 0;
+	vmlock();
+	vm.pending = 0;
+	for (a = vm.areas; a != NULL && n < max; a = a->next) {
+		if (a->flags & (VM_NOHUGE | VM_PHYS))
+			continue;
+		for (va = (a->base + LPAGE_MASK) & ~LPAGE_MASK;
+				va + LPAGE_SIZE <= a->base + a->size && n < max;
+				va += LPAGE_SIZE) {
+			pde = walkpd(va, 0);
+			if (pde != NULL && (*pde & (PTE_P | PTE_PS)) == PTE_P)
+				n += collapse(a, va, pde);
+		}
+	}
+	if (n == max)
+		vm.pending = 1;		/* Maybe more */
+	spin_unlock(&vm.lock);
+
+	return n;
+}
+
+/*
+ * Back `va`..`end` of area `a` with zeroed memory, using 2 MiB pages where
+ * they fit. Returns -1 if memory ran out.
+ */
+static int
+populate(struct vmarea *a, uintptr_t va, uintptr_t end)
+{
+	uintptr_t pa;
+
+	while (va < end) {
+		if ((a->flags & VM_NOHUGE) == 0 && (va & LPAGE_MASK) == 0
+		&& va + LPAGE_SIZE <= end
+		&& (pa = pmm_zalloc(LPAGE_ORDER)) != 0) {
+			if (maplarge(va, pa, a->prot) == 0) {
+				va += LPAGE_SIZE;
+				continue;
+			}
+			pmm_free(pa, LPAGE_ORDER);
+		}
+
+		if ((pa = pmm_zalloc(0)) == 0)
+			return -1;
+		if (map(va, pa, a->prot) != 0) {
+			pmm_free(pa, 0);
+			return -1;
+		}
+		va += PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+/*
+ * Give `base`..`base + size` back to the free extents, merging it with its
+ * neighbours. `a` is used as the extent if it does not merge, or freed.
+ */
+static void
+extent_free(struct vmarea *a, uintptr_t base, size_t size)
+{
+	struct vmarea *prev, *next;
+
+	prev = NULL;
+	for (next = vm.free; next != NULL && next->base < base;
+			next = next->next)
+		prev = next;
+
+	if (prev != NULL && prev->base + prev->size == base) {
+		prev->size += size;
+		if (next != NULL && prev->base + prev->size == next->base) {
+			prev->size += next->size;
+			prev->next = next->next;
+			kmem_cache_free(vm.cache, next);
+		}
+		kmem_cache_free(vm.cache, a);
+		return;
+	}
+
+	if (next != NULL && base + size == next->base) {
+		next->base = base;
+		next->size += size;
+		kmem_cache_free(vm.cache, a);
+		return;
+	}
+
+	a->base = base;
+	a->size = size;
+	a->next = next;
+	if (prev != NULL)
+		prev->next = a;
+	else
+		vm.free = a;
+}
+
+/*
+ * Reserve an area of `size` bytes (page multiple) plus its guard page, 2 MiB
+ * aligned if it is that large. Returns it with the lock held, or NULL.
+ */
+static struct vmarea *
+area_alloc(size_t size, int flags, uint64_t prot)
+{
+	struct vmarea *a, *spare, *f, **fp;
+	uintptr_t base;
+	size_t span, align;
+
+	if (vm.cache == NULL || size > VM_END - VM_BASE - LPAGE_SIZE)
+		return NULL;
+
+	span = size + PAGE_SIZE;
+	align = (size >= LPAGE_SIZE && (flags & VM_NOHUGE) == 0)
+			? LPAGE_SIZE : PAGE_SIZE;
+	if ((a = kmem_cache_alloc(vm.cache)) == NULL)
+		return NULL;
+	if ((spare = kmem_cache_alloc(vm.cache)) == NULL) {
+		kmem_cache_free(vm.cache, a);
+		return NULL;
+	}
+
+	vmlock();
+	for (fp = &vm.free; (f = *fp) != NULL; fp = &f->next) {
+		base = (f->base + align - 1) & ~(align - 1);
+		if (base + span <= f->base + f->size)
+			break;
+	}
+	if (f == NULL) {
+		spin_unlock(&vm.lock);
+		kmem_cache_free(vm.cache, spare);
+		kmem_cache_free(vm.cache, a);
+		return NULL;
+	}
+
+	/* Alignment leaves a head behind, it stays free */
+	if (base != f->base) {
+		spare->base = f->base;
+		spare->size = base - f->base;
+		spare->next = f;
+		*fp = spare;
+		fp = &spare->next;
+		f->size -= spare->size;
+		f->base = base;
+		spare = NULL;
+	}
+
+	f->base += span;
+	f->size -= span;
+	if (f->size == 0) {
+		*fp = f->next;
+		kmem_cache_free(vm.cache, f);
+	}
+	if (spare != NULL)
+		kmem_cache_free(vm.cache, spare);
+
+	a->base = base;
+	a->size = size;
+	a->flags = flags;
+	a->prot = prot;
+	a->next = vm.areas;
+	vm.areas = a;
+	vm.nareas++;
+
+	return a;
+}
+
+/*
+ * Allocate `size` bytes of kernel virtual memory, page aligned, backed by
+ * zeroed pages as they are touched (or right away with `VM_NOW`). Returns
+ * NULL if address space or, with `VM_NOW`, memory ran out.
+ */
+void *
+vmalloc(size_t size, int flags)
+{
+	struct vmarea *a;
+	int bad;
+
+	if (size == 0)
+		return NULL;
+
+	flags &= ~VM_PHYS;
+	size = (size + PAGE_MASK) & ~PAGE_MASK;
+	if ((a = area_alloc(size, flags, PTE_W)) == NULL)
+		return NULL;
+
+	bad = (flags & VM_NOW) && populate(a, a->base, a->base + size) != 0;
+	spin_unlock(&vm.lock);
+
+	if (bad) {
+		vfree((void *) a->base);
+		return NULL;
+	}
+
+	return (void *) a->base;
+}
+
+/*
+ * Map `size` bytes of physical memory at `pa` into kernel virtual memory
+ * with `PTE_*` `flags` (e.g. `PTE_W` and a `PAT_*` memory type), 2 MiB pages
+ * where both addresses line up. Returns the address of `pa`, or NULL.
+ */
+void *
+vmap(uintptr_t pa, size_t size, uint64_t flags)
+{
+	struct vmarea *a;
+	uintptr_t va, off;
+	int bad;
+
+	if (size == 0)
+		return NULL;
+
+	off = pa & PAGE_MASK;
+	pa -= off;
+	size = (size + off + PAGE_MASK) & ~PAGE_MASK;
+	flags &= PTE_PROT;
+	if ((a = area_alloc(size, VM_PHYS, flags)) == NULL)
+		return NULL;
+
+	bad = 0;
+	for (va = a->base; va < a->base + size && !bad; ) {
+		if (((va | pa) & LPAGE_MASK) == 0
+		&& va + LPAGE_SIZE <= a->base + size
+		&& maplarge(va, pa, flags) == 0) {
+			va += LPAGE_SIZE;
+			pa += LPAGE_SIZE;
+			continue;
+		}
+		bad = map(va, pa, flags);
+		va += PAGE_SIZE;
+		pa += PAGE_SIZE;
+	}
+	spin_unlock(&vm.lock);
+
+	if (bad) {
+		vfree((void *) a->base);
+		return NULL;
+	}
+
+	return (void *) (a->base + off);
+}
+
+/*
+ * Change the protection of the pages of `ptr`..`ptr + size`, all in one
+ * area, to `PTE_*` `flags` (e.g. no `PTE_W` for read only). Whole 2 MiB pages
+ * in the range keep being one, others are split. Pages not populated yet
+ * are, so the change sticks. Returns 0, or -1 if the range is not in an area
+ * or memory ran out.
+ */
+int
+vmm_protect(void *ptr, size_t size, uint64_t flags)
+{
+	struct vmarea *a;
+	uintptr_t start, va, end, pa;
+	uint64_t *pde, *pte;
+	int r;
+
+	start = (uintptr_t) ptr & ~PAGE_MASK;
+	end = ((uintptr_t) ptr + size + PAGE_MASK) & ~PAGE_MASK;
+	flags &= PTE_PROT;
+	r = -1;
+
+	vmlock();
+	if ((a = areafind(start)) == NULL || end > a->base + a->size)
+		goto out;
+	if (start == a->base && end == a->base + a->size)
+		a->prot = flags;
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		if ((pde = walkpd(va, 1)) == NULL)
+			goto flush;
+		if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			if ((va & LPAGE_MASK) == 0 && va + LPAGE_SIZE <= end) {
+				*pde = (*pde & ~PTE_PROT) | flags;
+				va += LPAGE_SIZE - PAGE_SIZE;
+				continue;
+			}
+			if (split(va, pde) != 0)
+				goto flush;
+		}
+
+		if ((pte = walk(va, 1)) == NULL)
+			goto flush;
+		if (*pte & PTE_P) {
+			*pte = (*pte & ~PTE_PROT) | flags;
+		} else if ((a->flags & VM_PHYS) == 0) {
+			if ((pa = pmm_zalloc(0)) == 0)
+				goto flush;
+			*pte = pa | PTE_P | flags;
+			vm.mapped++;
+		}
+	}
+	r = 0;
+flush:
+	flush(start, (end - start) / PAGE_SIZE);
+out:
+	spin_unlock(&vm.lock);
+
+	return r;
+}
+
+/*
+ * Clear the present bit of every mapping of `a` (`mark`), or free what
+ * those mappings pointed to and clear them. Lock held.
+ */
+static void
+area_unmap(struct vmarea *a, int mark)
+{
+	uintptr_t va, end;
+	uint64_t *pde, *pte;
+
+	end = a->base + a->size;
+	for (va = a->base; va < end; va += PAGE_SIZE) {
+		if ((pde = walkpd(va, 0)) == NULL || *pde == 0) {
+			va |= LPAGE_MASK & ~PAGE_MASK;	/* Next table */
+			continue;
+		}
+
+		if (*pde & PTE_PS) {
+			if (mark) {
+				*pde &= ~PTE_P;
+			} else {
+				if ((a->flags & VM_PHYS) == 0)
+					pmm_free(*pde & PTE_ADDR, LPAGE_ORDER);
+				*pde = 0;
+				vm.mapped -= NPTE;
+				vm.huge--;
+			}
+			va += LPAGE_SIZE - PAGE_SIZE;
+			continue;
+		}
+
+		if ((pte = walk(va, 0)) == NULL || *pte == 0)
+			continue;
+		if (mark) {
+			*pte &= ~PTE_P;
+			continue;
+		}
+		if ((a->flags & VM_PHYS) == 0)
+			pmm_free(*pte & PTE_ADDR, 0);
+		*pte = 0;
+		vm.mapped--;
+	}
+}
+
+/*
+ * Free an area from `vmalloc()` and the pages behind it, or undo a `vmap()`.
+ * NULL is ignored.
+ */
+void
+vfree(void *ptr)
+{
+	struct vmarea *a, **ap;
+	uintptr_t va;
+
+	if (ptr == NULL)
+		return;
+
+	va = (uintptr_t) ptr & ~PAGE_MASK;
+	vmlock();
+	for (ap = &vm.areas; (a = *ap) != NULL; ap = &a->next) {
+		if (a->base == va)
+			break;
+	}
+	if (a == NULL) {
+		spin_unlock(&vm.lock);
+		kprintf("vfree: %lx was not allocated\n", ptr);
+		return;
+	}
+	*ap = a->next;
+	vm.nareas--;
+
+	/*
+	 * Unmap everything and flush once before the pages go back, no stale
+	 * TLB entry may point at a page someone else has been given.
+	 */
+	area_unmap(a, 1);
+	flush(a->base, a->size / PAGE_SIZE);
+	area_unmap(a, 0);
+
+	extent_free(a, a->base, a->size + PAGE_SIZE);
+	spin_unlock(&vm.lock);
+}
+
+void
+vmm_stats(void)
+{
+	kprintf("vmm: %lu areas, %lu KiB mapped, %lu 2 MiB pages, "
+			"%lu promoted, %lu split\n", vm.nareas,
+			vm.mapped * PAGE_SIZE / 1024, vm.huge, vm.promotions,
+			vm.splits);
+	kprintf("  %lu faults, %lu invlpg, %lu TLB flushes, %lu shootdowns\n",
+			vm.faults, vm.invlpgs, vm.flushes, vm.shootdowns);
+}
+
+/* Needs `kmem_init()` */
+void
+vmm_init(struct kargtab *kargtab)
+{
+	struct vmarea *f;
+
+	vm.pml4 = (uint64_t *) P2V(kargtab->pml4);
+	trap_register(T_TLB, tlbipi);
+	vm.cache = kmem_cache_create("vmarea", sizeof(struct vmarea), 0, NULL);
+	if (vm.cache == NULL || (f = kmem_cache_alloc(vm.cache)) == NULL
+	|| tablenext(&vm.pml4[PML4_INDEX(VM_BASE)], 1) == NULL) {
+		kprintf("vmm: cannot set up vmalloc space\n");
+		vm.cache = NULL;
+		return;
+	}
+
+	f->base = VM_BASE;
+	f->size = VM_END - VM_BASE;
+	f->next = NULL;
+	vm.free = f;
+
+	kprintf("vmm: %lu GiB of vmalloc space at %lx\n",
+			(VM_END - VM_BASE) >> 30, VM_BASE);
+}
@@ -0,0 +1,31 @@
+/*
+ * ALIX: `sys/vmm.h` -- Kernel virtual memory
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _VMM_H_
+#define _VMM_H_
+
+/* `vmalloc()` flags */
+#define VM_NOW		0x01		/* Populate now, not on first touch */
+#define VM_NOHUGE	0x02		/* 4 KiB pages only */
+#define VM_PHYS		0x04		/* Set by `vmap()` */
+
+void		vmm_init(struct kargtab *kargtab);
+int		vmm_map(uintptr_t va, uintptr_t pa, uint64_t flags);
+uintptr_t	vmm_unmap(uintptr_t va);
+uintptr_t	vmm_translate(uintptr_t va);
+int		vmm_protect(void *ptr, size_t size, uint64_t flags);
+void		vmm_flush(uintptr_t va, uint64_t npages);
+int		vmm_fault(uintptr_t va, uint64_t err);
+int		vmm_collapse(int max);
+void *		vmalloc(size_t size, int flags);
+void *		vmap(uintptr_t pa, size_t size, uint64_t flags);
+void		vfree(void *ptr);
+void		vmm_stats(void);
+
+#endif /* _VMM_H_ */
@@ -0,0 +1,41 @@
+/*
+ * ALIX: `sys/x64/cpu.h` -- x64 processor procedures
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_CPU_H_
+#define _X64_CPU_H_
+
+/* Model specific registers */
+#define MSR_APIC_BASE	0x1B
+#define MSR_PAT		0x277
+#define MSR_TSC_DEADLINE 0x6E0
+#define MSR_EFER	0xC0000080
+#define MSR_GS_BASE	0xC0000101
+#define MSR_KGS_BASE	0xC0000102	/* Swapped in by `swapgs` */
+
+#define EFER_LMA	(1 << 10)	/* Long mode active */
+
+#define RFLAGS_IF	(1 << 9)	/* Interrupts enabled */
+
+uint64_t	tscread(void);
+void		cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]);
+uint64_t	rdmsr(uint32_t msr);
+void		wrmsr(uint32_t msr, uint64_t val);
+uintptr_t	rcr2(void);
+uintptr_t	rcr3(void);
+void		lcr3(uintptr_t cr3);
+void		invlpg(uintptr_t va);
+void		pagezero(void *page);
+void		ltr(uint16_t sel);
+uint64_t	intr_save(void);
+void		intr_restore(uint64_t flags);
+void		halt(void);
+void		intr_poll(void);
+int		preempt_dec(void);
+
+#endif /* _X64_CPU_H_ */
@@ -8,35 +8,80 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
 #include <sys/x64/gdt.h>
+#include <sys/x64/cpu.h>
 
-/* Global Descriptor table */
-Segdesc GDT[6];
+/*
+ * Every processor has its own table, only because each needs its own TSS
+ * descriptor: a TSS is marked busy when loaded and cannot be shared.
+ */
+
+/* Global Descriptor tables */
+static Segdesc	GDT[NCPU][GDT_NENTRY];
+static Tss	TSS[NCPU];
+
+/* Bootstrap processor's interrupt stacks, it runs before there is a `pmm` */
+static uint8_t	bspist[NIST][ISTACK_SIZE] __attribute__((aligned(16)));
 
 /*
- * Initialize the Global Descriptor Table
+ * Initialize and load the Global Descriptor Table and TSS of processor `cpu`,
+ * and point its GS base at its `struct cpu`. `ist` are the tops of its
+ * interrupt stacks, NULL on the bootstrap processor.
  */
 void
-gdt_init(void)
+gdt_init(uint32_t cpu, uintptr_t ist[NIST])
 {
+	Segdesc *gdt;
+	Tss *tss;
+	uintptr_t base;
+	int i;
+
+	gdt = GDT[cpu];
+	tss = &TSS[cpu];
+
 	/* Null descriptor. */
-	GDT[0] = 0;
+	gdt[0] = 0;
 
 	/* Kernel code segment. */
-	GDT[1] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(0)
-		| SEGDESC_PRES(1) | SEGDESC_LONG(1);
+	gdt[1] = SEGDESC_TYPE(1) | SEGDESC_EXEC(1) | SEGDESC_RW(1)
+		| SEGDESC_DPL(0) | SEGDESC_PRES(1) | SEGDESC_LONG(1);
 	/* Kernel data segment. */
-	GDT[2] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(0)
-		| SEGDESC_PRES(1) | SEGDESC_LONG(1);
+	gdt[2] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(0)
+		| SEGDESC_PRES(1);
 
 	/* User code segment. */
-	GDT[3] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(3)
-		| SEGDESC_PRES(1) | SEGDESC_LONG(1);
+	gdt[3] = SEGDESC_TYPE(1) | SEGDESC_EXEC(1) | SEGDESC_RW(1)
+		| SEGDESC_DPL(3) | SEGDESC_PRES(1) | SEGDESC_LONG(1);
 	/* User data segment. */
-	GDT[4] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(3)
-		| SEGDESC_PRES(1) | SEGDESC_LONG(1);
+	gdt[4] = SEGDESC_TYPE(1) | SEGDESC_RW(1) | SEGDESC_DPL(3)
+		| SEGDESC_PRES(1);
 
-	return;	
-}
+	/* Task state segment, a 16 byte descriptor. */
+	for (i = 1; i <= NIST; i++)
+		tss->ist[i] = ist != NULL ? ist[i - 1]
+				: (uintptr_t) bspist[i - 1] + ISTACK_SIZE;
+	tss->iomap = sizeof(Tss);	/* None */
+	base = (uintptr_t) tss;
+	gdt[5] = (sizeof(Tss) - 1) | ((base & 0xFFFFFF) << 16)
+		| SEGDESC_TSS | SEGDESC_PRES(1)
+		| ((Segdesc) (base >> 24) & 0xFF) << 56;
+	gdt[6] = base >> 32;
 
+	/*
+	 * Switch off the firmware's table, it lives in boot services memory
+	 * which the kernel reclaims.
+	 */
+	gdtload(gdt, sizeof(GDT[0]) - 1, SEL_KCODE, SEL_KDATA);
+	ltr(SEL_TSS);
+
+	/* Loading GS cleared its base */
+	cpus[cpu].self = &cpus[cpu];
+	wrmsr(MSR_GS_BASE, (uintptr_t) &cpus[cpu]);
+	wrmsr(MSR_KGS_BASE, 0);
+}
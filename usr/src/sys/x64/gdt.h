@@ -20,6 +20,8 @@ typedef uint64_t Segdesc;
 
 /* 0=system, 1=code/data */
 #define SEGDESC_TYPE(x) (((Segdesc) x << 12) << 32)
+/* 1=code (executable), 0=data */
+#define SEGDESC_EXEC(x)	(((Segdesc) x << 11) << 32)
 /* data: 1=write enable, code: 1=read enable */
 #define SEGDESC_RW(x)	(((Segdesc) x << 9) << 32)
 /* Privilege level */
@@ -29,7 +31,38 @@ typedef uint64_t Segdesc;
 /* Long mode? 1=yes */
 #define SEGDESC_LONG(x) (((Segdesc) x << 21) << 32)
 
-void	gdt_init(void);
+/* System segment types */
+#define SEGDESC_TSS	(((Segdesc) 0x9 << 8) << 32)	/* 64 bit TSS */
+
+/* Selectors */
+#define SEL_KCODE	0x08
+#define SEL_KDATA	0x10
+#define SEL_UCODE	(0x18 | 3)
+#define SEL_UDATA	(0x20 | 3)
+#define SEL_TSS		0x28		/* Two entries */
+
+#define GDT_NENTRY	7
+
+/* Interrupt stacks, indices into `ist` of the TSS */
+#define IST_DF		1		/* Double fault */
+#define IST_NMI		2
+#define NIST		2
+#define ISTACK_SIZE	4096
+
+/* Task State Segment, only for its stack pointers in long mode */
+typedef struct Tss {
+
+	uint32_t	reserved1;
+	uint64_t	rsp[3];		/* Stack on entry from privilege 0-2 */
+	uint64_t	reserved2;
+	uint64_t	ist[8];		/* `ist[0]` unused, 1-7 are IST1-7 */
+	uint16_t	reserved3;
+	uint16_t	iomap;		/* I/O permission bitmap offset */
+
+} __attribute__((packed)) Tss;
+
+void	gdt_init(uint32_t cpu, uintptr_t ist[NIST]);
+void	gdtload(Segdesc *gdt, uint16_t limit, uint16_t code, uint16_t data);
 
 #endif /* _X64_GDT_H_ */
 
@@ -0,0 +1,207 @@
+/*
+ * ALIX: `sys/x64/idt.c` -- x64 Interrupt Descriptor Table and trap dispatch
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/vmm.h>
+#include <sys/sched.h>
+#include <sys/x64/gdt.h>
+#include <sys/x64/idt.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/cpu.h>
+#include <sys/dev/console.h>
+
+/*
+ * Every vector enters through a stub in `trap.S` that builds a `struct
+ * trapframe` and calls `trap()`, which counts it and hands it to the handler
+ * registered for it. Exceptions without a handler are fatal, interrupts
+ * without one are only counted.
+ */
+
+/* Entry points, `trap.S` */
+extern void	(*trapstubs[NVECTOR])(void);
+
+/* Interrupt Descriptor Table */
+Gatedesc IDT[NVECTOR];
+
+static Traphandler	handlers[NVECTOR];
+
+static const char *excnames[T_IRQ] = {
+	[T_DE] = "divide error",
+	[T_DB] = "debug",
+	[T_NMI] = "NMI",
+	[T_BP] = "breakpoint",
+	[T_OF] = "overflow",
+	[T_BR] = "bound range exceeded",
+	[T_UD] = "invalid opcode",
+	[T_NM] = "device not available",
+	[T_DF] = "double fault",
+	[T_TS] = "invalid TSS",
+	[T_NP] = "segment not present",
+	[T_SS] = "stack fault",
+	[T_GP] = "general protection",
+	[T_PF] = "page fault",
+	[T_MF] = "x87 floating point error",
+	[T_AC] = "alignment check",
+	[T_MC] = "machine check",
+	[T_XM] = "SIMD floating point exception",
+	[T_VE] = "virtualization exception",
+	[T_CP] = "control protection",
+};
+
+/* Point vector `vec` at `entry`, on interrupt stack `ist` if not 0 */
+void
+idt_set(int vec, void (*entry)(void), int ist)
+{
+	uintptr_t a;
+
+	a = (uintptr_t) entry;
+	IDT[vec].offset_lo = a & 0xFFFF;
+	IDT[vec].selector = SEL_KCODE;
+	IDT[vec].ist = ist;
+	IDT[vec].attr = GATE_INTR;
+	IDT[vec].offset_mid = (a >> 16) & 0xFFFF;
+	IDT[vec].offset_hi = a >> 32;
+	IDT[vec].reserved = 0;
+}
+
+/* Print the frame of an exception nothing handled and stop */
+static void
+fatal(struct trapframe *tf)
+{
+	const char *name;
+
+	name = excnames[tf->vec];
+	kprintf("trap %lu (%s), error %lx at rip %lx\n", tf->vec,
+			name != NULL ? name : "reserved", tf->err, tf->rip);
+	kprintf("  rax %lx rbx %lx rcx %lx rdx %lx\n",
+			tf->rax, tf->rbx, tf->rcx, tf->rdx);
+	kprintf("  rsi %lx rdi %lx rbp %lx rsp %lx\n",
+			tf->rsi, tf->rdi, tf->rbp, tf->rsp);
+	kprintf("  r8 %lx r9 %lx r10 %lx r11 %lx\n",
+			tf->r8, tf->r9, tf->r10, tf->r11);
+	kprintf("  r12 %lx r13 %lx r14 %lx r15 %lx\n",
+			tf->r12, tf->r13, tf->r14, tf->r15);
+	kprintf("  cs %lx ss %lx rflags %lx cr2 %lx cr3 %lx\n",
+			tf->cs, tf->ss, tf->rflags, rcr2(), rcr3());
+	for (;;)
+		__builtin_ia32_pause();
+}
+
+/* Page faults, anything `vmm_fault()` does not resolve is fatal */
+static void
+pagefault(struct trapframe *tf)
+{
+	uintptr_t va;
+
+	va = rcr2();
+	if (vmm_fault(va, tf->err) == 0)
+		return;
+
+	kprintf("page fault: %s %s %lx\n",
+			(tf->err & PF_P) ? "protection" : "not present",
+			(tf->err & PF_I) ? "fetch" :
+			(tf->err & PF_W) ? "write" : "read", va);
+	fatal(tf);
+}
+
+/* Common entry from the stubs in `trap.S` */
+void
+trap(struct trapframe *tf)
+{
+	Traphandler h;
+
+	cpu_self()->ntrap[tf->vec]++;
+
+	if ((h = handlers[tf->vec]) != NULL)
+		h(tf);
+	else if (tf->vec < T_IRQ)
+		fatal(tf);
+
+	/* An interrupt may have made another thread due */
+	if (tf->vec >= T_IRQ)
+		sched_intr();
+}
+
+/*
+ * Make `handler` the one for vector `vec`, NULL to remove it. Returns the
+ * previous handler.
+ */
+Traphandler
+trap_register(int vec, Traphandler handler)
+{
+	return __atomic_exchange_n(&handlers[vec], handler, __ATOMIC_ACQ_REL);
+}
+
+/* Times vector `vec` was taken, on all processors */
+uint64_t
+trap_count(int vec)
+{
+	uint64_t n;
+	uint32_t i;
+
+	n = 0;
+	for (i = 0; i < ncpu; i++)
+		n += __atomic_load_n(&cpus[i].ntrap[vec], __ATOMIC_RELAXED);
+
+	return n;
+}
+
+/* Print the count of every vector that was taken */
+void
+trap_stats(void)
+{
+	const char *name;
+	uint64_t n;
+	int v;
+
+	kprintf("Traps:\n");
+	for (v = 0; v < NVECTOR; v++) {
+		if ((n = trap_count(v)) == 0)
+			continue;
+		name = v < T_IRQ ? excnames[v] : NULL;
+		if (name != NULL)
+			kprintf("  %d (%s): %lu\n", v, name, n);
+		else
+			kprintf("  %d: %lu\n", v, n);
+	}
+}
+
+/*
+ * Initialize the Interrupt Descriptor Table with every vector. The
+ * firmware's lives in boot services memory, which the kernel reclaims.
+ */
+void
+idt_init(void)
+{
+	int v;
+
+	for (v = 0; v < NVECTOR; v++)
+		idt_set(v, trapstubs[v], 0);
+
+	/* Known good stacks, these can hit at any point */
+	idt_set(T_DF, trapstubs[T_DF], IST_DF);
+	idt_set(T_NMI, trapstubs[T_NMI], IST_NMI);
+
+	trap_register(T_PF, pagefault);
+
+	idt_load();
+}
+
+/* Load the table on the calling processor, all of them share it */
+void
+idt_load(void)
+{
+	lidt(IDT, sizeof(IDT) - 1);
+}
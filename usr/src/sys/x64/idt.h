@@ -0,0 +1,34 @@
+/*
+ * ALIX: `sys/x64/idt.h` -- x64 Interrupt Descriptor Table
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_IDT_H_
+#define _X64_IDT_H_
+
+/* A gate descriptor is 16 bytes */
+typedef struct Gatedesc {
+
+	uint16_t	offset_lo;	/* Entry point, bits 15:0 */
+	uint16_t	selector;	/* Code segment */
+	uint8_t		ist;		/* Interrupt stack table index */
+	uint8_t		attr;		/* `GATE_*` */
+	uint16_t	offset_mid;	/* 	-bits 31:16 */
+	uint32_t	offset_hi;	/* 	-bits 63:32 */
+	uint32_t	reserved;
+
+} Gatedesc;
+
+/* Present, DPL 0, 64 bit interrupt gate (interrupts off on entry) */
+#define GATE_INTR	0x8E
+
+void	idt_init(void);
+void	idt_load(void);
+void	idt_set(int vec, void (*entry)(void), int ist);
+void	lidt(Gatedesc *idt, uint16_t limit);
+
+#endif /* _X64_IDT_H_ */
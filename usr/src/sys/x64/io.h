@@ -10,7 +10,8 @@
 #ifndef _X64_IO_H_
 #define _X64_IO_H_
 
-void	outb(uint16_t port, uint8_t byte);
+void		outb(uint16_t port, uint8_t byte);
+uint32_t	inl(uint16_t port);
 
 #endif /* _X64_IO_H_ */
 
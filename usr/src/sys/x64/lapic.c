@@ -0,0 +1,224 @@
+/*
+ * ALIX: `sys/x64/lapic.c` -- x64 local APIC
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/vmm.h>
+#include <sys/x64/page.h>
+#include <sys/x64/pat.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/trap.h>
+#include <sys/x64/lapic.h>
+#include <sys/dev/console.h>
+
+/*
+ * Every processor's local APIC answers at the same address, so one mapping
+ * serves all of them. Where the processor has x2APIC mode it is used
+ * instead: registers are MSRs, IDs are 32 bits and an IPI is a single write
+ * with no delivery status to wait on.
+ */
+
+#define APIC_BASE_X2	(1 << 10)	/* `MSR_APIC_BASE`, x2APIC mode */
+#define APIC_BASE_EN	(1 << 11)	/* 	-global enable */
+
+#define X2APIC_MSR(reg)	(0x800 + ((reg) >> 4))
+
+int			x2apic;
+int			tscdeadline;
+static volatile uint32_t *lapic;	/* xAPIC registers */
+
+/* Timer ticks per TSC cycle, 32.32 fixed point, in one-shot mode */
+static uint64_t		tickspercyc;
+
+uint32_t
+lapic_read(uint32_t reg)
+{
+	if (x2apic)
+		return rdmsr(X2APIC_MSR(reg));
+
+	return lapic[reg / 4];
+}
+
+void
+lapic_write(uint32_t reg, uint32_t val)
+{
+	if (x2apic)
+		wrmsr(X2APIC_MSR(reg), val);
+	else
+		lapic[reg / 4] = val;
+}
+
+/*
+ * Pick the mode and map the registers at physical address `pa` (from the
+ * MADT) uncached. Returns 0, -1 if they could not be mapped.
+ */
+int
+lapic_init(uintptr_t pa)
+{
+	uint32_t regs[4];
+
+	/* CPUID.01H:ECX[21] */
+	cpuid(1, 0, regs);
+	x2apic = (regs[2] >> 21) & 1;
+	if (x2apic)
+		return 0;
+
+	lapic = vmap(pa, PAGE_SIZE, PTE_W | PAT_UC);
+
+	return lapic != NULL ? 0 : -1;
+}
+
+/* Enable the calling processor's local APIC, in the mode `lapic_init()` chose */
+void
+lapic_enable(void)
+{
+	uint64_t base;
+
+	base = rdmsr(MSR_APIC_BASE) | APIC_BASE_EN;
+	if (x2apic)
+		base |= APIC_BASE_X2;
+	wrmsr(MSR_APIC_BASE, base);
+
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, SVR_ENABLE | T_SPURIOUS);
+}
+
+/* Local APIC id of the calling processor */
+uint32_t
+lapic_id(void)
+{
+	if (x2apic)
+		return lapic_read(LAPIC_ID);
+
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+void
+lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+/*
+ * Send an interrupt command `icr` (`ICR_*` and a vector) to the processor
+ * with id `apicid`, or to a shorthand's destination.
+ */
+void
+lapic_ipi(uint32_t apicid, uint32_t icr)
+{
+	uint64_t flags;
+
+	if (x2apic) {
+		wrmsr(X2APIC_MSR(LAPIC_ICRLO), (uint64_t) apicid << 32 | icr);
+		return;
+	}
+
+	/* An IPI sent from a handler in between would retarget this one */
+	flags = intr_save();
+	lapic_write(LAPIC_ICRHI, apicid << 24);
+	lapic_write(LAPIC_ICRLO, icr);
+	while (lapic_read(LAPIC_ICRLO) & ICR_PENDING)
+		__builtin_ia32_pause();
+	intr_restore(flags);
+}
+
+/*
+ * The timer fires once, at a TSC deadline. Where the processor has
+ * TSC-deadline mode the deadline is written as is, otherwise it is turned
+ * into a count for one-shot mode at the rate measured here against the TSC.
+ * Either way nothing fires unless armed. Returns 0, -1 if there is no way
+ * to tell time.
+ */
+int
+lapic_timer_init(uint64_t tsc_khz)
+{
+	uint32_t regs[4];
+	uint64_t start, n;
+
+	if (tsc_khz == 0 || (!x2apic && lapic == NULL))
+		return -1;
+
+	/* CPUID.01H:ECX[24] */
+	cpuid(1, 0, regs);
+	tscdeadline = (regs[2] >> 24) & 1;
+	if (tscdeadline)
+		return 0;
+
+	/* Count down from the top for 10 ms */
+	lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LVT_ONESHOT | T_TIMER);
+	lapic_write(LAPIC_TDCR, TDCR_DIV1);
+	lapic_write(LAPIC_TICR, 0xFFFFFFFF);
+	start = tscread();
+	while (tscread() - start < tsc_khz * 10)
+		__builtin_ia32_pause();
+	n = 0xFFFFFFFF - lapic_read(LAPIC_TCCR);
+	lapic_write(LAPIC_TICR, 0);
+
+	if (n == 0)
+		return -1;
+	tickspercyc = (n << 32) / (tsc_khz * 10);
+
+	return 0;
+}
+
+/* Set up the calling processor's timer, disarmed */
+void
+lapic_timer_enable(void)
+{
+	if (tscdeadline) {
+		lapic_write(LAPIC_LVT_TIMER, LVT_DEADLINE | T_TIMER);
+		wrmsr(MSR_TSC_DEADLINE, 0);
+		return;
+	}
+
+	lapic_write(LAPIC_TDCR, TDCR_DIV1);
+	lapic_write(LAPIC_LVT_TIMER, LVT_ONESHOT | T_TIMER);
+	lapic_write(LAPIC_TICR, 0);
+}
+
+/*
+ * Fire once at TSC `deadline`, right away if it has passed. One-shot counts
+ * too long for the register fire early.
+ */
+void
+lapic_timer_arm(uint64_t deadline)
+{
+	uint64_t now, delta, ticks;
+
+	if (tscdeadline) {
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+
+	now = tscread();
+	ticks = 1;
+	if (deadline > now) {
+		delta = deadline - now;
+		if (delta > UINT64_MAX / tickspercyc)
+			ticks = 0xFFFFFFFF;
+		else
+			ticks = (delta * tickspercyc) >> 32;
+		if (ticks > 0xFFFFFFFF)
+			ticks = 0xFFFFFFFF;
+		if (ticks == 0)
+			ticks = 1;
+	}
+	lapic_write(LAPIC_TICR, ticks);
+}
+
+void
+lapic_timer_stop(void)
+{
+	if (tscdeadline)
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	else
+		lapic_write(LAPIC_TICR, 0);
+}
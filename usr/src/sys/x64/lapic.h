@@ -0,0 +1,66 @@
+/*
+ * ALIX: `sys/x64/lapic.h` -- x64 local APIC
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_LAPIC_H_
+#define _X64_LAPIC_H_
+
+/* Registers, as offsets into the xAPIC page */
+#define LAPIC_ID	0x020
+#define LAPIC_VER	0x030
+#define LAPIC_TPR	0x080		/* Task priority */
+#define LAPIC_EOI	0x0B0
+#define LAPIC_SVR	0x0F0		/* Spurious interrupt vector */
+#define LAPIC_ESR	0x280		/* Error status */
+#define LAPIC_ICRLO	0x300		/* Interrupt command */
+#define LAPIC_ICRHI	0x310
+#define LAPIC_LVT_TIMER	0x320
+#define LAPIC_LVT_LINT0	0x350
+#define LAPIC_LVT_LINT1	0x360
+#define LAPIC_LVT_ERROR	0x370
+#define LAPIC_TICR	0x380		/* Timer initial count */
+#define LAPIC_TCCR	0x390		/* 	-current count */
+#define LAPIC_TDCR	0x3E0		/* 	-divide configuration */
+
+#define SVR_ENABLE	(1 << 8)
+
+/* Local vector table */
+#define LVT_MASKED	(1 << 16)
+#define LVT_ONESHOT	(0 << 17)	/* Timer modes */
+#define LVT_PERIODIC	(1 << 17)
+#define LVT_DEADLINE	(2 << 17)	/* 	-TSC-deadline */
+
+#define TDCR_DIV1	0xB
+
+/* Interrupt command */
+#define ICR_FIXED	(0 << 8)
+#define ICR_INIT	(5 << 8)
+#define ICR_STARTUP	(6 << 8)	/* Vector is the page to start at */
+#define ICR_PENDING	(1 << 12)	/* Delivery status, xAPIC only */
+#define ICR_ASSERT	(1 << 14)
+#define ICR_LEVEL	(1 << 15)
+#define ICR_SELF	(1 << 18)	/* Destination shorthands */
+#define ICR_ALL		(2 << 18)
+#define ICR_OTHERS	(3 << 18)
+
+extern int	x2apic;		/* In x2APIC mode */
+extern int	tscdeadline;	/* Timer in TSC-deadline mode */
+
+int		lapic_init(uintptr_t pa);
+void		lapic_enable(void);
+uint32_t	lapic_read(uint32_t reg);
+void		lapic_write(uint32_t reg, uint32_t val);
+uint32_t	lapic_id(void);
+void		lapic_eoi(void);
+void		lapic_ipi(uint32_t apicid, uint32_t icr);
+int		lapic_timer_init(uint64_t tsc_khz);
+void		lapic_timer_enable(void);
+void		lapic_timer_arm(uint64_t deadline);
+void		lapic_timer_stop(void);
+
+#endif /* _X64_LAPIC_H_ */
@@ -0,0 +1,305 @@
+/*
+ * ALIX: `sys/x64/mp.c` -- x64 application processor startup
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/kargtab.h>
+#include <sys/acpi.h>
+#include <sys/numa.h>
+#include <sys/pmm.h>
+#include <sys/cpu.h>
+#include <sys/string.h>
+#include <sys/timer.h>
+#include <sys/sched.h>
+#include <sys/x64/page.h>
+#include <sys/x64/cpu.h>
+#include <sys/x64/io.h>
+#include <sys/x64/gdt.h>
+#include <sys/x64/idt.h>
+#include <sys/x64/pat.h>
+#include <sys/x64/lapic.h>
+#include <sys/x64/mp.h>
+#include <sys/dev/console.h>
+#include <sys/bench/bench.h>
+
+/*
+ * Application processors are listed in the MADT and started one at a time
+ * with INIT-SIPI-SIPI. Each begins in real mode in the trampoline of
+ * `mpentry.S`, copied to the page below 1 MiB the bootloader set aside, and
+ * arrives in `mp_apmain()` in long mode on a stack allocated here from its
+ * own node. The next one is only started once it has, as they all share
+ * the trampoline.
+ */
+
+/*
+ * Stacks of a processor, in one block: the interrupt stacks at the bottom
+ * `ISTACK_SIZE` each, the kernel stack the rest.
+ */
+#define STACK_ORDER	3		/* 32 KiB */
+
+/* 8259 interrupt mask registers */
+#define PIC1_DATA	0x21
+#define PIC2_DATA	0xA1
+
+/* Trampoline, `mpentry.S` */
+extern uint8_t	mptramp[], mptramp_end[], mpdata[];
+
+/* Handed to the trampoline, laid out like `mpdata` */
+struct mpdata {
+
+	uint32_t	cr3;		/* Kernel PML4, below 4 GiB */
+	uint32_t	efer;
+	uint64_t	stack;		/* Top of the kernel stack */
+	uint64_t	cpu;		/* `struct cpu *`, argument to */
+	uint64_t	entry;		/* 	-this */
+
+};
+
+static uint32_t		apicids[NCPU];	/* From the MADT, BSP excluded */
+static uint32_t		napicid;
+static uint32_t		nskipped;	/* Beyond `NCPU` */
+static int		nolapic;
+static uintptr_t	istacks[NCPU][NIST];
+
+static volatile uint32_t started;	/* Id of the last processor up */
+static uint32_t		claim;		/* Set by the processor being started
+					   on arrival, or by `start()` giving
+					   up on it, whichever is first */
+
+/* Wait `us` microseconds, assuming 4 GHz if the TSC rate is unknown */
+static void
+udelay(struct kargtab *kargtab, uint64_t us)
+{
+	uint64_t end;
+
+	end = tscread() + us * (kargtab->tsc_khz ? kargtab->tsc_khz
+			: 4000000) / 1000;
+	while (tscread() < end)
+		__builtin_ia32_pause();
+}
+
+static void
+addcpu(uint32_t apicid)
+{
+	uint32_t i;
+
+	if (apicid == cpus[0].apicid)
+		return;
+	for (i = 0; i < napicid; i++) {
+		if (apicids[i] == apicid)
+			return;
+	}
+
+	if (napicid == NCPU - 1) {
+		nskipped++;
+		return;
+	}
+	apicids[napicid++] = apicid;
+}
+
+/* Collect processors, returns the local APIC's physical address */
+static uintptr_t
+madt_parse(Acpi_madt *madt)
+{
+	Acpi_madt_entry *e;
+	Acpi_madt_lapic *l;
+	Acpi_madt_x2apic *x;
+	uintptr_t pa;
+	uint8_t *p, *end;
+
+	pa = madt->lapic;
+	p = (uint8_t *) (madt + 1);
+	end = (uint8_t *) madt + madt->hdr.length;
+	for (; p + sizeof(Acpi_madt_entry) <= end; p += e->length) {
+		e = (Acpi_madt_entry *) p;
+		if (e->length < sizeof(Acpi_madt_entry) || p + e->length > end)
+			break;
+
+		switch (e->type) {
+		case MADT_LAPIC:
+			l = (Acpi_madt_lapic *) e;
+			if (l->flags & MADT_ENABLED)
+				addcpu(l->apicid);
+			break;
+		case MADT_LAPIC_ADDR:
+			pa = ((Acpi_madt_lapic_addr *) e)->addr;
+			break;
+		case MADT_X2APIC:
+			x = (Acpi_madt_x2apic *) e;
+			if (x->flags & MADT_ENABLED)
+				addcpu(x->x2apicid);
+			break;
+		}
+	}
+
+	return pa;
+}
+
+/* First code of an application processor in C, `cpu` is its area */
+void
+mp_apmain(struct cpu *cpu)
+{
+	uint32_t none;
+
+	/* Too late, its id may go to the next one: stay down */
+	none = 0;
+	if (!__atomic_compare_exchange_n(&claim, &none, 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		for (;;)
+			__builtin_ia32_pause();
+	}
+
+	gdt_init(cpu->id, istacks[cpu->id]);
+	idt_load();
+	pat_init();
+	lapic_enable();
+	timer_cpu_init();
+	sched_cpu_init();
+
+	__atomic_store_n(&started, cpu->id, __ATOMIC_RELEASE);
+
+#ifdef BENCH
+	bench_pmm_ap();
+#endif
+	cpu_idle();
+}
+
+/* Start processor `id`, returns 0 once it runs, -1 if it never did */
+static int
+start(struct kargtab *kargtab, uint32_t id)
+{
+	struct mpdata *d;
+	struct cpu *cpu;
+	uintptr_t stack;
+	uint64_t end;
+	uint32_t none;
+	int i;
+
+	cpu = &cpus[id];
+	cpu->node = numa_cpunode(cpu->apicid);
+
+	if ((stack = pmm_alloc_node(cpu->node, STACK_ORDER)) == 0)
+		return -1;
+	stack = P2V(stack);
+	for (i = 0; i < NIST; i++)
+		istacks[id][i] = stack + (i + 1) * ISTACK_SIZE;
+
+	d = (struct mpdata *) P2V(kargtab->trampoline + (mpdata - mptramp));
+	d->cr3 = kargtab->pml4;
+	d->efer = rdmsr(MSR_EFER) & ~EFER_LMA;
+	d->stack = stack + (PAGE_SIZE << STACK_ORDER);
+	d->cpu = (uintptr_t) cpu;
+	d->entry = (uintptr_t) mp_apmain;
+	__atomic_store_n(&claim, 0, __ATOMIC_RELEASE);
+
+	lapic_ipi(cpu->apicid, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+	udelay(kargtab, 10000);
+	for (i = 0; i < 2; i++) {
+		lapic_ipi(cpu->apicid, ICR_STARTUP
+				| (kargtab->trampoline / PAGE_SIZE));
+		udelay(kargtab, 200);
+	}
+
+	end = tscread() + 100 * (kargtab->tsc_khz ? kargtab->tsc_khz
+			: 4000000);
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) != id) {
+		__builtin_ia32_pause();
+		if (tscread() <= end)
+			continue;
+
+		/* Arrived just now, it is on its way up */
+		none = 0;
+		if (!__atomic_compare_exchange_n(&claim, &none, 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+
+		/*
+		 * Given up on: it stops in `mp_apmain()` if it ever gets
+		 * there, and INIT holds it until the next startup IPI, which
+		 * never comes. Its id goes to the next processor.
+		 */
+		lapic_ipi(cpu->apicid, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+		udelay(kargtab, 10000);
+		pmm_free(V2P(stack), STACK_ORDER);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the application processors and enable the bootstrap processor's
+ * local APIC, needs `cpu_init()` and `vmm_init()`. Returns 0, -1 if there
+ * is no usable local APIC.
+ */
+int
+mp_init(struct kargtab *kargtab)
+{
+	Acpi_madt *madt;
+	uintptr_t pa;
+
+	if ((madt = (Acpi_madt *) acpi_find("APIC")) == NULL) {
+		kprintf("mp: no MADT, 1 processor\n");
+		nolapic = 1;
+		return -1;
+	}
+	pa = madt_parse(madt);
+	if (lapic_init(pa) != 0) {
+		kprintf("mp: cannot map the local APIC at %lx\n", pa);
+		nolapic = 1;
+		return -1;
+	}
+
+	/* Mask the 8259s, everything goes through the local APIC */
+	if (madt->flags & MADT_PCAT_COMPAT) {
+		outb(PIC1_DATA, 0xFF);
+		outb(PIC2_DATA, 0xFF);
+	}
+	lapic_enable();
+
+	return 0;
+}
+
+/* Start the application processors `mp_init()` found */
+void
+mp_start(struct kargtab *kargtab)
+{
+	uint32_t i, id;
+
+	if (nolapic)
+		return;
+	if (napicid == 0) {
+		kprintf("mp: 1 processor (%s)\n", x2apic ? "x2APIC" : "xAPIC");
+		return;
+	}
+	if (kargtab->trampoline == 0 || kargtab->pml4 > 0xFFFFFFFF) {
+		kprintf("mp: no trampoline, 1 of %u processors\n",
+				napicid + 1);
+		return;
+	}
+	memcpy((void *) P2V(kargtab->trampoline), mptramp,
+			mptramp_end - mptramp);
+
+	id = 1;
+	for (i = 0; i < napicid; i++) {
+		cpus[id].apicid = apicids[i];
+		if (start(kargtab, id) != 0) {
+			kprintf("mp: APIC id %u did not start\n", apicids[i]);
+			continue;
+		}
+		__atomic_store_n(&ncpu, ++id, __ATOMIC_RELEASE);
+	}
+
+	kprintf("mp: %u of %u processors running (%s)", ncpu,
+			napicid + nskipped + 1, x2apic ? "x2APIC" : "xAPIC");
+	if (nskipped != 0)
+		kprintf(", NCPU is %u", NCPU);
+	kprintf("\n");
+}
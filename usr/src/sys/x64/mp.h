@@ -0,0 +1,16 @@
+/*
+ * ALIX: `sys/x64/mp.h` -- x64 application processor startup
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_MP_H_
+#define _X64_MP_H_
+
+int	mp_init(struct kargtab *kargtab);
+void	mp_start(struct kargtab *kargtab);
+
+#endif /* _X64_MP_H_ */
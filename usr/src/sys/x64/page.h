@@ -0,0 +1,65 @@
+/*
+ * ALIX: `sys/x64/page.h` -- x64 paging definitions
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_PAGE_H_
+#define _X64_PAGE_H_
+
+/*
+ * Shared between the bootloader (which builds the kernel's first mappings)
+ * and the kernel itself.
+ */
+
+/* Page sizes */
+#define PAGE_SIZE	0x1000ULL	/* 4 KiB, page table entry */
+#define LPAGE_SIZE	0x200000ULL	/* 2 MiB, page directory entry (PS) */
+#define HPAGE_SIZE	0x40000000ULL	/* 1 GiB, PDPT entry (PS) */
+
+#define PAGE_MASK	(PAGE_SIZE - 1)
+#define LPAGE_MASK	(LPAGE_SIZE - 1)
+#define HPAGE_MASK	(HPAGE_SIZE - 1)
+
+/* Table indices of a virtual address at each level of the hierarchy */
+#define PML4_INDEX(va)	(((va) >> 39) & 0x1FF)
+#define PDPT_INDEX(va)	(((va) >> 30) & 0x1FF)
+#define PD_INDEX(va)	(((va) >> 21) & 0x1FF)
+#define PT_INDEX(va)	(((va) >> 12) & 0x1FF)
+
+/* Page table entry flags */
+#define PTE_P		(1ULL << 0)	/* present */
+#define PTE_W		(1ULL << 1)	/* writable */
+#define PTE_U		(1ULL << 2)	/* user accessible */
+#define PTE_PWT		(1ULL << 3)	/* write-through */
+#define PTE_PCD		(1ULL << 4)	/* cache disable */
+#define PTE_A		(1ULL << 5)	/* accessed */
+#define PTE_D		(1ULL << 6)	/* dirty */
+#define PTE_PS		(1ULL << 7)	/* large page (PD/PDPT entries) */
+#define PTE_G		(1ULL << 8)	/* global */
+#define PTE_NX		(1ULL << 63)	/* no execute */
+
+/* Physical address bits of an entry */
+#define PTE_ADDR	0x000FFFFFFFFFF000ULL
+
+/*
+ * Kernel address space layout
+ * DMAP_BASE:	direct map of all physical memory (PML4 slots 256..)
+ * VM_BASE:	`vmalloc()` space, up to VM_END (PML4 slot 508)
+ * FB_BASE:	framebuffer, write-combining (PML4 slot 510)
+ * KERN_BASE:	kernel image, see `link.ld` (PML4 slot 511)
+ */
+#define DMAP_BASE	0xFFFF800000000000ULL
+#define VM_BASE		0xFFFFFE0000000000ULL
+#define VM_END		0xFFFFFE8000000000ULL
+#define FB_BASE		0xFFFFFF0000000000ULL
+#define KERN_BASE	0xFFFFFFFF80000000ULL
+
+/* Convert between physical addresses and their direct map addresses */
+#define P2V(pa)		((uintptr_t) (pa) + DMAP_BASE)
+#define V2P(va)		((uintptr_t) (va) - DMAP_BASE)
+
+#endif /* _X64_PAGE_H_ */
@@ -0,0 +1,44 @@
+/*
+ * ALIX: `sys/x64/pat.c` -- x64 Page Attribute Table
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdint.h>
+
+#include <sys/x64/cpu.h>
+#include <sys/x64/page.h>
+#include <sys/x64/pat.h>
+
+/* Memory types as encoded in the PAT MSR */
+#define MT_UC		0x00
+#define MT_WC		0x01
+#define MT_WT		0x04
+#define MT_WP		0x05
+#define MT_WB		0x06
+#define MT_UCM		0x07
+
+#define PAT_ENTRY(i, type)	((uint64_t) (type) << ((i) * 8))
+
+/*
+ * Program the PAT. Only entry 1 changes from its power-on write-through to
+ * write-combining, used for the framebuffer window the bootloader maps with
+ * PWT alone. Nothing maps through entry 1 before this runs, so no cache
+ * flush is needed, only stale TLB entries are dropped.
+ */
+void
+pat_init(void)
+{
+	uint64_t pat;
+
+	pat = PAT_ENTRY(0, MT_WB) | PAT_ENTRY(1, MT_WC)
+		| PAT_ENTRY(2, MT_UCM) | PAT_ENTRY(3, MT_UC)
+		| PAT_ENTRY(4, MT_WB) | PAT_ENTRY(5, MT_WT)
+		| PAT_ENTRY(6, MT_UCM) | PAT_ENTRY(7, MT_UC);
+
+	wrmsr(MSR_PAT, pat);
+	lcr3(rcr3());
+}
@@ -0,0 +1,24 @@
+/*
+ * ALIX: `sys/x64/pat.h` -- x64 Page Attribute Table
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_PAT_H_
+#define _X64_PAT_H_
+
+/*
+ * Page table bits selecting a memory type once `pat_init()` has run.
+ * PAT entries 0, 2 and 3 keep their power-on types.
+ */
+#define PAT_WB		0		/* write-back */
+#define PAT_WC		PTE_PWT		/* write-combining */
+#define PAT_UCM		PTE_PCD		/* uncached, MTRRs may override */
+#define PAT_UC		(PTE_PCD | PTE_PWT)	/* uncached */
+
+void	pat_init(void);
+
+#endif /* _X64_PAT_H_ */
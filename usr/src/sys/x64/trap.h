@@ -0,0 +1,94 @@
+/*
+ * ALIX: `sys/x64/trap.h` -- x64 interrupt and exception dispatch
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _X64_TRAP_H_
+#define _X64_TRAP_H_
+
+#define NVECTOR		256
+
+/* Exception vectors */
+#define T_DE		0	/* Divide error */
+#define T_DB		1	/* Debug */
+#define T_NMI		2	/* Non-maskable interrupt */
+#define T_BP		3	/* Breakpoint (`int3`) */
+#define T_OF		4	/* Overflow */
+#define T_BR		5	/* Bound range exceeded */
+#define T_UD		6	/* Invalid opcode */
+#define T_NM		7	/* Device not available */
+#define T_DF		8	/* Double fault */
+#define T_TS		10	/* Invalid TSS */
+#define T_NP		11	/* Segment not present */
+#define T_SS		12	/* Stack fault */
+#define T_GP		13	/* General protection */
+#define T_PF		14	/* Page fault */
+#define T_MF		16	/* x87 floating point error */
+#define T_AC		17	/* Alignment check */
+#define T_MC		18	/* Machine check */
+#define T_XM		19	/* SIMD floating point exception */
+#define T_VE		20	/* Virtualization exception */
+#define T_CP		21	/* Control protection */
+
+/* Vectors from here on are interrupts, taking the fast path */
+#define T_IRQ		32
+#define T_TLB		0xED	/* Inter-processor, TLB shootdown */
+#define T_RESCHED	0xEE	/* Inter-processor, run queue changed */
+#define T_TIMER		0xEF	/* Local APIC timer */
+#define T_SOFT		0xF0	/* `softint()`, entry/exit measurement */
+#define T_SPURIOUS	0xFF	/* Local APIC spurious interrupts */
+
+/* Page fault error code bits */
+#define PF_P		(1 << 0)	/* Protection violation, else not present */
+#define PF_W		(1 << 1)	/* Write */
+#define PF_U		(1 << 2)	/* User mode */
+#define PF_RSVD		(1 << 3)	/* Reserved bit set in an entry */
+#define PF_I		(1 << 4)	/* Instruction fetch */
+
+/*
+ * Stack at the time the handler runs, built by the entry stubs in `trap.S`.
+ * Exceptions save every register. Interrupts only save the ones the C code
+ * may clobber and leave room for the rest: rbx, rbp and r12-r15 are garbage
+ * there and a handler must not read or change them.
+ */
+struct trapframe {
+
+	uint64_t	r15;		/* Exceptions only */
+	uint64_t	r14;
+	uint64_t	r13;
+	uint64_t	r12;
+	uint64_t	rbp;
+	uint64_t	rbx;
+	uint64_t	r11;		/* Always saved */
+	uint64_t	r10;
+	uint64_t	r9;
+	uint64_t	r8;
+	uint64_t	rdi;
+	uint64_t	rsi;
+	uint64_t	rdx;
+	uint64_t	rcx;
+	uint64_t	rax;
+	uint64_t	vec;
+	uint64_t	err;		/* 0 for vectors without one */
+	uint64_t	rip;		/* Pushed by the processor */
+	uint64_t	cs;
+	uint64_t	rflags;
+	uint64_t	rsp;
+	uint64_t	ss;
+
+};
+
+typedef void (*Traphandler)(struct trapframe *tf);
+
+void		trap_init(void);
+Traphandler	trap_register(int vec, Traphandler handler);
+uint64_t	trap_count(int vec);
+void		trap_stats(void);
+void		softint(void);
+void		breakpoint(void);
+
+#endif /* _X64_TRAP_H_ */
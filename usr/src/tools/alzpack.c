@@ -0,0 +1,254 @@
+/*
+ * ALIX: `tools/alzpack.c` -- Pack a file into an ALZ compressed image
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Host tool, usage: alzpack input output
+ *
+ * Elf executables are split into the extents the bootloader needs (headers
+ * and each loadable segment), anything else is packed as a single extent.
+ * See `alz.h` for the format.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <elf.h>
+#include <alz.h>
+
+#define MINMATCH	4
+#define LASTLITERALS	5	/* last bytes of a block are always literals */
+#define MFLIMIT		12	/* no match may start within the last bytes */
+#define MAXOFF		65535
+#define HASHBITS	16
+
+static void
+die(const char *msg)
+{
+	fprintf(stderr, "alzpack: %s\n", msg);
+	exit(1);
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t
+hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASHBITS);
+}
+
+/* Emit an LZ4 length extension */
+static uint8_t *
+putlen(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+/* Emit one sequence: literals `lit`..`lit + nlit`, then an optional match */
+static uint8_t *
+putseq(uint8_t *op, const uint8_t *lit, size_t nlit, size_t off, size_t mlen)
+{
+	uint8_t *token;
+
+	token = op++;
+	*token = (nlit >= 15 ? 15 : nlit) << 4;
+	if (nlit >= 15)
+		op = putlen(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (mlen == 0)
+		return op;
+
+	*op++ = off & 0xFF;
+	*op++ = off >> 8;
+	mlen -= MINMATCH;
+	*token |= (mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15)
+		op = putlen(op, mlen - 15);
+
+	return op;
+}
+
+/*
+ * Compress `sz` bytes at `src` as a single LZ4 block into `dst`, which must
+ * hold `lz4_bound(sz)` bytes. Greedy single-probe hash matcher, it is not
+ * the best ratio but the decoder in the bootloader does not care.
+ */
+static size_t
+lz4_bound(size_t sz)
+{
+	return sz + (sz / 255) + 16;
+}
+
+static size_t
+lz4_encode(uint8_t *dst, const uint8_t *src, size_t sz)
+{
+	static uint32_t table[1 << HASHBITS];
+	const uint8_t *ip, *anchor, *mlimit, *mend, *ref;
+	uint8_t *op;
+	uint32_t h;
+	size_t len;
+
+	op = dst;
+	ip = anchor = src;
+
+	if (sz > MFLIMIT) {
+		memset(table, 0xFF, sizeof(table));
+		mlimit = src + sz - MFLIMIT;
+		mend = src + sz - LASTLITERALS;
+
+		while (ip < mlimit) {
+			h = hash(read32(ip));
+			ref = (table[h] == 0xFFFFFFFF) ? NULL : src + table[h];
+			table[h] = ip - src;
+
+			if (ref == NULL || ip - ref > MAXOFF
+			|| read32(ref) != read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			len = MINMATCH;
+			while (ip + len < mend && ref[len] == ip[len])
+				len++;
+
+			op = putseq(op, anchor, ip - anchor, ip - ref, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	/* Trailing literals */
+	return putseq(op, anchor, src + sz - anchor, 0, 0) - dst;
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *f;
+	uint8_t *in, *out, *op;
+	size_t insz, outsz;
+	Alz_hdr *hdr;
+	Alz_blk *blk;
+	Elf64_Ehdr *ehdr;
+	Elf64_Phdr *phdrs;
+	uint32_t nblk, i;
+	long l;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: alzpack input output\n");
+		return 1;
+	}
+
+	if ((f = fopen(argv[1], "rb")) == NULL)
+		die("cannot open input");
+	if (fseek(f, 0, SEEK_END) != 0 || (l = ftell(f)) < 0)
+		die("cannot size input");
+	insz = l;
+	rewind(f);
+	if ((in = malloc(insz + 1)) == NULL)
+		die("out of memory");
+	if (fread(in, 1, insz, f) != insz)
+		die("cannot read input");
+	fclose(f);
+
+	if (insz >= sizeof(uint32_t) && read32(in) == ALZ_MAGIC)
+		die("input is already an ALZ image");
+
+	/* Collect extents */
+	ehdr = (Elf64_Ehdr *) in;
+	phdrs = NULL;
+	nblk = 1;
+	if (insz >= sizeof(Elf64_Ehdr) && ehdr->e_ident[EI_MAG0] == ELFMAG0
+	&& ehdr->e_ident[EI_MAG1] == ELFMAG1
+	&& ehdr->e_ident[EI_MAG2] == ELFMAG2
+	&& ehdr->e_ident[EI_MAG3] == ELFMAG3
+	&& ehdr->e_ident[EI_CLASS] == ELFCLASS64) {
+		if (ehdr->e_phentsize != sizeof(Elf64_Phdr)
+		|| ehdr->e_phoff + (uint64_t) ehdr->e_phnum
+				* sizeof(Elf64_Phdr) > insz)
+			die("malformed Elf program headers");
+		phdrs = (Elf64_Phdr *) (in + ehdr->e_phoff);
+		for (i = 0; i < ehdr->e_phnum; i++) {
+			if (phdrs[i].p_type == PT_LOAD
+			&& phdrs[i].p_filesz != 0) {
+				if (phdrs[i].p_offset + phdrs[i].p_filesz > insz)
+					die("malformed Elf segment");
+				nblk++;
+			}
+		}
+	}
+
+	hdr = calloc(1, sizeof(Alz_hdr) + nblk * sizeof(Alz_blk));
+	if (hdr == NULL)
+		die("out of memory");
+	hdr->magic = ALZ_MAGIC;
+	hdr->nblk = nblk;
+	hdr->rawsz = insz;
+	blk = (Alz_blk *) (hdr + 1);
+
+	if (phdrs == NULL) {
+		blk[0].off = 0;
+		blk[0].rawsz = insz;
+	} else {
+		blk[0].off = 0;
+		blk[0].rawsz = ehdr->e_phoff
+			+ (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr);
+		if (blk[0].rawsz < sizeof(Elf64_Ehdr))
+			blk[0].rawsz = sizeof(Elf64_Ehdr);
+
+		nblk = 1;
+		for (i = 0; i < ehdr->e_phnum; i++) {
+			if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_filesz == 0)
+				continue;
+			blk[nblk].off = phdrs[i].p_offset;
+			blk[nblk].rawsz = phdrs[i].p_filesz;
+			nblk++;
+		}
+	}
+
+	/* Compress each extent after the header and extent table */
+	outsz = sizeof(Alz_hdr) + hdr->nblk * sizeof(Alz_blk);
+	for (i = 0; i < hdr->nblk; i++)
+		outsz += lz4_bound(blk[i].rawsz);
+	if ((out = malloc(outsz)) == NULL)
+		die("out of memory");
+
+	op = out + sizeof(Alz_hdr) + hdr->nblk * sizeof(Alz_blk);
+	for (i = 0; i < hdr->nblk; i++) {
+		blk[i].zoff = op - out;
+		blk[i].zsz = lz4_encode(op, in + blk[i].off, blk[i].rawsz);
+		op += blk[i].zsz;
+	}
+	memcpy(out, hdr, sizeof(Alz_hdr) + hdr->nblk * sizeof(Alz_blk));
+	outsz = op - out;
+
+	if ((f = fopen(argv[2], "wb")) == NULL)
+		die("cannot open output");
+	if (fwrite(out, 1, outsz, f) != outsz || fclose(f) != 0)
+		die("cannot write output");
+
+	printf("alzpack: %s: %zu -> %zu bytes, %u extents\n", argv[1], insz,
+			outsz, hdr->nblk);
+
+	return 0;
+}
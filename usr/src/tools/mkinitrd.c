@@ -0,0 +1,136 @@
+/*
+ * ALIX: `tools/mkinitrd.c` -- Build an initial ramdisk archive
+ * Copyright (c) 2023 Alan Potteiger
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Host tool, usage: mkinitrd output [file ...]
+ *
+ * Files are stored under the path given on the command line with any
+ * leading "./" removed. See `initrd.h` for the format.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <initrd.h>
+
+static void
+die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "mkinitrd: %s%s%s\n", msg, arg ? ": " : "",
+			arg ? arg : "");
+	exit(1);
+}
+
+static int
+entcmp(const void *a, const void *b)
+{
+	return strcmp(((const Initrd_ent *) a)->name,
+			((const Initrd_ent *) b)->name);
+}
+
+static uint64_t
+align(uint64_t v)
+{
+	return (v + INITRD_ALIGN - 1) & ~((uint64_t) INITRD_ALIGN - 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *in, *out;
+	Initrd_hdr hdr;
+	Initrd_ent *ents;
+	char **paths;
+	const char *name;
+	uint64_t off;
+	uint32_t i;
+	long l;
+	int ch;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: mkinitrd output [file ...]\n");
+		return 1;
+	}
+
+	hdr.magic = INITRD_MAGIC;
+	hdr.nent = argc - 2;
+	ents = calloc(hdr.nent + 1, sizeof(Initrd_ent));
+	paths = calloc(hdr.nent + 1, sizeof(char *));
+	if (ents == NULL || paths == NULL)
+		die("out of memory", NULL);
+
+	/* Build and sort the index, sizes first */
+	for (i = 0; i < hdr.nent; i++) {
+		name = argv[i + 2];
+		while (strncmp(name, "./", 2) == 0)
+			name += 2;
+		if (strlen(name) >= INITRD_NAMESZ)
+			die("name too long", name);
+		strcpy(ents[i].name, name);
+
+		if ((in = fopen(argv[i + 2], "rb")) == NULL)
+			die("cannot open", argv[i + 2]);
+		if (fseek(in, 0, SEEK_END) != 0 || (l = ftell(in)) < 0)
+			die("cannot size", argv[i + 2]);
+		fclose(in);
+		ents[i].size = l;
+		/* Stash the source path behind the name to find it again */
+		ents[i].off = i;
+	}
+	qsort(ents, hdr.nent, sizeof(Initrd_ent), entcmp);
+
+	for (i = 0; i < hdr.nent; i++) {
+		paths[i] = argv[ents[i].off + 2];
+		if (i > 0 && strcmp(ents[i - 1].name, ents[i].name) == 0)
+			die("duplicate name", ents[i].name);
+	}
+
+	/* Lay out data after the index */
+	off = align(sizeof(Initrd_hdr) + hdr.nent * sizeof(Initrd_ent));
+	for (i = 0; i < hdr.nent; i++) {
+		ents[i].off = off;
+		off = align(off + ents[i].size);
+	}
+	hdr.size = off;
+
+	if ((out = fopen(argv[1], "wb")) == NULL)
+		die("cannot open", argv[1]);
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+	|| (hdr.nent > 0
+	&& fwrite(ents, sizeof(Initrd_ent), hdr.nent, out) != hdr.nent))
+		die("cannot write", argv[1]);
+
+	for (i = 0; i < hdr.nent; i++) {
+		if (fseek(out, ents[i].off, SEEK_SET) != 0)
+			die("cannot write", argv[1]);
+		if ((in = fopen(paths[i], "rb")) == NULL)
+			die("cannot open", paths[i]);
+		while ((ch = getc(in)) != EOF)
+			putc(ch, out);
+		fclose(in);
+	}
+
+	/* Pad out the tail so the archive is `hdr.size` long */
+	if ((l = ftell(out)) < 0)
+		die("cannot write", argv[1]);
+	if ((uint64_t) l < hdr.size && (fseek(out, hdr.size - 1, SEEK_SET) != 0
+	|| putc(0, out) == EOF))
+		die("cannot write", argv[1]);
+	if (fclose(out) != 0)
+		die("cannot write", argv[1]);
+
+	for (i = 0; i < hdr.nent; i++)
+		printf("mkinitrd: %s %lu bytes\n", ents[i].name,
+				(unsigned long) ents[i].size);
+
+	return 0;
+}